@@ -0,0 +1,166 @@
+// -*- C++ -*-
+
+// Compare the timing wheel that holds the callbacks scheduled with
+// MIDI.at() with the priority queue of heap allocated entries that it
+// replaced, with 100000 callbacks pending.  The callbacks are
+// scheduled at random times within a minute, a tenth of them is
+// cancelled, and time is then advanced millisecond by millisecond as
+// the Porttime thread does, expiring the due callbacks.  The priority
+// queue cannot remove entries, cancelled entries are marked and
+// skipped when they expire.
+//
+// Reported are the time per schedule and per cancellation, and the
+// distribution of the time taken per millisecond tick, which is the
+// time that the Porttime thread spends on timed callbacks.
+
+#include <iostream>
+#include <iomanip>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "timingwheel.h"
+
+using namespace std;
+
+struct Callback {
+  uint32_t id;
+  bool cancelled;
+};
+
+static uint64_t
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Entry {
+  uint32_t when;
+  Callback* callback;
+  bool operator<(const Entry& other) const { return when > other.when; }
+};
+
+class HeapScheduler
+{
+public:
+  void schedule(uint32_t when, uint32_t id)
+  {
+    Callback* callback = new Callback;
+    callback->id = id;
+    callback->cancelled = false;
+    _byId.push_back(callback);
+    Entry entry = { when, callback };
+    _queue.push(entry);
+  }
+
+  void cancel(uint32_t id) { _byId[id - 1]->cancelled = true; }
+
+  size_t expire(uint32_t time)
+  {
+    size_t count = 0;
+    while (!_queue.empty() && _queue.top().when <= time) {
+      Callback* callback = _queue.top().callback;
+      _queue.pop();
+      count += !callback->cancelled;
+      delete callback;
+    }
+    return count;
+  }
+
+private:
+  priority_queue<Entry> _queue;
+  vector<Callback*> _byId;
+};
+
+class WheelScheduler
+{
+public:
+  WheelScheduler() : _wheel(0) {}
+
+  void schedule(uint32_t when, uint32_t id)
+  {
+    Callback callback = { id, false };
+    _wheel.insert(when, callback, id);
+  }
+
+  void cancel(uint32_t id) { _wheel.cancel(id, Ignore()); }
+
+  size_t expire(uint32_t time)
+  {
+    _count = 0;
+    _wheel.expire(time, Count(_count));
+    return _count;
+  }
+
+private:
+  struct Ignore { void operator()(const Callback&) const {} };
+  struct Count {
+    Count(size_t& count) : count(count) {}
+    size_t& count;
+    void operator()(uint32_t, const Callback&) const { count++; }
+  };
+  timingwheel<Callback> _wheel;
+  size_t _count;
+};
+
+template <class Scheduler>
+static void
+runBenchmark(const char* name, const vector<uint32_t>& times, uint32_t duration)
+{
+  Scheduler scheduler;
+
+  uint64_t start = now();
+  for (size_t i = 0; i < times.size(); i++) {
+    scheduler.schedule(times[i], i + 1);
+  }
+  const uint64_t scheduleTime = now() - start;
+
+  start = now();
+  for (size_t i = 0; i < times.size(); i += 10) {
+    scheduler.cancel(i + 1);
+  }
+  const uint64_t cancelTime = now() - start;
+
+  vector<uint64_t> tickTimes;
+  size_t called = 0;
+  for (uint32_t t = 1; t <= duration; t++) {
+    start = now();
+    called += scheduler.expire(t);
+    tickTimes.push_back(now() - start);
+  }
+  sort(tickTimes.begin(), tickTimes.end());
+
+  cout << setw(6) << name
+       << "  schedule " << setw(6) << fixed << setprecision(1) << (double) scheduleTime / times.size() << " ns"
+       << "  cancel " << setw(6) << (double) cancelTime / (times.size() / 10) << " ns"
+       << "  tick ns p50 " << setw(6) << tickTimes[tickTimes.size() / 2]
+       << " p99 " << setw(7) << tickTimes[tickTimes.size() * 99 / 100]
+       << " max " << setw(8) << tickTimes.back()
+       << "  called " << called
+       << endl;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t count = (argc > 1) ? atoi(argv[1]) : 100000;
+  const uint32_t duration = 60000;
+
+  vector<uint32_t> times(count);
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    times[i] = 1 + rand() % duration;
+  }
+
+  cout << count << " callbacks pending over " << duration / 1000 << " seconds" << endl;
+  runBenchmark<HeapScheduler>("heap", times, duration);
+  runBenchmark<WheelScheduler>("wheel", times, duration);
+
+  return 0;
+}
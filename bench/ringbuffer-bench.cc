@@ -0,0 +1,209 @@
+// -*- C++ -*-
+
+// Compare the lock-free ring buffer used between the MIDI reader
+// thread and the JavaScript thread with the mutex protected
+// std::queue that it replaced.
+//
+// The producer pushes events at a fixed rate, like the reader thread
+// does for a busy input.  The consumer drains in batches and holds
+// the queue for a configurable amount of time per batch to simulate
+// the JavaScript thread building its callback arguments.  Reported
+// are the producer throughput when pushing without pause and the
+// distribution of the time the producer spends in each push, which
+// is the time that the reader thread would be blocked.  Run it on a
+// machine with at least two cores, otherwise the threads merely take
+// turns and the lock is rarely contended.
+
+#include <exception>
+#include <iostream>
+#include <iomanip>
+#include <queue>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mutex.h"
+#include "ringbuffer.h"
+
+using namespace std;
+
+struct Event {
+  int32_t message;
+  int32_t timestamp;
+};
+
+static uint64_t
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+spin(uint64_t nanoseconds)
+{
+  uint64_t end = now() + nanoseconds;
+  while (now() < end)
+    ;
+}
+
+// //////////////////////////////////////////////////////////////////
+// The two queue implementations, with the same interface
+// //////////////////////////////////////////////////////////////////
+
+enum { QUEUE_SIZE = 16384 };
+
+class LockedQueue
+{
+public:
+  bool push(const Event& event)
+  {
+    unique_lock<mutex> lock(_mutex);
+    _queue.push(event);
+    return true;
+  }
+
+  // Drain all queued events while holding the lock for drainTime
+  // nanoseconds, like MIDIInput::readResultsToJSCallbackArguments did.
+  size_t drain(uint64_t drainTime)
+  {
+    unique_lock<mutex> lock(_mutex);
+    size_t count = _queue.size();
+    while (!_queue.empty()) {
+      _queue.pop();
+    }
+    if (count) {
+      spin(drainTime);
+    }
+    return count;
+  }
+
+private:
+  mutex _mutex;
+  queue<Event> _queue;
+};
+
+class RingQueue
+{
+public:
+  bool push(const Event& event) { return _ring.push(event); }
+
+  size_t drain(uint64_t drainTime)
+  {
+    size_t count = 0;
+    Event event;
+    while (_ring.pop(event)) {
+      count++;
+    }
+    if (count) {
+      spin(drainTime);
+    }
+    return count;
+  }
+
+private:
+  ringbuffer<Event, QUEUE_SIZE> _ring;
+};
+
+// //////////////////////////////////////////////////////////////////
+// Benchmark driver
+// //////////////////////////////////////////////////////////////////
+
+template <class Q>
+struct Run {
+  Q queue;
+  size_t events;
+  uint64_t interval;                            // between pushes, ns
+  uint64_t drainTime;                           // per batch, ns
+  volatile bool done;
+  size_t consumed;
+  size_t dropped;
+  vector<uint64_t> pushTimes;
+};
+
+template <class Q>
+static void*
+consumer(void* arg)
+{
+  Run<Q>* run = static_cast<Run<Q>*>(arg);
+  while (!run->done || run->consumed + run->dropped < run->events) {
+    size_t count = run->queue.drain(run->drainTime);
+    run->consumed += count;
+    if (!count) {
+      if (run->done && run->consumed + run->dropped >= run->events) {
+        break;
+      }
+      spin(1000);
+    }
+  }
+  return 0;
+}
+
+template <class Q>
+static void
+runBenchmark(const char* name, size_t events, uint64_t interval, uint64_t drainTime)
+{
+  Run<Q>* run = new Run<Q>;
+  run->events = events;
+  run->interval = interval;
+  run->drainTime = drainTime;
+  run->done = false;
+  run->consumed = 0;
+  run->dropped = 0;
+  run->pushTimes.reserve(events);
+
+  pthread_t thread;
+  pthread_create(&thread, 0, consumer<Q>, run);
+
+  uint64_t start = now();
+  uint64_t next = start;
+  for (size_t i = 0; i < events; i++) {
+    if (interval) {
+      next += interval;
+      while (now() < next)
+        ;
+    }
+    Event event = { (int32_t) i, (int32_t) i };
+    uint64_t before = now();
+    if (!run->queue.push(event)) {
+      run->dropped++;
+    }
+    run->pushTimes.push_back(now() - before);
+  }
+  uint64_t elapsed = now() - start;
+  run->done = true;
+  pthread_join(thread, 0);
+
+  vector<uint64_t>& t = run->pushTimes;
+  sort(t.begin(), t.end());
+  cout << setw(8) << name
+       << setw(12) << fixed << setprecision(1) << (events / (elapsed / 1e9) / 1e6) << " Mev/s"
+       << "  push ns p50 " << setw(6) << t[t.size() / 2]
+       << " p99 " << setw(7) << t[t.size() * 99 / 100]
+       << " p99.9 " << setw(8) << t[t.size() * 999 / 1000]
+       << " max " << setw(9) << t.back()
+       << "  dropped " << run->dropped
+       << endl;
+  delete run;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t events = (argc > 1) ? atoi(argv[1]) : 2000000;
+
+  cout << "throughput, producer pushing without pause" << endl;
+  runBenchmark<LockedQueue>("queue", events, 0, 0);
+  runBenchmark<RingQueue>("ring", events, 0, 0);
+
+  cout << endl << "tail latency, one event every 10us, consumer holding each batch 200us" << endl;
+  runBenchmark<LockedQueue>("queue", events / 20, 10000, 200000);
+  runBenchmark<RingQueue>("ring", events / 20, 10000, 200000);
+
+  return 0;
+}
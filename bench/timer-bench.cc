@@ -0,0 +1,141 @@
+// -*- C++ -*-
+
+// Compare the wakeup lateness of the timer thread with that of
+// porttime's periodic callback thread that it replaced.  Porttime
+// sleeps with select() for the time remaining until the next
+// millisecond as measured by its millisecond clock.  The timer thread
+// waits on a condition variable until absolute CLOCK_MONOTONIC
+// deadlines, so that it can be woken early when something is
+// scheduled.
+//
+// Each variant ticks every millisecond for a few seconds, with an
+// optional load thread per CPU to show how the variants hold up
+// under load.  Reported is the distribution of the lateness of each
+// tick relative to its exact deadline, in microseconds.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/time.h>
+
+#include "mutex.h"
+#include "histogram.h"
+
+using namespace std;
+
+static int64_t
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t
+milliseconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static volatile bool loadRunning = true;
+
+static void*
+load(void*)
+{
+  volatile uint64_t counter = 0;
+  while (loadRunning) {
+    counter++;
+  }
+  return 0;
+}
+
+// Porttime's callback loop, ticks are expected at whole milliseconds
+// of its clock
+static void
+runPorttime(histogram& lateness, int ticks)
+{
+  const int64_t start = milliseconds();
+  const int64_t startNanoseconds = now();
+  for (int tick = 1; tick <= ticks; tick++) {
+    const int64_t delay = start + tick - milliseconds();
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = (delay > 0) ? delay * 1000 : 0;
+    select(0, 0, 0, 0, &timeout);
+    const int64_t late = now() - (startNanoseconds + tick * 1000000LL);
+    lateness.record(late > 0 ? late / 1000 : 0);
+  }
+}
+
+static void
+runTimer(histogram& lateness, int ticks)
+{
+  mutex m;
+  monotonic_condition_variable condition;
+  unique_lock<mutex> lock(m);
+  const int64_t start = now();
+  for (int tick = 1; tick <= ticks; tick++) {
+    const int64_t deadline = start + tick * 1000000LL;
+    struct timespec until;
+    until.tv_sec = deadline / 1000000000;
+    until.tv_nsec = deadline % 1000000000;
+    while (condition.wait_until(lock, until))
+      ;
+    const int64_t late = now() - deadline;
+    lateness.record(late > 0 ? late / 1000 : 0);
+  }
+}
+
+static void
+report(const char* name, const histogram& lateness)
+{
+  cout << setw(9) << name
+       << "  late us mean " << setw(7) << fixed << setprecision(1) << lateness.mean()
+       << " p50 " << setw(5) << lateness.percentile(0.5)
+       << " p99 " << setw(6) << lateness.percentile(0.99)
+       << " p99.9 " << setw(6) << lateness.percentile(0.999)
+       << " max " << setw(6) << lateness.max()
+       << endl;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const int ticks = (argc > 1) ? atoi(argv[1]) : 5000;
+  const bool loaded = argc > 2 && atoi(argv[2]);
+
+  vector<pthread_t> loadThreads;
+  if (loaded) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < cpus; i++) {
+      pthread_t thread;
+      pthread_create(&thread, 0, load, 0);
+      loadThreads.push_back(thread);
+    }
+  }
+
+  cout << ticks << " ticks of 1 ms" << (loaded ? " with a load thread per CPU" : "") << endl;
+
+  histogram porttime;
+  runPorttime(porttime, ticks);
+  report("porttime", porttime);
+
+  histogram timer;
+  runTimer(timer, ticks);
+  report("timer", timer);
+
+  loadRunning = false;
+  for (size_t i = 0; i < loadThreads.size(); i++) {
+    pthread_join(loadThreads[i], 0);
+  }
+
+  return 0;
+}
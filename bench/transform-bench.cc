@@ -0,0 +1,166 @@
+// -*- C++ -*-
+
+// Measure the throughput of the transform kernels that implement
+// MIDI.transform(), for a program that filters, transposes, remaps
+// the channel and applies a velocity curve, compared to a
+// straightforward loop that does the same per message with branches,
+// like the JavaScript code it replaces.  The results of both are
+// compared.
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "transform.h"
+
+using namespace std;
+
+enum { RECORD_SIZE = 16, STATUS = 4 };
+
+static uint64_t
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+generate(vector<unsigned char>& buffer, size_t count)
+{
+  static const unsigned char statuses[] = { 0x80, 0x90, 0x90, 0xa0, 0xb0, 0xe0 };
+  buffer.assign(count * RECORD_SIZE, 0);
+  srand(1);
+  for (size_t i = 0; i < count; i++) {
+    unsigned char* record = &buffer[i * RECORD_SIZE];
+    record[0] = i;
+    record[1] = i >> 8;
+    record[STATUS] = statuses[rand() % 6] | (rand() % 4);
+    record[STATUS + 1] = rand() % 128;
+    record[STATUS + 2] = rand() % 128;
+  }
+}
+
+static unsigned char velocityCurve[128];
+
+static transformprogram
+compile()
+{
+  transformprogram program;
+
+  // Keep notes on channels 1 and 2
+  transformprogram::operation filter = transformprogram::identity();
+  filter.filter = true;
+  memset(filter.statuses, 0, sizeof filter.statuses);
+  filter.statuses[0x80] = filter.statuses[0x81] = filter.statuses[0x90] = filter.statuses[0x91] = 1;
+  program.add(filter);
+
+  // Transpose channel 2 down an octave
+  transformprogram::operation transpose = transformprogram::identity();
+  memset(transpose.statuses, 0, sizeof transpose.statuses);
+  transpose.statuses[0x81] = transpose.statuses[0x91] = 1;
+  for (int key = 0; key < 128; key++) {
+    transpose.table[key] = (key < 12) ? (int) transformprogram::DROP : key - 12;
+  }
+  program.add(transpose);
+
+  // Everything to channel 3
+  transformprogram::operation channel = transformprogram::identity(transformprogram::STATUS);
+  for (int status = 0x80; status < 0xf0; status++) {
+    channel.table[status] = (status & 0xf0) | 2;
+  }
+  program.add(channel);
+
+  // Velocity curve
+  transformprogram::operation velocity = transformprogram::identity(transformprogram::DATA2);
+  memset(velocity.statuses, 0, sizeof velocity.statuses);
+  for (int status = 0x90; status < 0xa0; status++) {
+    velocity.statuses[status] = 1;
+  }
+  for (int value = 0; value < 128; value++) {
+    velocityCurve[value] = value ? max(1, (int) floor(127 * pow(value / 127.0, 1.5) + 0.5)) : 0;
+    velocity.table[value] = velocityCurve[value];
+  }
+  program.add(velocity);
+
+  return program;
+}
+
+static size_t
+reference(unsigned char* records, size_t count)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    unsigned char* record = records + i * RECORD_SIZE;
+    unsigned char status = record[STATUS];
+    int key = record[STATUS + 1];
+    int velocity = record[STATUS + 2];
+    const int type = status & 0xf0;
+    const int channel = status & 0x0f;
+    if ((type != 0x80 && type != 0x90) || channel > 1) {
+      continue;
+    }
+    if (channel == 1) {
+      key -= 12;
+      if (key < 0) {
+        continue;
+      }
+    }
+    if (type == 0x90) {
+      velocity = velocityCurve[velocity];
+    }
+    unsigned char* out = records + kept++ * RECORD_SIZE;
+    memmove(out, record, RECORD_SIZE);
+    out[STATUS] = type | 2;
+    out[STATUS + 1] = key;
+    out[STATUS + 2] = velocity;
+  }
+  return kept;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t count = (argc > 1) ? atoi(argv[1]) : 4000000;
+  const int rounds = 10;
+  const transformprogram program = compile();
+
+  vector<unsigned char> input;
+  generate(input, count);
+  vector<unsigned char> kernels(input);
+  vector<unsigned char> loop(input);
+
+  uint64_t kernelTime = 0;
+  uint64_t loopTime = 0;
+  size_t kernelKept = 0;
+  size_t loopKept = 0;
+  for (int round = 0; round < rounds; round++) {
+    kernels = input;
+    uint64_t start = now();
+    kernelKept = program.run(&kernels[0], count, RECORD_SIZE, STATUS);
+    kernelTime += now() - start;
+
+    loop = input;
+    start = now();
+    loopKept = reference(&loop[0], count);
+    loopTime += now() - start;
+  }
+
+  const bool same = (kernelKept == loopKept)
+    && memcmp(&kernels[0], &loop[0], kernelKept * RECORD_SIZE) == 0;
+
+  cout << count << " events, " << kernelKept << " kept" << endl
+       << setw(8) << "kernels" << setw(10) << fixed << setprecision(1)
+       << (count * rounds / (kernelTime / 1e9) / 1e6) << " Mev/s" << endl
+       << setw(8) << "loop" << setw(10) << fixed << setprecision(1)
+       << (count * rounds / (loopTime / 1e9) / 1e6) << " Mev/s" << endl
+       << (same ? "results match" : "RESULTS DIFFER") << endl;
+
+  return same ? 0 : 1;
+}
@@ -0,0 +1,233 @@
+// -*- C++ -*-
+
+// Compare the two ways in which the MIDI reader thread can learn about
+// received data: The Porttime thread polling every millisecond and
+// signalling the reader thread through a condition variable, and the
+// reader thread blocking in poll() on a file descriptor that the
+// kernel makes readable when data arrives, as it does with the ALSA
+// sequencer on Linux.  A pipe stands in for the sequencer descriptor.
+//
+// Reported are the CPU time that the process uses per second while no
+// data arrives and the latency from the arrival of a message until
+// the reader thread has woken up, for messages arriving at random
+// intervals.
+
+#include <exception>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "mutex.h"
+
+using namespace std;
+
+static uint64_t
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleepFor(uint64_t nanoseconds)
+{
+  struct timespec ts;
+  ts.tv_sec = nanoseconds / 1000000000;
+  ts.tv_nsec = nanoseconds % 1000000000;
+  while (nanosleep(&ts, &ts) && errno == EINTR)
+    ;
+}
+
+static uint64_t
+cpuTime()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return ((uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000
+          + (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000);
+}
+
+// //////////////////////////////////////////////////////////////////
+// The two wakeup implementations.  send() is called by the producer
+// when a message arrives, the reader thread calls receive() which
+// returns the arrival time of the message.
+// //////////////////////////////////////////////////////////////////
+
+class PollingWakeup
+{
+public:
+  PollingWakeup()
+    : _arrival(0),
+      _readPending(false),
+      _stop(false)
+  {
+    pthread_create(&_ticker, 0, tick, this);
+  }
+
+  ~PollingWakeup()
+  {
+    _stop = true;
+    pthread_join(_ticker, 0);
+  }
+
+  // The message is queued by the driver, to be found by the next poll
+  void send(uint64_t arrival)
+  {
+    __sync_synchronize();
+    _arrival = arrival;
+  }
+
+  uint64_t receive()
+  {
+    unique_lock<mutex> lock(_mutex);
+    while (!_readPending) {
+      _condition.wait(lock);
+    }
+    _readPending = false;
+    uint64_t arrival = _arrival;
+    _arrival = 0;
+    return arrival;
+  }
+
+private:
+  volatile uint64_t _arrival;
+  mutex _mutex;
+  condition_variable _condition;
+  bool _readPending;
+  volatile bool _stop;
+  pthread_t _ticker;
+
+  // Like Porttime::pollAll, every millisecond
+  static void* tick(void* arg)
+  {
+    PollingWakeup* self = static_cast<PollingWakeup*>(arg);
+    while (!self->_stop) {
+      sleepFor(1000000);
+      unique_lock<mutex> lock(self->_mutex);
+      if (self->_arrival) {
+        self->_readPending = true;
+        self->_condition.notify_one();
+      }
+    }
+    return 0;
+  }
+};
+
+class BlockingWakeup
+{
+public:
+  BlockingWakeup()
+  {
+    if (pipe(_pipe)) {
+      throw pthread_exception("pipe failed");
+    }
+  }
+
+  ~BlockingWakeup()
+  {
+    close(_pipe[0]);
+    close(_pipe[1]);
+  }
+
+  void send(uint64_t arrival)
+  {
+    if (write(_pipe[1], &arrival, sizeof arrival) != sizeof arrival) {
+      throw pthread_exception("write failed");
+    }
+  }
+
+  uint64_t receive()
+  {
+    pollfd fd;
+    fd.fd = _pipe[0];
+    fd.events = POLLIN;
+    while (poll(&fd, 1, -1) < 0 && errno == EINTR)
+      ;
+    uint64_t arrival;
+    if (read(_pipe[0], &arrival, sizeof arrival) != sizeof arrival) {
+      throw pthread_exception("read failed");
+    }
+    return arrival;
+  }
+
+private:
+  int _pipe[2];
+};
+
+// //////////////////////////////////////////////////////////////////
+// Benchmark driver
+// //////////////////////////////////////////////////////////////////
+
+template <class W>
+struct Run {
+  W wakeup;
+  size_t messages;
+  vector<uint64_t> latencies;
+};
+
+template <class W>
+static void*
+reader(void* arg)
+{
+  Run<W>* run = static_cast<Run<W>*>(arg);
+  for (size_t i = 0; i < run->messages; i++) {
+    uint64_t arrival = run->wakeup.receive();
+    run->latencies.push_back(now() - arrival);
+  }
+  return 0;
+}
+
+template <class W>
+static void
+runBenchmark(const char* name, size_t messages, uint64_t idleTime)
+{
+  Run<W>* run = new Run<W>;
+  run->messages = messages;
+  run->latencies.reserve(messages);
+
+  pthread_t thread;
+  pthread_create(&thread, 0, reader<W>, run);
+
+  uint64_t cpuBefore = cpuTime();
+  sleepFor(idleTime);
+  uint64_t idleCpu = cpuTime() - cpuBefore;
+
+  for (size_t i = 0; i < messages; i++) {
+    sleepFor(2000000 + rand() % 3000000);
+    run->wakeup.send(now());
+  }
+  pthread_join(thread, 0);
+
+  vector<uint64_t>& t = run->latencies;
+  sort(t.begin(), t.end());
+  cout << setw(9) << name
+       << "  idle cpu " << setw(7) << fixed << setprecision(1) << (idleCpu / 1e3 / (idleTime / 1e9)) << " us/s"
+       << "  wake latency us p50 " << setw(7) << setprecision(1) << (t[t.size() / 2] / 1e3)
+       << " p99 " << setw(7) << (t[t.size() * 99 / 100] / 1e3)
+       << " max " << setw(7) << (t.back() / 1e3)
+       << endl;
+  delete run;
+}
+
+int
+main(int argc, char* argv[])
+{
+  const size_t messages = (argc > 1) ? atoi(argv[1]) : 500;
+  const uint64_t idleTime = 2000000000;
+
+  runBenchmark<PollingWakeup>("polling", messages, idleTime);
+  runBenchmark<BlockingWakeup>("blocking", messages, idleTime);
+
+  return 0;
+}
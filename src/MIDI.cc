@@ -27,20 +27,37 @@
 #include <iomanip>
 #include <sstream>
 #include <set>
-#include <queue>
 #include <vector>
+#include <deque>
+#include <algorithm>
 
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
 
 #include <v8.h>
 #include <node.h>
 #include <node_events.h>
+#include <node_buffer.h>
 
 #include <portmidi.h>
 #include <pmutil.h>
 #include <porttime.h>
+#include <pminternal.h>
 
 #include "mutex.h"
+#include "ringbuffer.h"
+#include "sysexarena.h"
+#include "alsawakeup.h"
+#include "timingwheel.h"
+#include "smf.h"
+#include "journal.h"
+#include "transform.h"
+#include "histogram.h"
+#include "trace.h"
 
 using namespace std;
 using namespace v8;
@@ -100,39 +117,159 @@ PortMidiJSException::message() const
 }
 
 // //////////////////////////////////////////////////////////////////
-// Class to handle starting and stopping the porttime timer thread as
-// needed
+// Time base and timer thread.  All times are taken from the
+// CLOCK_MONOTONIC clock, counted from the start of the timer thread.
+// Internally, and for portmidi, which gets time() as its time proc,
+// times are 32 bit milliseconds that wrap after about 24 days.  The
+// 64 bit microseconds of the same clock are used to present times to
+// JavaScript in the high resolution time base, see MIDI::timeValue().
+//
+// Everything that needs to happen at a given time is done by the
+// timer thread, which is still called the Porttime thread.  It sleeps
+// until absolute deadlines of the monotonic clock, so that it does not
+// drift.
+// Each pass polls the inputs that cannot be waited for, ticks the
+// clients, releases due messages and runs due timed callbacks.  The
+// thread then sleeps until the next millisecond while inputs are
+// polled or clients are active, and otherwise until the earliest
+// entry in any of the schedulers is due.  Code that schedules
+// something earlier than that wakes it through schedule().
+//
+// The lateness of the wakeups and the overruns of passes that ended
+// after the next deadline are recorded in histograms, in microseconds.
 // //////////////////////////////////////////////////////////////////
 
 class Porttime
 {
 public:
-  static void stop()
+  static void stop();
+  static void start() throw(JSException);
+
+  // Microseconds since the start
+  static int64_t microseconds() { return (monotonicNanoseconds() - _epoch) / 1000; }
+
+  // Microseconds from since until now, for statistics
+  static uint32_t elapsed(int64_t since) { return (uint32_t) max((int64_t) 0, microseconds() - since); }
+
+  // Milliseconds since the start in portmidi's 32 bit time base
+  static PmTimestamp time() { return (PmTimestamp) (microseconds() / 1000); }
+  static PmTimestamp portmidiTime(void* timeInfo) { return time(); }
+
+  // Conversions between the two time bases.  expand() returns the
+  // microseconds of the millisecond time closest to the current time,
+  // so that it is correct across wraps of the millisecond time.
+  static int64_t expand(PmTimestamp time);
+  static PmTimestamp truncate(int64_t microseconds) { return (PmTimestamp) floorDivide(microseconds, 1000); }
+
+  // Compare millisecond times across wraps
+  static bool before(PmTimestamp a, PmTimestamp b) { return (int32_t) ((uint32_t) a - (uint32_t) b) < 0; }
+  static PmTimestamp earliest(PmTimestamp a, PmTimestamp b) { return before(a, b) ? a : b; }
+  static PmTimestamp latest(PmTimestamp a, PmTimestamp b) { return before(a, b) ? b : a; }
+
+  // Make sure that the timer thread runs a pass at time when.  May be
+  // called from any thread, also with other locks held, as the timer
+  // thread does not take any other lock while it holds _mutex.
+  static void schedule(PmTimestamp when);
+
+  // Scheduling class and CPU affinity of the timer thread.  A priority
+  // above 0 selects SCHED_FIFO, 0 the default scheduling class.
+  static void setPriority(int priority) throw(JSException);
+  static void setAffinity(const vector<int>& cpus) throw(JSException);
+
+  static histogram jitter;                      // wakeup lateness
+  static histogram overruns;                    // passes ending late
+  static volatile uint64_t passes;
+  static volatile uint64_t earlyWakeups;        // passes run early for schedule()
+
+  // Objects that need to be called on every tick of the Porttime
+  // thread.  tick() is called in the Porttime thread with the time in
+  // microseconds, which does not wrap.  Clients keep their time
+  // origins in microseconds as well and only truncate the times of
+  // the messages that they send.
+  class Client
   {
-    if (_running) {
-      Pt_Stop();
-      _running = false;
+  public:
+    virtual ~Client() {}
+    virtual void tick(int64_t microseconds) = 0;
+  };
+
+  static void addClient(Client* client)
+  {
+    {
+      unique_lock<mutex> lock(_clientsMutex);
+      _clients.insert(client);
     }
+    schedule(time());
   }
 
-  static void start()
+  static void removeClient(Client* client)
   {
-    unique_lock<mutex> lock(_mutex);
-
-    if (!_running) {
-      Pt_Start(1, pollAll, 0);
-      _running = true;
-    }
+    unique_lock<mutex> lock(_clientsMutex);
+    _clients.erase(client);
   }
 
 private:
+  // Upper limit for the sleep time
+  enum { MAXIMUM_SLEEP = 250 };
+
   static mutex _mutex;
+  static monotonic_condition_variable _condition;
   static bool _running;
-  static void pollAll(PtTimestamp timestamp, void* userData);
+  static bool _stopping;
+  static pthread_t _thread;
+
+  // State of the sleeping timer thread, protected by _mutex
+  static bool _sleeping;
+  static PmTimestamp _deadline;
+  static bool _wakeRequested;
+  static PmTimestamp _wakeTime;
+
+  // Monotonic time of the start, in nanoseconds
+  static int64_t _epoch;
+
+  static int64_t monotonicNanoseconds();
+  static int64_t nanosecondsAt(PmTimestamp time) { return _epoch + expand(time) * 1000; }
+  static int64_t floorDivide(int64_t value, int64_t divisor)
+  {
+    return (value >= 0) ? value / divisor : -((-value + divisor - 1) / divisor);
+  }
+
+  static void* timerThread(void* arg);
+  static bool pollAll(int64_t microseconds);
+  static PmTimestamp nextDeadline(PmTimestamp now, bool periodic);
+
+  static set<Client*> _clients;
+  static mutex _clientsMutex;
+  static bool tickClients(int64_t microseconds);
 };
 
 mutex Porttime::_mutex;
+monotonic_condition_variable Porttime::_condition;
 bool Porttime::_running = false;
+bool Porttime::_stopping = false;
+pthread_t Porttime::_thread;
+bool Porttime::_sleeping = false;
+PmTimestamp Porttime::_deadline = 0;
+bool Porttime::_wakeRequested = false;
+PmTimestamp Porttime::_wakeTime = 0;
+int64_t Porttime::_epoch = 0;
+histogram Porttime::jitter;
+histogram Porttime::overruns;
+volatile uint64_t Porttime::passes = 0;
+volatile uint64_t Porttime::earlyWakeups = 0;
+set<Porttime::Client*> Porttime::_clients;
+mutex Porttime::_clientsMutex;
+
+// Returns true if there are clients, which need a tick every millisecond
+bool
+Porttime::tickClients(int64_t microseconds)
+{
+  unique_lock<mutex> lock(_clientsMutex);
+  for (set<Client*>::iterator i = _clients.begin(); i != _clients.end(); i++) {
+    (*i)->tick(microseconds);
+  }
+  return !_clients.empty();
+}
 
 // //////////////////////////////////////////////////////////////////
 // Class to encapsulate MIDI utility functionality.  This class
@@ -146,14 +283,135 @@ public:
   enum PortDirection { INPUT, OUTPUT };
 
   enum {
+    NOTE_OFF_STATUS = 0x80,
+    NOTE_ON_STATUS = 0x90,
     SYSEX_START = 0xf0,
     SYSEX_END = 0xf7
   };
 
   static bool IS_REALTIME(unsigned char status) { return (status & 0xf8) == 0xf8; }
 
+  // Length of a short message with the given status byte
+  static size_t messageLength(unsigned char status)
+  {
+    if (status < 0xf0) {
+      return ((status & 0xe0) == 0xc0) ? 2 : 3;
+    }
+    switch (status) {
+    case 0xf1: case 0xf3: return 2;
+    case 0xf2: return 3;
+    default: return 1;
+    }
+  }
+
+  // Message types as seen by the application.  The names of the
+  // types are the names of the events emitted by MIDIInput objects.
+  enum MessageType {
+    NOTE_OFF, NOTE_ON, POLYPHONIC_KEY_PRESSURE, CONTROL_CHANGE,
+    PROGRAM_CHANGE, CHANNEL_PRESSURE, PITCH_WHEEL_CHANGE,
+    SYSEX, MIDI_TIME_CODE, SONG_POSITION_POINTER, SONG_SELECT,
+    TUNE_REQUEST, TIMING_CLOCK, TICK, START, CONTINUE, STOP,
+    ACTIVE_SENSING, RESET,
+    // parameter changes decoded from control change messages
+    NRPN7, NRPN14, RPN, CC14,
+    MESSAGE_TYPE_COUNT,
+    UNDEFINED_MESSAGE = -1
+  };
+
+  static MessageType messageType(unsigned char status)
+  {
+    if (status < 0xf0) {
+      return (status & 0x80) ? static_cast<MessageType>((status >> 4) - 8) : UNDEFINED_MESSAGE;
+    } else {
+      return _systemMessageTypes[status & 0x0f];
+    }
+  }
+
+  static MessageType messageType(const char* name);
+
+  // Event name symbols for all message types, interned once
+  static Persistent<String> messageTypeSymbols[MESSAGE_TYPE_COUNT];
+
+  // Packed event records, as delivered by MIDIInput in packed mode.
+  // All fields are little endian.  Sysex records carry the offset and
+  // length of the message bytes, which are stored after the records
+  // in the same buffer.
+  enum {
+    PACKED_EVENT_SIZE = 16,
+    PACKED_TIMESTAMP = 0,                       // 32 bits
+    PACKED_STATUS = 4,
+    PACKED_DATA1 = 5,
+    PACKED_DATA2 = 6,
+    PACKED_SYSEX_OFFSET = 8,                    // 32 bits
+    PACKED_SYSEX_LENGTH = 12                    // 32 bits
+  };
+
+  static void packUint32(unsigned char* p, uint32_t value)
+  {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+  }
+
+  static uint32_t unpackUint32(const unsigned char* p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  }
+
+  static void packEvent(unsigned char* record,
+                        PmTimestamp timestamp,
+                        PmMessage message,
+                        uint32_t sysexOffset = 0,
+                        uint32_t sysexLength = 0)
+  {
+    packUint32(record + PACKED_TIMESTAMP, timestamp);
+    record[PACKED_STATUS] = Pm_MessageStatus(message);
+    record[PACKED_DATA1] = Pm_MessageData1(message);
+    record[PACKED_DATA2] = Pm_MessageData2(message);
+    record[7] = 0;
+    packUint32(record + PACKED_SYSEX_OFFSET, sysexOffset);
+    packUint32(record + PACKED_SYSEX_LENGTH, sysexLength);
+  }
+
   static void runTimedCallbacks(PmTimestamp timestamp);
 
+  // Lower next to the time at which the next timed callback is due
+  static void nextTimedCallback(PmTimestamp& next);
+
+  // Summary of a histogram as a JavaScript object
+  static Local<Object> histogramSummary(const histogram::summary& values);
+  static Local<Object> histogramSummary(const histogram& values)
+  {
+    return histogramSummary(values.summarize());
+  }
+
+  // Times as seen by JavaScript.  By default, they are milliseconds in
+  // the 32 bit time base.  In the high resolution time base selected
+  // with setTimeBase('microseconds'), they are 64 bit microseconds,
+  // which do not wrap.  timeArgument() returns microseconds.
+  static Local<Value> timeValue(PmTimestamp time);
+  static Local<Value> preciseTimeValue(int64_t microseconds);
+  static int64_t timeArgument(Handle<Value> value);
+
+  // Millisecond time at which something is started at the time
+  // argument value, rounded to the nearest millisecond and not before
+  // now
+  static PmTimestamp startTimeArgument(Handle<Value> value)
+  {
+    const PmTimestamp now = Porttime::time();
+    const PmTimestamp when = Porttime::truncate(timeArgument(value) + 500);
+    return Porttime::before(when, now) ? now : when;
+  }
+
+  // Event tracing of the MIDI pipeline, see startTrace()
+  enum TraceEvent {
+    TRACE_TIMER_PASS, TRACE_POLL, TRACE_READ, TRACE_SYSEX_UNPACK,
+    TRACE_QUEUE_PUSH, TRACE_QUEUE_POP, TRACE_DISPATCH, TRACE_WRITE,
+    TRACE_CALLBACKS
+  };
+  static tracerecorder trace;
+
 private:
   // v8 interface
   static Handle<Value> getPorts(PortDirection direction);
@@ -162,73 +420,86 @@ private:
   static Handle<Value> currentTime(const Arguments& args);
   static Handle<Value> at(const Arguments& args);
 
-  // //////////////////////////////////////////////////////////////////
-  // TimedCallback implements a JS function that is scheduled to be
-  // called synchronously to the MIDI clock.
-  // //////////////////////////////////////////////////////////////////
-  class TimedCallback
-  {
-  public:
-    TimedCallback(PmTimestamp timestamp, Local<Function> callback)
-      : _timestamp(timestamp),
-        _callback(Persistent<Function>::New(callback))
-    {
-    }
-
-    virtual ~TimedCallback()
-    {
-      _callback.Dispose();
-    }
-
-    PmTimestamp timestamp() const { return _timestamp; }
-    Persistent<Function>& callback() { return _callback; }
-
-  private:
-    PmTimestamp _timestamp;
-    Persistent<Function> _callback;
-  };
+  static Handle<Value> cancelAt(const Arguments& args);
+  static Handle<Value> setLookahead(const Arguments& args);
+  static Handle<Value> lookahead(const Arguments& args);
+
+  static Handle<Value> setTimeBase(const Arguments& args);
+  static Handle<Value> timeBase(const Arguments& args);
+  static Handle<Value> setTimerPriority(const Arguments& args);
+  static Handle<Value> setTimerAffinity(const Arguments& args);
+  static Handle<Value> timerStats(const Arguments& args);
+  static Handle<Value> resetTimerStats(const Arguments& args);
+  static Handle<Value> stats(const Arguments& args);
+  static Handle<Value> resetStats(const Arguments& args);
+  static Handle<Value> startTrace(const Arguments& args);
+  static Handle<Value> stopTrace(const Arguments& args);
+  static Handle<Value> dumpTrace(const Arguments& args);
+  static Handle<Value> createVirtualPort(const Arguments& args);
 
   // //////////////////////////////////////////////////////////////////
-  // TimedCallbackPointer encapsulates a pointer to a TimedCallback
-  // and provides for an ordering relation so that TimedCallbacks can
-  // be put into a priority queue with the next callback to run in
-  // front of the queue.
+  // Timed callbacks are JS functions that are scheduled to be called
+  // synchronously to the MIDI clock.  They are kept in a timing wheel
+  // that the Porttime thread expires every millisecond.  Expired
+  // callbacks are collected in _dueCallbacks, and the JavaScript thread
+  // is notified to call all of them in one go.  Each callback is
+  // tagged with the id returned by at(), so that it can be cancelled.
+  // _timedCallbacksMutex protects the wheel and _dueCallbacks.
+  //
+  // Callbacks may be called a lookahead interval before their time, so
+  // that they can schedule timestamped messages in time.  The adaptive
+  // lookahead follows the latency with which the JavaScript thread
+  // runs due callbacks, so that it grows when garbage collection or
+  // other work delays them.
   // //////////////////////////////////////////////////////////////////
-  class TimedCallbackPointer {
-  public:
-    TimedCallbackPointer(TimedCallback* pointer)
-      : _pointer(pointer)
-    {
-    }
-    
-    // define ordering relation for priority queue
-    bool
-    operator<(const TimedCallbackPointer other) const
-    {
-      return _pointer->timestamp() > other->timestamp();
-    }
-
-    void
-    destroy()
+  struct TimedCallback {
+    TimedCallback() : id(0), time(0) {}
+    uint32_t id;
+    int64_t time;                               // microseconds the callback was scheduled for
+    Persistent<Function> callback;
+  };
+  struct DisposeCallback {
+    void operator()(TimedCallback& timedCallback) const { timedCallback.callback.Dispose(); }
+  };
+  struct CollectCallback {
+    void operator()(uint32_t when, const TimedCallback& timedCallback) const
     {
-      delete _pointer;
+      if (_dueCallbacks.empty()) {
+        _dueSince = Porttime::microseconds();
+      }
+      _dueCallbacks.push_back(timedCallback);
     }
-
-    TimedCallback* operator->() const { return _pointer; }
-
-  private:
-    TimedCallback* _pointer;
   };
 
-  // libev interface functions for timed callbacks
-  static int EIO_waitForTimedCallback(eio_req* req);
-  static int EIO_waitForTimedCallbackDone(eio_req* req);
-
-  // guts for the implementation of timed callbacks.
-  static condition_variable _timedCallbackWantsToRunCondition;
   static mutex _timedCallbacksMutex;
-  static priority_queue<TimedCallbackPointer> _timedCallbacks;
-  static bool _timedCallbacksActive;
+  static timingwheel<TimedCallback> _timedCallbacks;
+  static vector<TimedCallback> _dueCallbacks;
+  static vector<TimedCallback> _runningCallbacks; // JavaScript thread only
+  static uint32_t _lastTimedCallbackId;
+  static bool _timedCallbacksActive;            // JavaScript thread only
+  static int64_t _dueSince;                     // microseconds at which _dueCallbacks became non-empty
+  static histogram _callbackLatency;            // from _dueSince until the callbacks run
+
+  // Lookahead settings and the dispatch latency estimate, JavaScript
+  // thread only
+  enum { DEFAULT_LOOKAHEAD_MINIMUM = 2, DEFAULT_LOOKAHEAD_MAXIMUM = 100 };
+  static double _lookahead;                     // fixed lookahead in ms
+  static bool _adaptiveLookahead;
+  static double _lookaheadMinimum;
+  static double _lookaheadMaximum;
+  static double _dispatchLatency;               // decaying peak of the latency, in ms
+  static double currentLookahead();
+  static double adaptiveLookahead();
+  static void updateDispatchLatency(double latency);
+
+  static ev_async _timedCallbackNotifier;
+  static void timedCallbacksDue(EV_P_ ev_async* watcher, int revents);
+  static void updateTimedCallbacksActive();
+
+  static bool _microseconds;                    // high resolution time base
+
+  static const char* _messageTypeNames[MESSAGE_TYPE_COUNT];
+  static const MessageType _systemMessageTypes[16];
 };
 
 // //////////////////////////////////////////////////////////////////
@@ -251,925 +522,6610 @@ public:
   const string& portName() const { return _portName; }
   const int portId() const { return _portId; }
 
+  // Number of streams that are open in portmidi, JavaScript thread only
+  static int openStreams() { return _openStreams; }
+
 protected:
   PmStream* _pmMidiStream;
 
+  // Count a stream that has been opened
+  static void opened() { _openStreams++; }
+
   enum { MIDISTREAM_BUFSIZE = 16384 };
 
 private:
   string _portName;
   int _portId;
+
+  static int _openStreams;
 };
 
 // //////////////////////////////////////////////////////////////////
-// Class to implement a MIDI input channel.  It works in an
-// asynchronous fashion, received messages are queued by the
-// background thread and sent back to the JavaScript application
-// by the way of libev.
+// Class to implement virtual MIDI ports for running and measuring
+// without MIDI hardware.  A virtual port is a pair of an output and an
+// input device of the same name that are registered with portmidi, so
+// that MIDIInput and MIDIOutput find and open them like any other
+// port.  Messages written to the output arrive at the input at the
+// time at which they are sent, or with throttling at the time at which
+// their last byte would have been transmitted over a DIN MIDI cable.
+// Random jitter can be added to the arrival times, messages still
+// arrive in the order in which they were sent.  Arrivals are
+// delivered when portmidi polls the input and carry their arrival
+// time as timestamp.  Messages sent while the input is closed are
+// lost.  Virtual ports cannot be removed.
 // //////////////////////////////////////////////////////////////////
-class MIDIInput
-  : public EventEmitter,
-    public MIDIStream
+class VirtualPort
 {
 public:
-  MIDIInput(const char* portName) throw(JSException);
-  virtual ~MIDIInput();
-
-  void setFilters(int32_t channels, int32_t filters) throw(JSException);
-  static void pollAll();
-
-  // v8 interface
-public:
-  static void Initialize(Handle<Object> target);
+  // Register a virtual port.  jitter is the maximum number of
+  // microseconds added to arrival times, seed seeds its random
+  // generator so that runs can be repeated.
+  static void create(const string& name, bool throttle, uint32_t jitter, uint32_t seed)
+    throw(JSException);
 
-  static Handle<Value> New(const Arguments& args);
-  static Handle<Value> setFilters(const Arguments& args);
-  static Handle<Value> recv(const Arguments& args);
-  static Handle<Value> close(const Arguments& args);
+  // Create the ports named in the comma separated list in the
+  // MIDI_VIRTUAL_PORTS environment variable, so that programs can be
+  // run against virtual ports through MIDI_INPUT and MIDI_OUTPUT
+  static void createFromEnvironment() throw(JSException);
 
 private:
+  VirtualPort(const string& name, bool throttle, uint32_t jitter, uint32_t seed);
 
-  condition_variable _dataReceivedCondition;
-  mutex _mutex;
-
-  void pollData();
-
-  // receivers that are being polled
-  static set<MIDIInput*> _receivers;
-  static mutex _receiversMutex;
-
-  static int EIO_recv(eio_req* req);
-  static int EIO_recvDone(eio_req* req);
-
-  // //////////////////////////////////////////////////////////////////
-  // Class to encapsulate one queued read of MIDI messages.  A pointer
-  // to an instance of this class is passed to libev during processing
-  // of a receive operation.  Once the operation is finished, the
-  // JavaScript function contained in it will be called with the
-  // received messages as argument.
-  // //////////////////////////////////////////////////////////////////
-  struct ReceiveIOCB {
-    ReceiveIOCB(MIDIInput* midiInput, Persistent<Object> this_, Persistent<Function> callback)
-      : _midiInput(midiInput),
-        _this(this_),
-        _callback(callback),
-        _error(0)
-    {}
-
-    ~ReceiveIOCB()
-    {
-      if (_error) {
-        delete _error;
-      }
-    }
-
-    MIDIInput* _midiInput;
-    Persistent<Object> _this;
-    Persistent<Function> _callback;
-    PortMidiJSException* _error;
-  };
-
-  void waitForData(ReceiveIOCB* iocb);
-  bool dataAvailable() const { return _sysexQueue.size() || _readQueue.size(); }
-  void readResultsToJSCallbackArguments(ReceiveIOCB* iocb, Local<Value> argv[]);
+  // Transmission time of one byte at 31250 baud, in microseconds
+  enum { DIN_BYTE_TIME = 320 };
 
-  // Queues for received messages
-  queue<PmEvent> _readQueue;
-  struct SysexMessageBuffer {
-    vector<unsigned char> data;
-    PmTimestamp timestamp;
+  struct Arrival {
+    int64_t time;                               // microseconds
+    PmMessage message;
+    unsigned char* sysex;                       // malloc()ed, or 0
+    size_t length;
   };
-  queue<SysexMessageBuffer> _sysexQueue;
-  SysexMessageBuffer _currentSysexMessage;
 
-  bool inSysexMessage() { return _currentSysexMessage.data.size(); }
+  string _name;
+  bool _throttle;
+  uint32_t _jitter;
+  uint32_t _random;
 
-  // Unpack one message into the current sysex message buffer _currentSysexMessage
-  void unpackSysexMessage(PmEvent message);
+  // Protected by _mutex, which is taken by portmidi calls of both
+  // devices of the port
+  mutex _mutex;
+  PmInternal* _input;                           // open input, or 0
+  deque<Arrival> _arrivals;
+  int64_t _lineFree;                            // end of the last transmission
+  int64_t _lastArrival;
+
+  // Sysex message being written, by the writing thread only
+  vector<unsigned char> _sysex;
+
+  void transmit(PmInternal* output, PmTimestamp timestamp, PmMessage message, const vector<unsigned char>* sysex);
+  void discardArrivals();
+
+  static vector<VirtualPort*> _ports;
+  static pm_fns_node _dictionary;
+
+  // portmidi device interface
+  static VirtualPort* portOf(PmInternal* midi) { return static_cast<VirtualPort*>(midi->descriptor); }
+  static PmError openDevice(PmInternal* midi, void* driverInfo);
+  static PmError closeDevice(PmInternal* midi);
+  static PmError abortDevice(PmInternal* midi);
+  static PmError pollDevice(PmInternal* midi);
+  static PmError writeShort(PmInternal* midi, PmEvent* event);
+  static PmError beginSysex(PmInternal* midi, PmTimestamp timestamp);
+  static PmError endSysex(PmInternal* midi, PmTimestamp timestamp);
+  static PmError writeByte(PmInternal* midi, unsigned char byte, PmTimestamp timestamp);
+  static PmError writeFlush(PmInternal* midi, PmTimestamp timestamp);
+  static PmTimestamp synchronize(PmInternal* midi);
+  static unsigned int hasHostError(PmInternal* midi);
+  static void hostError(PmInternal* midi, char* message, unsigned int length);
 };
 
 // //////////////////////////////////////////////////////////////////
-// Class to implement a MIDI output channel.
+// Class to decode parameter changes that are transmitted as sequences
+// of control change messages: NRPNs, RPNs and 14 bit controllers.
+// State is kept separately for each channel.  process() is called for
+// every control change message received and reports the parameter
+// changes that have been completed by the message.
 // //////////////////////////////////////////////////////////////////
-class MIDIOutput
-  : public ObjectWrap,
-    public MIDIStream
+class ParameterDecoder
 {
 public:
-  MIDIOutput(const char* portName, int32_t latency) throw(JSException);
+  ParameterDecoder();
 
-  void send(const vector<unsigned char>& message,
-            PmTimestamp when = 0)
-    throw(JSException);
-
-  int32_t latency() const { return _latency; }
+  struct Update {
+    MIDI::MessageType type;
+    int parameter;
+    int value;
+  };
+  enum { MAX_UPDATES = 2 };
 
-  // Called periodically to unref the default libev queue when all
-  // delayed messages have been sent.
-  static void checkScheduledSends(PmTimestamp timestamp);
+  // Returns the number of updates stored into updates
+  int process(int channel, int controller, int value, Update updates[MAX_UPDATES]);
 
 private:
-  int32_t _latency;
-  PmTimestamp _lastSendTime;
+  enum {
+    DATA_ENTRY_MSB = 0x06,
+    DATA_ENTRY_LSB = 0x26,
+    DATA_INCREMENT = 0x60,
+    DATA_DECREMENT = 0x61,
+    NRPN_LSB = 0x62,
+    NRPN_MSB = 0x63,
+    RPN_LSB = 0x64,
+    RPN_MSB = 0x65,
+    NULL_PARAMETER = 0x3fff
+  };
 
-  static mutex _lastScheduledSendLock;
-  static PmTimestamp _lastScheduledSend;
+  enum Selection { NOTHING_SELECTED, NRPN_SELECTED, RPN_SELECTED };
+
+  struct ChannelState {
+    Selection selection;
+    int parameterMsb;
+    int parameterLsb;
+    int valueMsb;
+    int valueLsb;
+    int value7;
+    // MSBs of controllers 0-31, for 14 bit controller pairs
+    unsigned char controllerMsb[32];
+  };
 
-  // v8 interface
-public:
-  static void Initialize(Handle<Object> target);
-  virtual void Dispose() { cout << "MIDIOutput::Dispose()" << endl; }
+  ChannelState _channels[16];
 
-  static Handle<Value> New(const Arguments& args);
-  static Handle<Value> send(const Arguments& args);
-  static Handle<Value> close(const Arguments& args);
+  void select(ChannelState& state, Selection selection);
+  static int store(Update& update, MIDI::MessageType type, int parameter, int value);
 };
 
-// //////////////////////////////////////////////////////////////////
-// MIDI guts
-// //////////////////////////////////////////////////////////////////
-
-condition_variable MIDI::_timedCallbackWantsToRunCondition;
-mutex MIDI::_timedCallbacksMutex;
-priority_queue<MIDI::TimedCallbackPointer> MIDI::_timedCallbacks;
-bool MIDI::_timedCallbacksActive = false;
+ParameterDecoder::ParameterDecoder()
+{
+  memset(_channels, 0, sizeof _channels);
+}
 
 void
-MIDI::runTimedCallbacks(PmTimestamp timestamp)
+ParameterDecoder::select(ChannelState& state, Selection selection)
 {
-  unique_lock<mutex> lock(_timedCallbacksMutex);
+  state.selection = selection;
+  state.valueMsb = 0;
+  state.valueLsb = 0;
+  state.value7 = 0;
+  if (((state.parameterMsb << 7) | state.parameterLsb) == NULL_PARAMETER) {
+    state.selection = NOTHING_SELECTED;
+  }
+}
 
-  if (_timedCallbacks.size() && (_timedCallbacks.top()->timestamp() <= timestamp)) {
-    _timedCallbackWantsToRunCondition.notify_one();
- }
+int
+ParameterDecoder::store(Update& update, MIDI::MessageType type, int parameter, int value)
+{
+  update.type = type;
+  update.parameter = parameter;
+  update.value = value;
+  return 1;
 }
 
 int
-MIDI::EIO_waitForTimedCallback(eio_req* req)
+ParameterDecoder::process(int channel, int controller, int value, Update updates[MAX_UPDATES])
 {
-  unique_lock<mutex> lock(_timedCallbacksMutex);
+  ChannelState& state = _channels[channel];
+  const int parameter = (state.parameterMsb << 7) | state.parameterLsb;
+  int count = 0;
+
+  switch (controller) {
+  case NRPN_MSB:
+  case RPN_MSB:
+    state.parameterMsb = value;
+    select(state, (controller == NRPN_MSB) ? NRPN_SELECTED : RPN_SELECTED);
+    return 0;
+  case NRPN_LSB:
+  case RPN_LSB:
+    state.parameterLsb = value;
+    select(state, (controller == NRPN_LSB) ? NRPN_SELECTED : RPN_SELECTED);
+    return 0;
+  case DATA_ENTRY_MSB:
+    state.valueMsb = value;
+    state.value7 = value;
+    if (state.selection == NRPN_SELECTED) {
+      return store(updates[0], MIDI::NRPN7, parameter, value);
+    } else if (state.selection == RPN_SELECTED) {
+      return store(updates[0], MIDI::RPN, parameter, (state.valueMsb << 7) | state.valueLsb);
+    }
+    break;
+  case DATA_ENTRY_LSB:
+    state.valueLsb = value;
+    if (state.selection == NRPN_SELECTED) {
+      return store(updates[0], MIDI::NRPN14, parameter, (state.valueMsb << 7) | state.valueLsb);
+    } else if (state.selection == RPN_SELECTED) {
+      return store(updates[0], MIDI::RPN, parameter, (state.valueMsb << 7) | state.valueLsb);
+    }
+    break;
+  case DATA_INCREMENT:
+  case DATA_DECREMENT:
+    if (state.selection != NOTHING_SELECTED) {
+      const int delta = (controller == DATA_INCREMENT) ? value : -value;
+      const int value14 = max(0, min(0x3fff, ((state.valueMsb << 7) | state.valueLsb) + delta));
+      state.valueMsb = value14 >> 7;
+      state.valueLsb = value14 & 0x7f;
+      if (state.selection == RPN_SELECTED) {
+        return store(updates[0], MIDI::RPN, parameter, value14);
+      }
+      state.value7 = max(0, min(0x7f, state.value7 + delta));
+      count += store(updates[count], MIDI::NRPN7, parameter, state.value7);
+      count += store(updates[count], MIDI::NRPN14, parameter, value14);
+      return count;
+    }
+    return 0;
+  }
 
-  while (_timedCallbacks.top()->timestamp() > Pt_Time()) {
-    _timedCallbackWantsToRunCondition.wait(lock);
+  // 14 bit controllers: MSB on controllers 0-31, LSB on 32-63.  The
+  // data entry pair is reported as such only if no NRPN or RPN is
+  // selected.
+  if (controller < 32) {
+    state.controllerMsb[controller] = value;
+  } else if (controller < 64
+             && (controller != DATA_ENTRY_LSB || state.selection == NOTHING_SELECTED)) {
+    count += store(updates[count], MIDI::CC14, controller - 32,
+                   (state.controllerMsb[controller - 32] << 7) | value);
   }
 
-  return 0;
+  return count;
 }
 
-int
-MIDI::EIO_waitForTimedCallbackDone(eio_req* req)
+// //////////////////////////////////////////////////////////////////
+// Class to follow received MIDI clock.  Timing clock messages are
+// absorbed, and the tempo and beat phase are estimated by a linear
+// regression of the pulse timestamps over a sliding window, which
+// averages out the jitter of the sender and the transport.  Start,
+// Stop, Continue and Song Position Pointer maintain the song position.
+//
+// process() is called by the reader thread.  The current estimate is
+// published through a sequence lock, so that the JavaScript thread
+// can read it at any time without blocking the reader thread.
+// //////////////////////////////////////////////////////////////////
+class ClockFollower
 {
-  while (true) {
-    PtTimestamp timestamp = Pt_Time();
-    TimedCallbackPointer tc = 0;
-    {
-      unique_lock<mutex> lock(_timedCallbacksMutex);
-      if (_timedCallbacks.empty() || (_timedCallbacks.top()->timestamp() > timestamp)) {
-        break;
-      }
-      tc = _timedCallbacks.top();
-      _timedCallbacks.pop();
-    }
+public:
+  enum {
+    DEFAULT_WINDOW = 48,                        // pulses, two beats
+    MIN_WINDOW = 6,
+    MAX_WINDOW = 384,
+    PULSES_PER_BEAT = 24,
+    PULSES_PER_SIXTEENTH = 6,
+    // A longer gap between pulses restarts the estimation
+    MIN_GAP = 250
+  };
 
-    HandleScope scope;
+  ClockFollower();
 
-    Local<Value> argv[1];
-    argv[0] = v8::Integer::New(timestamp);
+  // Called with the reader thread excluded
+  void configure(size_t window, double threshold);
+  void reset();
 
-    TryCatch tryCatch;
-    tc->callback()->Call(Context::GetCurrent()->Global(), 1, argv);
+  // Returns true if the message has been absorbed.  Called by the
+  // reader thread.
+  bool process(PmTimestamp timestamp, PmMessage message);
 
-    if (tryCatch.HasCaught()) {
-      FatalException(tryCatch);
-    }
+  // Returns true once after the tempo estimate has changed by at least
+  // the threshold
+  bool takeTempoChange() { return __sync_lock_test_and_set(&_tempoChanged, 0); }
+  bool tempoChangePending() const { return _tempoChanged; }
 
-    tc->callback().Dispose();
-    tc.destroy();
-  }
+  // The following may be called from any thread.  The tempo is 0 while
+  // no estimate is available.
+  double tempo() const { return read().bpm; }
+  bool running() const { return read().running; }
+  double beatPosition(double time) const;
 
-  unique_lock<mutex> lock(_timedCallbacksMutex);
+private:
+  struct Estimate {
+    bool running;
+    double bpm;
+    double msPerPulse;                          // 0 while no estimate is available
+    double anchorTime;                          // fitted time of the anchor pulse
+    double anchorPulse;                         // song position, in pulses
+  };
 
-  if (_timedCallbacks.empty()) {
-    ev_unref(EV_DEFAULT_UC);
-    _timedCallbacksActive = false;
-  } else {
-    eio_custom(EIO_waitForTimedCallback,
-               EIO_PRI_DEFAULT,
-               EIO_waitForTimedCallbackDone,
-               0);
-  }
+  volatile uint32_t _sequence;                  // odd while _estimate is written
+  Estimate _estimate;
+  volatile int _tempoChanged;
+
+  void publish(const Estimate& estimate);
+  Estimate read() const;
+
+  // Used by the reader thread only
+  size_t _window;
+  double _threshold;
+  double _times[MAX_WINDOW];                    // ring of the latest pulse times
+  size_t _count;                                // pulses in _times
+  size_t _next;                                 // ring index of the next pulse
+  bool _running;
+  uint32_t _nextPulse;                          // song position of the next pulse
+  double _notifiedBpm;
+  Estimate _current;
+
+  void restartEstimation();
+  void addPulse(PmTimestamp timestamp);
+};
 
-  return 0;
+ClockFollower::ClockFollower()
+  : _sequence(0),
+    _tempoChanged(0),
+    _window(DEFAULT_WINDOW),
+    _threshold(0.5)
+{
+  reset();
 }
 
-// v8 interface
+void
+ClockFollower::configure(size_t window, double threshold)
+{
+  _window = min(max(window, (size_t) MIN_WINDOW), (size_t) MAX_WINDOW);
+  _threshold = threshold;
+  reset();
+}
 
-Handle<Value>
-MIDI::getPorts(PortDirection direction)
+void
+ClockFollower::reset()
 {
-  Local<Array> retval = Array::New();
-  unsigned count = 0;
-  for (int id = 0; id < Pm_CountDevices(); id++) {
-    const PmDeviceInfo* deviceInfo = Pm_GetDeviceInfo(id);
-    if ((direction == MIDI::INPUT) ^ deviceInfo->output) {
-      retval->Set(count++, String::New(deviceInfo->name));
-    }
-  }
-  return retval;
+  _running = false;
+  _nextPulse = 0;
+  _notifiedBpm = 0;
+  _current.running = false;
+  _current.bpm = 0;
+  _current.msPerPulse = 0;
+  _current.anchorTime = 0;
+  _current.anchorPulse = 0;
+  restartEstimation();
+  publish(_current);
 }
 
-Handle<Value>
-MIDI::inputPorts(const Arguments& args)
+void
+ClockFollower::restartEstimation()
 {
-  return getPorts(MIDI::INPUT);
+  _count = 0;
+  _next = 0;
 }
 
-Handle<Value>
-MIDI::outputPorts(const Arguments& args)
+void
+ClockFollower::publish(const Estimate& estimate)
 {
-  return getPorts(MIDI::OUTPUT);
+  _sequence++;
+  __sync_synchronize();
+  _estimate = estimate;
+  __sync_synchronize();
+  _sequence++;
 }
 
-Handle<Value>
-MIDI::currentTime(const Arguments& args)
+ClockFollower::Estimate
+ClockFollower::read() const
 {
-  return v8::Integer::New(Pt_Time());
+  Estimate estimate;
+  uint32_t sequence;
+  do {
+    while ((sequence = _sequence) & 1)
+      ;
+    __sync_synchronize();
+    estimate = _estimate;
+    __sync_synchronize();
+  } while (sequence != _sequence);
+  return estimate;
 }
 
-Handle<Value>
-MIDI::at(const Arguments& args)
+bool
+ClockFollower::process(PmTimestamp timestamp, PmMessage message)
 {
-  try {
-    if (args.Length() != 2) {
-      throw JSException("unexpected number of arguments to MIDI.at(timestamp, callback)");
-    }
+  switch (Pm_MessageStatus(message)) {
+  case 0xf8:                                    // timing clock
+    addPulse(timestamp);
+    publish(_current);
+    return true;
+  case 0xfa:                                    // start
+    _nextPulse = 0;
+    // fall through
+  case 0xfb:                                    // continue
+    _running = true;
+    restartEstimation();
+    break;
+  case 0xfc:                                    // stop
+    _running = false;
+    break;
+  case 0xf2:                                    // song position pointer
+    _nextPulse = ((Pm_MessageData2(message) << 7) | Pm_MessageData1(message)) * PULSES_PER_SIXTEENTH;
+    restartEstimation();
+    break;
+  default:
+    return false;
+  }
 
-    unique_lock<mutex> lock(_timedCallbacksMutex);
+  // Until the next pulse, the position stays at the transport position
+  _current.running = _running;
+  _current.anchorPulse = _nextPulse;
+  _current.anchorTime = timestamp;
+  _current.msPerPulse = 0;
+  publish(_current);
+  return false;
+}
 
-    _timedCallbacks.push(new TimedCallback(args[0]->Int32Value(), Local<Function>::Cast(args[1])));
+void
+ClockFollower::addPulse(PmTimestamp timestamp)
+{
+  if (_count && timestamp - _times[(_next + MAX_WINDOW - 1) % MAX_WINDOW]
+      > max((double) MIN_GAP, 4 * _current.msPerPulse)) {
+    restartEstimation();
+  }
+  _times[_next] = timestamp;
+  _next = (_next + 1) % MAX_WINDOW;
+  _count = min(_count + 1, _window);
+
+  // Clock is also sent while stopped, which only updates the tempo
+  const uint32_t pulse = _running ? _nextPulse++ : _nextPulse;
+
+  _current.running = _running;
+  _current.anchorPulse = pulse;
+  _current.anchorTime = timestamp;
+  _current.msPerPulse = 0;
+  if (_count < MIN_WINDOW) {
+    return;
+  }
 
-    if (!_timedCallbacksActive) {
-      eio_custom(EIO_waitForTimedCallback,
-                 EIO_PRI_DEFAULT,
-                 EIO_waitForTimedCallbackDone,
-                 0);
-      _timedCallbacksActive = true;
-      ev_ref(EV_DEFAULT_UC);
-    }
+  // Least squares fit of time over pulse number, relative to the
+  // oldest pulse in the window to keep the sums small
+  const size_t first = (_next + MAX_WINDOW - _count) % MAX_WINDOW;
+  const double t0 = _times[first];
+  double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+  for (size_t i = 0; i < _count; i++) {
+    const double y = _times[(first + i) % MAX_WINDOW] - t0;
+    sumX += i;
+    sumY += y;
+    sumXX += (double) i * i;
+    sumXY += i * y;
+  }
+  const double n = _count;
+  const double slope = (n * sumXY - sumX * sumY) / (n * sumXX - sumX * sumX);
+  if (slope <= 0) {
+    return;
+  }
+  const double intercept = (sumY - slope * sumX) / n;
 
-    return Undefined();
+  _current.msPerPulse = slope;
+  _current.anchorTime = t0 + intercept + slope * (n - 1);
+  _current.bpm = 60000 / (slope * PULSES_PER_BEAT);
+
+  if (fabs(_current.bpm - _notifiedBpm) >= _threshold) {
+    _notifiedBpm = _current.bpm;
+    _tempoChanged = 1;
   }
-  catch (const JSException& e) {
-    return e.asV8Exception();
+}
+
+// The position advances at the estimated tempo from the last pulse
+// received, but not beyond the next pulse.  While stopped, it is the
+// song position.
+double
+ClockFollower::beatPosition(double time) const
+{
+  const Estimate estimate = read();
+  double pulse = estimate.anchorPulse;
+  if (estimate.running && estimate.msPerPulse > 0) {
+    pulse += min(max((time - estimate.anchorTime) / estimate.msPerPulse, 0.0), 1.0);
   }
+  return pulse / PULSES_PER_BEAT;
 }
 
-void
-MIDI::Initialize(Handle<Object> target) {
-  HandleScope scope;
+// //////////////////////////////////////////////////////////////////
+// Class to implement a MIDI input channel.  It works in an
+// asynchronous fashion, received messages are queued by the native
+// reader thread and sent back to the JavaScript application by the
+// way of a libev async watcher.
+// //////////////////////////////////////////////////////////////////
+class Route;
+
+class MIDIInput
+  : public EventEmitter,
+    public MIDIStream
+{
+public:
+  MIDIInput(const char* portName) throw(JSException);
+  virtual ~MIDIInput();
+  virtual void closePort();
+
+  void setFilters(int32_t channels, int32_t filters) throw(JSException);
+
+  // Poll the receivers that are not watched through _wakeup, returns
+  // true if there are any
+  static bool pollAll();
+
+  // Statistics of all open inputs, for MIDI.stats()
+  static Local<Array> allStats();
+  static void resetAllStats();
+
+  // Statistics of one input, copied with _receiversMutex held
+  struct Stats {
+    string portName;
+    uint64_t received;
+    uint64_t batches;
+    uint64_t overflows;
+    histogram::summary poll;
+    histogram::summary read;
+    histogram::summary queue;
+    histogram::summary dispatch;
+  };
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> setFilters(const Arguments& args);
+  static Handle<Value> recv(const Arguments& args);
+  static Handle<Value> listen(const Arguments& args);
+  static Handle<Value> unlisten(const Arguments& args);
+  static Handle<Value> subscribe(const Arguments& args);
+  static Handle<Value> unsubscribe(const Arguments& args);
+  static Handle<Value> overflowCount(const Arguments& args);
+  static Handle<Value> setPacked(const Arguments& args);
+  static Handle<Value> setSysexLimit(const Arguments& args);
+  static Handle<Value> sysexOverflowCount(const Arguments& args);
+  static Handle<Value> setCoalescing(const Arguments& args);
+  static Handle<Value> coalescedCounts(const Arguments& args);
+  static Handle<Value> wakeupMode(const Arguments& args);
+  static Handle<Value> record(const Arguments& args);
+  static Handle<Value> stopRecording(const Arguments& args);
+  static Handle<Value> setClockFollowing(const Arguments& args);
+  static Handle<Value> addRoute(const Arguments& args);
+  static Handle<Value> updateRoute(const Arguments& args);
+  static Handle<Value> removeRoute(const Arguments& args);
+  static Handle<Value> clearRoutes(const Arguments& args);
+  static Handle<Value> tempo(const Arguments& args);
+  static Handle<Value> beatPosition(const Arguments& args);
+  static Handle<Value> clockRunning(const Arguments& args);
+  static Handle<Value> close(const Arguments& args);
+
+private:
+
+  // _mutex serializes access to the portmidi stream between the
+  // Porttime thread (Pm_Poll) and the reader thread (Pm_Read).  It is
+  // never taken by the JavaScript thread while data is flowing.
+  mutex _mutex;
+
+  bool pollData();
+
+  // receivers that are being polled
+  static set<MIDIInput*> _receivers;
+  static mutex _receiversMutex;
+
+  // The reader thread reads from a copy of _receivers without holding
+  // _receiversMutex, so that reading does not hold up the Porttime
+  // thread.  The receivers in the copy are marked as in use until they
+  // are released, closePort() waits for that.
+  int _users;                                   // protected by _receiversMutex
+  static condition_variable _receiversReleased;
+  static void acquireReceivers(vector<MIDIInput*>& receivers);
+  static void releaseReceivers(const vector<MIDIInput*>& receivers);
+
+  // //////////////////////////////////////////////////////////////////
+  // The reader thread is shared by all MIDIInput objects.  It is
+  // woken by the Porttime thread when any of the receivers has data
+  // pending, reads the data into the receivers' ring buffers and
+  // notifies the JavaScript thread through each receiver's async
+  // watcher.
+  //
+  // On Linux, the reader thread instead blocks on the ALSA sequencer
+  // through _wakeup and is woken by the kernel when data arrives for
+  // any of the watched receivers.  Receivers whose port cannot be
+  // watched are still polled by the Porttime thread, which then
+  // notifies the reader thread through _wakeup.
+  // //////////////////////////////////////////////////////////////////
+  static void startReaderThread();
+  static void* readerThread(void* arg);
+  static condition_variable _readerCondition;
+  static bool _readerRunning;
+  static bool _readPending;
+  static void notifyReader();
+
+#ifdef HAVE_ALSA
+  static alsawakeup* _wakeup;
+  static void blockingReaderLoop();
+#endif
+  // Set if the receiver is watched through _wakeup and need not be polled
+  bool _wakeupWatched;
+
+  bool readData();
+
+  // Journal that the reader thread writes all events read to, set by
+  // record().  Protected by _mutex.
+  journalwriter* _journal;
+  uint64_t stopRecording() throw(JSException);
+
+  // Routes that the reader thread forwards received messages through,
+  // see class Route.  The table is replaced as a whole by the
+  // JavaScript thread, with _mutex held, so that the reader thread
+  // never sees a partially edited table.  The routes themselves are
+  // owned by _routeList.
+  vector<Route*>* _routes;
+  vector<Route*> _routeList;                    // JavaScript thread only
+  uint32_t _lastRouteId;
+  void replaceRoutes(const vector<Route*>& routes);
+  void routeMessage(PmTimestamp timestamp, PmMessage message);
+
+  // If set by setClockFollowing(), the reader thread absorbs timing
+  // clock messages into _clockFollower.  Protected by _mutex.
+  bool _followingClock;
+  ClockFollower _clockFollower;
+
+  // libev interface, called in the JavaScript thread when data has
+  // been read by the reader thread
+  ev_async _dataReceivedNotifier;
+  static void dataReceived(EV_P_ ev_async* watcher, int revents);
+  void deliverData();
+
+  // Callback function registered by recv(), called once with the
+  // next batch of received messages
+  Persistent<Function> _recvCallback;
+
+  // If set by listen(), received messages are decoded natively and
+  // emitted as events of the types that have their bit set in
+  // _subscriptions.
+  bool _listening;
+  uint32_t _subscriptions;
+  void emitMessages();
+  void emitEvent(MIDI::MessageType type, int argc, Local<Value> argv[]);
+
+  // NRPN, RPN and 14 bit controller changes are decoded if any of
+  // their events are subscribed to
+  enum {
+    PARAMETER_EVENTS = ((1 << MIDI::NRPN7) | (1 << MIDI::NRPN14)
+                        | (1 << MIDI::RPN) | (1 << MIDI::CC14))
+  };
+  ParameterDecoder _parameterDecoder;
+  static Handle<Value> subscription(const Arguments& args, bool subscribe);
+
+  // Read error reported by the reader thread, handed over to the
+  // JavaScript thread by atomic exchange.
+  PortMidiJSException* volatile _error;
+
+  // Events read by the reader thread (producer) and drained by the
+  // JavaScript thread (consumer).  Events that do not fit into the
+  // ring are dropped and counted in _overflowCount.
+  enum { READ_QUEUE_SIZE = MIDISTREAM_BUFSIZE };
+  ringbuffer<PmEvent, READ_QUEUE_SIZE> _readQueue;
+  volatile uint32_t _overflowCount;
+
+  // //////////////////////////////////////////////////////////////////
+  // Statistics, in microseconds.  _pollTime and _readTime are the
+  // durations of the Pm_Poll and Pm_Read calls, _queueTime is the time
+  // that the first message of a batch waited in _readQueue and
+  // _dispatchTime the time taken to deliver a batch to JavaScript.
+  // _queuedSince is set by the reader thread when it pushes to an
+  // empty queue and taken by the JavaScript thread when it drains it.
+  // //////////////////////////////////////////////////////////////////
+  histogram _pollTime;
+  histogram _readTime;
+  histogram _queueTime;
+  histogram _dispatchTime;
+  volatile uint64_t _receivedCount;
+  volatile int64_t _queuedSince;
+  uint64_t _batchCount;                         // JavaScript thread only
+
+  // The following members are only used by the JavaScript thread.
+
+  // Messages drained from _readQueue, in order of arrival.  Sysex
+  // messages are reassembled in _sysexArena while draining and are
+  // referenced by their index in _sysexMessages.
+  struct SysexMessage {
+    const unsigned char* data;
+    size_t length;
+    sysexarena::chunk* chunk;
+  };
+  struct ReceivedMessage {
+    PmTimestamp timestamp;
+    PmMessage message;
+    int sysexIndex;                             // -1 for short messages
+  };
+  vector<ReceivedMessage> _batch;
+  vector<SysexMessage> _sysexMessages;
+  sysexarena _sysexArena;
+
+  // Sysex messages longer than _sysexLimit bytes are dropped while
+  // they are received and counted in _sysexOverflowCount.
+  enum { DEFAULT_SYSEX_LIMIT = 1048576 };
+  size_t _sysexLimit;
+  bool _discardingSysex;
+  uint32_t _sysexOverflowCount;
+
+  void appendSysexByte(unsigned char b);
+
+  // Called by node when a Buffer that views a sysex message in the
+  // arena is garbage collected.
+  static void releaseSysexBuffer(char* data, void* hint);
+  Local<Object> sysexBuffer(const SysexMessage& sysex);
+
+  void drainReadQueue();
+  void readResultsToJSCallbackArguments(Local<Value> argv[]);
+  void readResultsToPackedCallbackArguments(Local<Value> argv[]);
+
+  // If set, received messages are delivered to recv() callbacks as
+  // one Buffer of packed event records per batch
+  bool _packed;
+
+  bool inSysexMessage() { return _sysexArena.inMessage() || _discardingSysex; }
+
+  void pushMessage(PmTimestamp timestamp, PmMessage message, int sysexIndex = -1);
+
+  // //////////////////////////////////////////////////////////////////
+  // Coalescing of continuous controller streams.  If enabled, only
+  // the last control change, pitch wheel, channel pressure and
+  // polyphonic key pressure message for each channel and controller
+  // (or key) is kept in a batch, at the position of its last
+  // occurrence.  All other messages pass unchanged and in order.
+  // //////////////////////////////////////////////////////////////////
+  enum {
+    COALESCE_CONTROL_CHANGE = 0,
+    COALESCE_POLYPHONIC_KEY_PRESSURE = COALESCE_CONTROL_CHANGE + 16 * 128,
+    COALESCE_PITCH_WHEEL_CHANGE = COALESCE_POLYPHONIC_KEY_PRESSURE + 16 * 128,
+    COALESCE_CHANNEL_PRESSURE = COALESCE_PITCH_WHEEL_CHANGE + 16,
+    COALESCE_KEY_COUNT = COALESCE_CHANNEL_PRESSURE + 16
+  };
+  bool _coalescing;
+  // Index of the last message per key in the current batch.  Slots
+  // are valid if their generation matches _coalesceGeneration, so the
+  // table does not need to be cleared for every batch.
+  struct CoalesceSlot {
+    uint32_t generation;
+    uint32_t lastIndex;
+  };
+  CoalesceSlot _coalesceSlots[COALESCE_KEY_COUNT];
+  uint32_t _coalesceGeneration;
+  // Number of messages merged away, per key
+  uint32_t _coalescedCounts[COALESCE_KEY_COUNT];
+
+  int coalesceKey(PmMessage message) const;
+  void coalesceBatch();
+
+  // Unpack one message into the sysex message being assembled in _sysexArena
+  void unpackSysexMessage(PmEvent message);
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to implement a MIDI output channel.
+// //////////////////////////////////////////////////////////////////
+class MIDIOutput
+  : public ObjectWrap,
+    public MIDIStream
+{
+public:
+  MIDIOutput(const char* portName, int32_t latency) throw(JSException);
+  virtual ~MIDIOutput();
+  virtual void closePort();
+
+  // Messages with a send time are queued in the output's scheduler and
+  // may be sent in any order.  Messages with a tag can be cancelled
+  // until they are released to portmidi.
+  void send(const unsigned char* message,
+            size_t length,
+            PmTimestamp when = 0,
+            uint32_t tag = 0)
+    throw(JSException);
+
+  // Send count packed event records (see MIDI::PACKED_EVENT_SIZE) from
+  // buffer.  The batch is validated completely before anything is
+  // sent.  Records to be sent immediately are written with one
+  // Pm_Write call, the others are queued in the scheduler.
+  void sendBatch(const unsigned char* buffer, size_t length, size_t count, uint32_t tag = 0)
+    throw(JSException);
+
+  // Remove all queued messages with the given tag, returns the number
+  // of messages removed
+  size_t cancel(uint32_t tag);
+
+  // Send a short message from a native timer.  The message is queued
+  // if the output has a latency, otherwise it is sent immediately.
+  void sendFromTimer(PmTimestamp when, PmMessage message);
+  void sendSysexFromTimer(PmTimestamp when, const unsigned char* sysex, size_t length);
+
+  // Send a short message forwarded from an input, bypassing the
+  // scheduler.  timestamp is the time the message was received, so
+  // that an output with latency keeps the timing of the input.
+  void sendThru(PmTimestamp timestamp, PmMessage message);
+
+  int32_t latency() const { return _latency; }
+
+  // Called periodically by the Porttime thread to release due
+  // messages from the schedulers of all outputs to portmidi.
+  static void releaseAll(PmTimestamp timestamp);
+
+  // Called periodically to unref the default libev queue when all
+  // delayed messages have been sent.
+  static void checkScheduledSends(PmTimestamp timestamp);
+
+  // Lower next to the time at which releaseAll() or
+  // checkScheduledSends() next have something to do
+  static void nextDue(PmTimestamp& next);
+
+  // Statistics of all open outputs, for MIDI.stats()
+  static Local<Array> allStats();
+  static void resetAllStats();
+
+  // Statistics of one output, copied with _outputsMutex held
+  struct Stats {
+    string portName;
+    uint64_t sent;
+    uint64_t queued;
+    uint64_t released;
+    uint64_t late;
+    histogram::summary slack;
+    histogram::summary lateness;
+  };
+
+private:
+  int32_t _latency;
+
+  // Keep the event loop referenced until the message to be sent at
+  // time when has been sent
+  void scheduleSend(PmTimestamp when);
+
+  // //////////////////////////////////////////////////////////////////
+  // Scheduler.  Messages are released to portmidi by the Porttime
+  // thread RELEASE_AHEAD milliseconds before their send time, with
+  // their send time as timestamp, so that portmidi's latency queue
+  // sends them precisely.  _writeMutex serializes the access to the
+  // scheduler and to the portmidi stream between the JavaScript and
+  // the Porttime thread.
+  // //////////////////////////////////////////////////////////////////
+  enum { RELEASE_AHEAD = 2 };
+
+  struct ScheduledMessage {
+    ScheduledMessage() : message(0), sysex(0) {}
+    PmMessage message;
+    unsigned char* sysex;                       // malloced copy, or 0
+  };
+  struct FreeSysex {
+    void operator()(const ScheduledMessage& scheduled) const { free(scheduled.sysex); }
+  };
+  struct Releaser {
+    MIDIOutput* output;
+    int64_t now;                                // microseconds
+    void operator()(uint32_t when, const ScheduledMessage& scheduled) const
+    {
+      output->releaseMessage(when, scheduled, now);
+    }
+  };
+
+  mutex _writeMutex;
+  timingwheel<ScheduledMessage> _scheduled;
+  vector<PmEvent> _releaseEvents;
+
+  static set<MIDIOutput*> _outputs;
+  static mutex _outputsMutex;
+
+  void enqueue(PmTimestamp when, PmMessage message, const unsigned char* sysex, size_t sysexLength, uint32_t tag);
+  void releaseMessage(uint32_t when, const ScheduledMessage& scheduled, int64_t now);
+  void flushReleased();
+
+  // Events of the last batch, kept to avoid allocation for every batch
+  vector<PmEvent> _batchEvents;
+
+  // //////////////////////////////////////////////////////////////////
+  // Statistics.  Messages are counted when they are sent immediately,
+  // queued in the scheduler and released from it.  _releaseSlack is
+  // the time in microseconds from the release of a message until its
+  // send time, _releaseLateness the time by which messages were
+  // released after their send time.  Updated with _writeMutex held.
+  // //////////////////////////////////////////////////////////////////
+  volatile uint64_t _sentCount;
+  volatile uint64_t _queuedCount;
+  volatile uint64_t _releasedCount;
+  volatile uint64_t _lateCount;
+  histogram _releaseSlack;
+  histogram _releaseLateness;
+
+  // Message bytes decoded from strings and arrays, reused between sends
+  vector<unsigned char> _messageBytes;
+
+  static void decodeHex(const char* string, size_t length, vector<unsigned char>& bytes)
+    throw(JSException);
+
+  static mutex _lastScheduledSendLock;
+  static PmTimestamp _lastScheduledSend;
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+  virtual void Dispose() { cout << "MIDIOutput::Dispose()" << endl; }
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> send(const Arguments& args);
+  static Handle<Value> sendBatch(const Arguments& args);
+  static Handle<Value> cancel(const Arguments& args);
+  static Handle<Value> queueDepth(const Arguments& args);
+  static Handle<Value> close(const Arguments& args);
+
+  static Persistent<FunctionTemplate> constructorTemplate;
+};
+
+// //////////////////////////////////////////////////////////////////
+// Notes that a sequencer has turned on but not off, by channel and
+// key, so that they can be turned off when the sequencer stops.
+// //////////////////////////////////////////////////////////////////
+class SoundingNotes
+{
+public:
+  SoundingNotes() { clear(); }
+
+  void clear() { memset(_notes, 0, sizeof _notes); }
+  void track(PmMessage message);
+  void stopAll(MIDIOutput* output, PmTimestamp when);
+
+private:
+  uint32_t _notes[16][4];
+};
+
+// //////////////////////////////////////////////////////////////////
+// A route forwards the messages received by a MIDIInput to a
+// MIDIOutput in the reader thread, without involving JavaScript.
+// Messages are selected by type, channel and key range, and may be
+// moved to another channel, transposed and given a fixed velocity.
+// Sysex messages are not routed.  A route is not changed once it is in
+// use, MIDIInput replaces it to change its settings.
+// //////////////////////////////////////////////////////////////////
+class Route
+{
+public:
+  Route(uint32_t id, MIDIOutput* output, Handle<Object> outputObject);
+  ~Route();
+
+  // Set the route up from a JavaScript options object
+  void configure(Handle<Object> options) throw(JSException);
+
+  // Map message, returns false if the route does not pass it
+  bool map(PmMessage& message) const;
+
+  // Forward message to the output.  Called by the reader thread.
+  void forward(PmTimestamp timestamp, PmMessage message);
+
+  // Turn off the notes that the route has forwarded and that have
+  // not been turned off yet.  Called when the route is removed.
+  void stopNotes();
+
+  uint32_t id() const { return _id; }
+  Local<Object> outputObject() const { return Local<Object>::New(_outputObject); }
+
+private:
+  uint32_t _id;
+  MIDIOutput* _output;
+  Persistent<Object> _outputObject;             // keeps the output alive
+
+  uint32_t _types;                              // bit mask of MIDI::MessageType
+  uint16_t _channels;                           // bit mask, bit 0 is channel 1
+  int _lowKey;
+  int _highKey;
+  int _channel;                                 // target channel, or -1
+  int _transpose;
+  int _velocity;                                // fixed note on velocity, or 0
+
+  SoundingNotes _soundingNotes;                 // reader thread only
+
+  static int intOption(Handle<Object> options, const char* name, int defaultValue, int min, int max)
+    throw(JSException);
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to implement a looping pattern sequencer.  A pattern holds a
+// list of events at tick positions and plays them to a MIDIOutput from
+// the Porttime thread, without involving JavaScript.  Changes to the
+// events, the tempo and the swing are applied at the next loop
+// boundary while the pattern is playing.
+// //////////////////////////////////////////////////////////////////
+class Pattern
+  : public ObjectWrap,
+    public Porttime::Client
+{
+public:
+  Pattern(MIDIOutput* output, Handle<Object> outputObject);
+  virtual ~Pattern();
+
+  virtual void tick(int64_t microseconds);
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> setEvents(const Arguments& args);
+  static Handle<Value> setTempo(const Arguments& args);
+  static Handle<Value> setSwing(const Arguments& args);
+  static Handle<Value> start(const Arguments& args);
+  static Handle<Value> stop(const Arguments& args);
+  static Handle<Value> playing(const Arguments& args);
+  static Handle<Value> loopCount(const Arguments& args);
+
+private:
+  // Events are queued in the output this many milliseconds ahead, if
+  // the output has a latency
+  enum { LOOKAHEAD = 10, DEFAULT_TICKS_PER_BEAT = 96 };
+
+  struct Event {
+    uint32_t tick;
+    PmMessage message;
+    bool operator<(const Event& other) const { return tick < other.tick; }
+  };
+
+  struct Configuration {
+    vector<Event> events;                       // sorted by tick
+    uint32_t length;                            // loop length in ticks
+    uint32_t ticksPerBeat;
+    double tempo;                               // beats per minute
+    double swing;                               // 0 is straight
+    uint32_t swingUnit;                         // ticks
+
+    double microsecondsPerTick() const { return 60000000.0 / (tempo * ticksPerBeat); }
+    double swungTick(uint32_t tick) const;
+  };
+
+  MIDIOutput* _output;
+  Persistent<Object> _outputObject;             // keeps the output alive
+
+  // _mutex protects everything below against the Porttime thread
+  mutex _mutex;
+  Configuration _current;                       // used by the Porttime thread
+  Configuration _next;                          // changed by JavaScript
+  bool _changed;                                // _next to be applied at the next loop
+
+  bool _playing;
+  int64_t _loopStart;                           // time of the current loop, us
+  size_t _nextEvent;                            // index into _current.events
+  uint32_t _loopCount;
+  PmTimestamp _lastSendTime;                    // of the last event sent
+  SoundingNotes _soundingNotes;
+};
+
+// //////////////////////////////////////////////////////////////////
+// Base class for players that stream messages from the Porttime
+// thread, either to a MIDIOutput or, if there is no output, to
+// JavaScript as 'message' events.  Subclasses supply the messages in
+// playUntil().  'end' is emitted when all messages have been played.
+// //////////////////////////////////////////////////////////////////
+class SequencePlayer
+  : public EventEmitter,
+    public Porttime::Client
+{
+public:
+  SequencePlayer(MIDIOutput* output, Handle<Object> outputObject);
+  virtual ~SequencePlayer();
+
+  virtual void tick(int64_t microseconds);
+
+  // v8 interface
+public:
+  static void SetPrototypeMethods(Handle<FunctionTemplate> playerTemplate);
+
+  static Handle<Value> play(const Arguments& args);
+  static Handle<Value> stop(const Arguments& args);
+  static Handle<Value> playing(const Arguments& args);
+
+protected:
+  // Messages are queued in the output this many milliseconds ahead,
+  // if the output has a latency
+  enum { LOOKAHEAD = 20 };
+
+  // Called with _mutex held.  startAt() prepares to play from the
+  // current position at time when, playUntil() plays the messages due
+  // up to horizon and returns false when there are no more messages.
+  // Both times are in microseconds.
+  virtual bool atEnd() const = 0;
+  virtual void rewind() = 0;
+  virtual void startAt(int64_t when) = 0;
+  virtual bool playUntil(int64_t horizon) = 0;
+
+  void sendMessage(PmTimestamp when, PmMessage message);
+  void sendSysex(PmTimestamp when, const unsigned char* sysex, size_t length);
+
+  // Continue from a changed position or speed right after the
+  // messages that have been sent already.  Called with _mutex held.
+  void restart();
+
+  MIDIOutput* _output;                          // 0 to play to JavaScript
+  Persistent<Object> _outputObject;             // keeps the output alive
+
+  // _mutex protects the state of the player against the Porttime thread
+  mutex _mutex;
+  bool _playing;
+  PmTimestamp _lastSendTime;                    // of the last message sent
+
+private:
+  SoundingNotes _soundingNotes;
+
+  // Messages played to JavaScript, handed over to the JavaScript
+  // thread through _notifier
+  struct PlayedMessage {
+    PmTimestamp time;
+    size_t offset;                              // into _playedBytes
+    size_t length;
+  };
+  vector<PlayedMessage> _played;
+  vector<unsigned char> _playedBytes;
+  bool _ended;                                  // set when the end has been reached
+
+  // Set while the player keeps itself and the event loop alive,
+  // only used in the JavaScript thread
+  bool _active;
+
+  ev_async _notifier;
+  static void notified(EV_P_ ev_async* watcher, int revents);
+  void deactivate();
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to implement a Standard MIDI File player.  The file is mapped
+// into memory and its events are decoded only shortly before they are
+// due.  See smf.h.
+// //////////////////////////////////////////////////////////////////
+class SMFPlayer
+  : public SequencePlayer
+{
+public:
+  SMFPlayer(MIDIOutput* output, Handle<Object> outputObject, const char* filename)
+    throw(JSException);
+  virtual ~SMFPlayer();
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> seek(const Arguments& args);
+  static Handle<Value> seekBar(const Arguments& args);
+  static Handle<Value> position(const Arguments& args);
+  static Handle<Value> duration(const Arguments& args);
+
+protected:
+  virtual bool atEnd() const;
+  virtual void rewind();
+  virtual void startAt(int64_t when);
+  virtual bool playUntil(int64_t horizon);
+
+private:
+  static Handle<Value> seekTo(const Arguments& args, bool bar);
+
+  smffile* _file;
+  smfsequence* _sequence;
+
+  int64_t _timeOrigin;                          // us, time of _startMicros
+  double _startMicros;                          // file time at which playing started
+  vector<unsigned char> _sysex;                 // sysex message being sent
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to replay a journal recorded by MIDIInput.record().  The
+// journal is mapped into memory, see journal.h.  Messages are played
+// at their recorded time intervals, scaled by the playback speed.
+// //////////////////////////////////////////////////////////////////
+class JournalPlayer
+  : public SequencePlayer
+{
+public:
+  JournalPlayer(const char* filename, MIDIOutput* output, Handle<Object> outputObject)
+    throw(JSException);
+  virtual ~JournalPlayer();
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> seek(const Arguments& args);
+  static Handle<Value> setSpeed(const Arguments& args);
+  static Handle<Value> position(const Arguments& args);
+
+protected:
+  virtual bool atEnd() const;
+  virtual void rewind();
+  virtual void startAt(int64_t when);
+  virtual bool playUntil(int64_t horizon);
+
+private:
+  enum { MAX_SYSEX_LENGTH = 1048576 };
+
+  journalreader* _journal;
+  journalreader::position _position;
+  double _speed;
+  int64_t _timeOrigin;                          // us, time of _startTimestamp
+  uint32_t _startTimestamp;                     // recorded time at which playing started
+
+  // Sysex messages are reassembled from the recorded events
+  vector<unsigned char> _sysex;
+  bool _inSysex;
+
+  void playEvent(PmTimestamp when, PmMessage message);
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to implement a MIDI clock source.  Timing clock messages (24
+// per quarter note) are sent to one or more outputs from the Porttime
+// thread.  The deadline of every pulse is computed from the start of
+// the current tempo segment rather than from the previous pulse, so
+// rounding and scheduling errors do not accumulate.  A segment is
+// either a constant tempo or a linear tempo ramp followed by a
+// constant tempo.
+// //////////////////////////////////////////////////////////////////
+class MIDIClock
+  : public ObjectWrap,
+    public Porttime::Client
+{
+public:
+  MIDIClock(double bpm);
+  virtual ~MIDIClock();
+
+  void addOutput(MIDIOutput* output, Handle<Object> outputObject);
+
+  virtual void tick(int64_t microseconds);
+
+  // v8 interface
+public:
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> setTempo(const Arguments& args);
+  static Handle<Value> tempo(const Arguments& args);
+  static Handle<Value> start(const Arguments& args);
+  static Handle<Value> stop(const Arguments& args);
+  static Handle<Value> continue_(const Arguments& args);
+  static Handle<Value> setSongPosition(const Arguments& args);
+  static Handle<Value> songPosition(const Arguments& args);
+  static Handle<Value> running(const Arguments& args);
+  static Handle<Value> jitter(const Arguments& args);
+  static Handle<Value> resetJitter(const Arguments& args);
+
+private:
+  // Pulses are queued in the outputs this many milliseconds ahead, if
+  // all outputs have a latency
+  enum {
+    LOOKAHEAD = 10,
+    PULSES_PER_QUARTER = 24,
+    PULSES_PER_SIXTEENTH = 6,
+    START = 0xfa,
+    CONTINUE = 0xfb,
+    STOP = 0xfc,
+    TIMING_CLOCK = 0xf8,
+    SONG_POSITION_POINTER = 0xf2
+  };
+
+  // Times are in microseconds, durations within the segment in ms
+  struct Segment {
+    int64_t startTime;
+    double startPulse;                          // pulses at startTime
+    double startTempo;                          // bpm
+    double endTempo;                            // bpm, reached after rampDuration
+    double rampDuration;                        // ms, 0 for constant tempo
+
+    double tempoAt(int64_t time) const;
+    double pulsesAt(int64_t time) const;
+    int64_t timeOfPulse(double pulse) const;
+  };
+
+  vector<MIDIOutput*> _outputs;
+  vector< Persistent<Object> > _outputObjects;  // keep the outputs alive
+  bool _allLatency;                             // all outputs have a latency
+
+  // _mutex protects everything below against the Porttime thread
+  mutex _mutex;
+  Segment _segment;
+  bool _running;
+  uint32_t _pulse;                              // song position of the next pulse
+  PmTimestamp _lastSendTime;
+
+  // Difference between the time at which each pulse was sent, or
+  // queued to be sent by portmidi, and its deadline, in ms
+  uint32_t _jitterCount;
+  double _jitterMean;
+  double _jitterM2;                             // sum of squared deviations
+  double _jitterMin;
+  double _jitterMax;
+
+  void recordJitter(double error);
+  void send(PmTimestamp when, PmMessage message);
+  void startAt(int64_t time, unsigned char status);
+  void deactivate();
+};
+
+// //////////////////////////////////////////////////////////////////
+// Class to hold a compiled transform program that MIDI.transform()
+// runs over buffers of packed event records.  The operations are
+// compiled into lookup tables when the Transform is constructed, see
+// transform.h.
+// //////////////////////////////////////////////////////////////////
+class Transform
+  : public ObjectWrap
+{
+public:
+  // v8 interface
+  static void Initialize(Handle<Object> target);
+
+  static Handle<Value> New(const Arguments& args);
+  static Handle<Value> transform(const Arguments& args);
+
+  static Persistent<FunctionTemplate> constructorTemplate;
+
+private:
+  transformprogram _program;
+
+  void compile(Handle<Object> operation) throw(JSException);
+
+  static uint16_t channelsOption(Handle<Object> options) throw(JSException);
+  static void keysOption(Handle<Object> options, transformprogram::operation& op) throw(JSException);
+  static void curveOption(Handle<Object> options, transformprogram::operation& op, int minimum) throw(JSException);
+};
+
+// //////////////////////////////////////////////////////////////////
+// MIDI guts
+// //////////////////////////////////////////////////////////////////
+
+const char* MIDI::_messageTypeNames[MESSAGE_TYPE_COUNT] = {
+  "noteOff", "noteOn", "polyphonicKeyPressure", "controlChange",
+  "programChange", "channelPressure", "pitchWheelChange",
+  "sysex", "midiTimeCode", "songPositionPointer", "songSelect",
+  "tuneRequest", "timingClock", "tick", "start", "continue", "stop",
+  "activeSensing", "reset",
+  "nrpn7", "nrpn14", "rpn", "cc14"
+};
+
+const MIDI::MessageType MIDI::_systemMessageTypes[16] = {
+  SYSEX, MIDI_TIME_CODE, SONG_POSITION_POINTER, SONG_SELECT,
+  UNDEFINED_MESSAGE, UNDEFINED_MESSAGE, TUNE_REQUEST, UNDEFINED_MESSAGE,
+  TIMING_CLOCK, TICK, START, CONTINUE,
+  STOP, UNDEFINED_MESSAGE, ACTIVE_SENSING, RESET
+};
+
+Persistent<String> MIDI::messageTypeSymbols[MESSAGE_TYPE_COUNT];
+
+MIDI::MessageType
+MIDI::messageType(const char* name)
+{
+  for (int i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+    if (!strcmp(name, _messageTypeNames[i])) {
+      return static_cast<MessageType>(i);
+    }
+  }
+  return UNDEFINED_MESSAGE;
+}
+
+mutex MIDI::_timedCallbacksMutex;
+timingwheel<MIDI::TimedCallback> MIDI::_timedCallbacks;
+vector<MIDI::TimedCallback> MIDI::_dueCallbacks;
+vector<MIDI::TimedCallback> MIDI::_runningCallbacks;
+uint32_t MIDI::_lastTimedCallbackId = 0;
+bool MIDI::_timedCallbacksActive = false;
+int64_t MIDI::_dueSince = 0;
+histogram MIDI::_callbackLatency;
+double MIDI::_lookahead = 0;
+bool MIDI::_adaptiveLookahead = false;
+double MIDI::_lookaheadMinimum = DEFAULT_LOOKAHEAD_MINIMUM;
+double MIDI::_lookaheadMaximum = DEFAULT_LOOKAHEAD_MAXIMUM;
+double MIDI::_dispatchLatency = 0;
+ev_async MIDI::_timedCallbackNotifier;
+bool MIDI::_microseconds = false;
+
+// Names of the trace events and of their arguments, in the order of
+// TraceEvent
+static const tracerecorder::eventtype traceEventTypes[] = {
+  { "timer pass", "late" },
+  { "poll", "pending" },
+  { "read", "events" },
+  { "sysex unpack", "bytes" },
+  { "queue push", "events" },
+  { "queue pop", "events" },
+  { "dispatch", "messages" },
+  { "write", "events" },
+  { "timed callbacks", "callbacks" }
+};
+
+tracerecorder MIDI::trace(Porttime::microseconds, traceEventTypes);
+
+// Called by the Porttime thread
+void
+MIDI::runTimedCallbacks(PmTimestamp timestamp)
+{
+  unique_lock<mutex> lock(_timedCallbacksMutex);
+
+  if (_timedCallbacks.empty()) {
+    return;
+  }
+  const bool wasDue = !_dueCallbacks.empty();
+  _timedCallbacks.expire(timestamp, CollectCallback());
+  if (!wasDue && !_dueCallbacks.empty()) {
+    ev_async_send(EV_DEFAULT_UC_ &_timedCallbackNotifier);
+  }
+}
+
+void
+MIDI::nextTimedCallback(PmTimestamp& next)
+{
+  unique_lock<mutex> lock(_timedCallbacksMutex);
+  timingwheel<TimedCallback>::time_type when;
+  if (_timedCallbacks.next(when)) {
+    next = Porttime::earliest(next, when);
+  }
+}
+
+// Keep the event loop referenced while callbacks are pending.  Called
+// in the JavaScript thread with _timedCallbacksMutex held.
+void
+MIDI::updateTimedCallbacksActive()
+{
+  const bool active = !_timedCallbacks.empty() || !_dueCallbacks.empty();
+  if (active != _timedCallbacksActive) {
+    if (active) {
+      ev_ref(EV_DEFAULT_UC);
+    } else {
+      ev_unref(EV_DEFAULT_UC);
+    }
+    _timedCallbacksActive = active;
+  }
+}
+
+double
+MIDI::currentLookahead()
+{
+  return _adaptiveLookahead ? adaptiveLookahead() : _lookahead;
+}
+
+// Twice the latency leaves a margin for latencies that are higher than
+// any seen recently
+double
+MIDI::adaptiveLookahead()
+{
+  return min(_lookaheadMaximum, _lookaheadMinimum + 2 * _dispatchLatency);
+}
+
+// The estimate follows rising latencies immediately and decays slowly
+// once they have fallen, so that a single quiet period does not shrink
+// the lookahead before the next garbage collection.
+void
+MIDI::updateDispatchLatency(double latency)
+{
+  if (latency > _dispatchLatency) {
+    _dispatchLatency = latency;
+  } else {
+    _dispatchLatency += (latency - _dispatchLatency) / 32;
+  }
+}
+
+// Call all callbacks that are due, in the order in which they became
+// due, within one handle scope
+void
+MIDI::timedCallbacksDue(EV_P_ ev_async* watcher, int revents)
+{
+  int64_t dueSince;
+  {
+    unique_lock<mutex> lock(_timedCallbacksMutex);
+    _runningCallbacks.swap(_dueCallbacks);
+    dueSince = _dueSince;
+  }
+  if (_runningCallbacks.empty()) {
+    return;
+  }
+  const uint32_t latency = Porttime::elapsed(dueSince);
+  _callbackLatency.record(latency);
+  updateDispatchLatency(latency / 1000.0);
+  const int64_t start = trace.now();
+  const uint32_t count = _runningCallbacks.size();
+
+  HandleScope scope;
+
+  for (size_t i = 0; i < _runningCallbacks.size(); i++) {
+    TimedCallback& timedCallback = _runningCallbacks[i];
+    if (!timedCallback.id) {
+      // cancelled by an earlier callback
+      continue;
+    }
+    timedCallback.id = 0;
+
+    Local<Value> argv[1];
+    argv[0] = preciseTimeValue(timedCallback.time);
+
+    TryCatch tryCatch;
+    timedCallback.callback->Call(Context::GetCurrent()->Global(), 1, argv);
+    timedCallback.callback.Dispose();
+
+    if (tryCatch.HasCaught()) {
+      // The remaining callbacks are called once the exception has
+      // been reported
+      {
+        unique_lock<mutex> lock(_timedCallbacksMutex);
+        if (_dueCallbacks.empty()) {
+          _dueSince = Porttime::microseconds();
+        }
+        _dueCallbacks.insert(_dueCallbacks.begin(), _runningCallbacks.begin() + i + 1, _runningCallbacks.end());
+      }
+      ev_async_send(EV_DEFAULT_UC_ &_timedCallbackNotifier);
+      _runningCallbacks.clear();
+      FatalException(tryCatch);
+      break;
+    }
+  }
+  _runningCallbacks.clear();
+  trace.finish(TRACE_CALLBACKS, start, count);
+
+  unique_lock<mutex> lock(_timedCallbacksMutex);
+  updateTimedCallbacksActive();
+}
+
+// v8 interface
+
+Handle<Value>
+MIDI::getPorts(PortDirection direction)
+{
+  Local<Array> retval = Array::New();
+  unsigned count = 0;
+  for (int id = 0; id < Pm_CountDevices(); id++) {
+    const PmDeviceInfo* deviceInfo = Pm_GetDeviceInfo(id);
+    if ((direction == MIDI::INPUT) ^ deviceInfo->output) {
+      retval->Set(count++, String::New(deviceInfo->name));
+    }
+  }
+  return retval;
+}
+
+Handle<Value>
+MIDI::inputPorts(const Arguments& args)
+{
+  return getPorts(MIDI::INPUT);
+}
+
+Handle<Value>
+MIDI::outputPorts(const Arguments& args)
+{
+  return getPorts(MIDI::OUTPUT);
+}
+
+Local<Value>
+MIDI::timeValue(PmTimestamp time)
+{
+  if (_microseconds) {
+    return Number::New(Porttime::expand(time));
+  }
+  return v8::Integer::New(time);
+}
+
+Local<Value>
+MIDI::preciseTimeValue(int64_t microseconds)
+{
+  if (_microseconds) {
+    return Number::New(microseconds);
+  }
+  return v8::Integer::New(Porttime::truncate(microseconds));
+}
+
+int64_t
+MIDI::timeArgument(Handle<Value> value)
+{
+  if (_microseconds) {
+    return value->IntegerValue();
+  }
+  return (int64_t) value->Int32Value() * 1000;
+}
+
+Handle<Value>
+MIDI::currentTime(const Arguments& args)
+{
+  return preciseTimeValue(Porttime::microseconds());
+}
+
+// setTimeBase('milliseconds' | 'microseconds').  Selects the time base
+// of the times passed between JavaScript and the native code.
+Handle<Value>
+MIDI::setTimeBase(const Arguments& args)
+{
+  const string name = args.Length() == 1 ? *String::Utf8Value(args[0]) : "";
+  if (name == "milliseconds") {
+    _microseconds = false;
+  } else if (name == "microseconds") {
+    _microseconds = true;
+  } else {
+    return ThrowException(String::New("need 'milliseconds' or 'microseconds' argument in MIDI.setTimeBase"));
+  }
+  return Undefined();
+}
+
+Handle<Value>
+MIDI::timeBase(const Arguments& args)
+{
+  return String::New(_microseconds ? "microseconds" : "milliseconds");
+}
+
+// at(time, callback, [lookahead]).  The callback is called lookahead
+// milliseconds before time, by default with the lookahead set by
+// setLookahead().  lookahead may be 'adaptive'.  Callbacks are due on
+// whole milliseconds, a time between two milliseconds is due on the
+// later one.  Returns an id that can be passed to cancelAt().
+Handle<Value>
+MIDI::at(const Arguments& args)
+{
+  try {
+    if (args.Length() < 2 || args.Length() > 3) {
+      throw JSException("unexpected number of arguments to MIDI.at(timestamp, callback)");
+    }
+    if (!args[0]->IsNumber() || !args[1]->IsFunction()) {
+      throw JSException("need timestamp and function arguments in MIDI.at(timestamp, callback)");
+    }
+
+    double lookahead = currentLookahead();
+    if (args.Length() > 2 && !args[2]->IsUndefined()) {
+      if (args[2]->IsNumber() && args[2]->NumberValue() >= 0) {
+        lookahead = args[2]->NumberValue();
+      } else if (args[2]->IsString() && !strcmp(*String::Utf8Value(args[2]), "adaptive")) {
+        lookahead = adaptiveLookahead();
+      } else {
+        throw JSException("lookahead must be a number of milliseconds or 'adaptive'");
+      }
+    }
+
+    TimedCallback timedCallback;
+    if (!++_lastTimedCallbackId) {
+      ++_lastTimedCallbackId;
+    }
+    timedCallback.id = _lastTimedCallbackId;
+    timedCallback.time = timeArgument(args[0]);
+    timedCallback.callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+
+    const PmTimestamp due = Porttime::truncate(timedCallback.time + 999) - (PmTimestamp) floor(lookahead + 0.5);
+    {
+      unique_lock<mutex> lock(_timedCallbacksMutex);
+      _timedCallbacks.insert(due, timedCallback, timedCallback.id);
+      updateTimedCallbacksActive();
+    }
+    Porttime::schedule(due);
+
+    return v8::Integer::NewFromUnsigned(timedCallback.id);
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// cancelAt(id).  Returns true if the callback was still pending.
+Handle<Value>
+MIDI::cancelAt(const Arguments& args)
+{
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return ThrowException(String::New("need id argument in MIDI.cancelAt(id)"));
+  }
+  const uint32_t id = args[0]->Uint32Value();
+  if (!id) {
+    return False();
+  }
+
+  // Callbacks that are due in the batch being run
+  for (vector<TimedCallback>::iterator i = _runningCallbacks.begin(); i != _runningCallbacks.end(); i++) {
+    if (i->id == id) {
+      i->id = 0;
+      i->callback.Dispose();
+      return True();
+    }
+  }
+
+  unique_lock<mutex> lock(_timedCallbacksMutex);
+  bool cancelled = _timedCallbacks.cancel(id, DisposeCallback()) > 0;
+  for (vector<TimedCallback>::iterator i = _dueCallbacks.begin(); !cancelled && i != _dueCallbacks.end(); i++) {
+    if (i->id == id) {
+      i->callback.Dispose();
+      _dueCallbacks.erase(i);
+      cancelled = true;
+      break;
+    }
+  }
+  updateTimedCallbacksActive();
+
+  return cancelled ? True() : False();
+}
+
+// setLookahead(milliseconds) sets a fixed lookahead for at()
+// callbacks.  setLookahead('adaptive', [minimum], [maximum]) makes it
+// follow the dispatch latency, between minimum and maximum
+// milliseconds.
+Handle<Value>
+MIDI::setLookahead(const Arguments& args)
+{
+  if (args.Length() == 1 && args[0]->IsNumber() && args[0]->NumberValue() >= 0) {
+    _adaptiveLookahead = false;
+    _lookahead = args[0]->NumberValue();
+    return Undefined();
+  }
+
+  if (args.Length() >= 1 && args.Length() <= 3
+      && args[0]->IsString() && !strcmp(*String::Utf8Value(args[0]), "adaptive")) {
+    const double minimum = (args.Length() > 1) ? args[1]->NumberValue() : DEFAULT_LOOKAHEAD_MINIMUM;
+    const double maximum = (args.Length() > 2) ? args[2]->NumberValue() : DEFAULT_LOOKAHEAD_MAXIMUM;
+    if (!(minimum >= 0 && maximum >= minimum)) {
+      return ThrowException(String::New("invalid adaptive lookahead range"));
+    }
+    _adaptiveLookahead = true;
+    _lookaheadMinimum = minimum;
+    _lookaheadMaximum = maximum;
+    return Undefined();
+  }
+
+  return ThrowException(String::New("need number of milliseconds or 'adaptive' argument in MIDI.setLookahead"));
+}
+
+// Current lookahead in milliseconds, and the dispatch latency estimate
+Handle<Value>
+MIDI::lookahead(const Arguments& args)
+{
+  HandleScope scope;
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("lookahead"), Number::New(currentLookahead()));
+  result->Set(String::NewSymbol("adaptive"), Boolean::New(_adaptiveLookahead));
+  result->Set(String::NewSymbol("dispatchLatency"), Number::New(_dispatchLatency));
+  return scope.Close(result);
+}
+
+// setTimerPriority(priority).  A priority above 0 runs the timer thread
+// in the SCHED_FIFO real-time scheduling class with that priority, 0
+// in the default class.
+Handle<Value>
+MIDI::setTimerPriority(const Arguments& args)
+{
+  try {
+    if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+      throw JSException("need priority argument in MIDI.setTimerPriority(priority)");
+    }
+    Porttime::setPriority(args[0]->Int32Value());
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// setTimerAffinity([cpus]).  Restricts the timer thread to the given
+// CPUs, or allows all CPUs if cpus is empty or not given.
+Handle<Value>
+MIDI::setTimerAffinity(const Arguments& args)
+{
+  try {
+    vector<int> cpus;
+    if (args.Length() > 0 && !args[0]->IsUndefined()) {
+      if (!args[0]->IsArray()) {
+        throw JSException("need array of CPU numbers in MIDI.setTimerAffinity([cpus])");
+      }
+      Local<Array> array = Local<Array>::Cast(args[0]);
+      for (uint32_t i = 0; i < array->Length(); i++) {
+        cpus.push_back(array->Get(i)->Int32Value());
+      }
+    }
+    Porttime::setAffinity(cpus);
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Local<Object>
+MIDI::histogramSummary(const histogram::summary& values)
+{
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("count"), Number::New(values.count));
+  result->Set(String::NewSymbol("min"), Number::New(values.min));
+  result->Set(String::NewSymbol("max"), Number::New(values.max));
+  result->Set(String::NewSymbol("mean"), Number::New(values.mean));
+  result->Set(String::NewSymbol("p50"), Number::New(values.p50));
+  result->Set(String::NewSymbol("p90"), Number::New(values.p90));
+  result->Set(String::NewSymbol("p99"), Number::New(values.p99));
+  result->Set(String::NewSymbol("p999"), Number::New(values.p999));
+  return result;
+}
+
+// Statistics of the timer thread.  Times are in microseconds.
+Handle<Value>
+MIDI::timerStats(const Arguments& args)
+{
+  HandleScope scope;
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("passes"), Number::New(Porttime::passes));
+  result->Set(String::NewSymbol("earlyWakeups"), Number::New(Porttime::earlyWakeups));
+  result->Set(String::NewSymbol("jitter"), histogramSummary(Porttime::jitter));
+  result->Set(String::NewSymbol("overruns"), histogramSummary(Porttime::overruns));
+  return scope.Close(result);
+}
+
+Handle<Value>
+MIDI::resetTimerStats(const Arguments& args)
+{
+  __sync_lock_test_and_set(&Porttime::passes, 0);
+  __sync_lock_test_and_set(&Porttime::earlyWakeups, 0);
+  Porttime::jitter.reset();
+  Porttime::overruns.reset();
+  return Undefined();
+}
+
+// Statistics of the timer thread, timed callbacks and all open ports.
+// Times are in microseconds.
+Handle<Value>
+MIDI::stats(const Arguments& args)
+{
+  HandleScope scope;
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("timer"), timerStats(args));
+  Local<Object> callbacks = Object::New();
+  callbacks->Set(String::NewSymbol("latency"), histogramSummary(_callbackLatency));
+  result->Set(String::NewSymbol("callbacks"), callbacks);
+  result->Set(String::NewSymbol("inputs"), MIDIInput::allStats());
+  result->Set(String::NewSymbol("outputs"), MIDIOutput::allStats());
+  return scope.Close(result);
+}
+
+Handle<Value>
+MIDI::resetStats(const Arguments& args)
+{
+  resetTimerStats(args);
+  _callbackLatency.reset();
+  MIDIInput::resetAllStats();
+  MIDIOutput::resetAllStats();
+  return Undefined();
+}
+
+// Start recording trace events, discarding those of an earlier trace.
+// Each thread keeps the given number of its most recent events.
+Handle<Value>
+MIDI::startTrace(const Arguments& args)
+{
+  try {
+    if (args.Length() > 1 || (args.Length() == 1 && (!args[0]->IsNumber() || args[0]->IntegerValue() < 1))) {
+      throw JSException("invalid arguments to MIDI.startTrace([recordsPerThread])");
+    }
+    trace.start(args.Length() ? args[0]->IntegerValue() : (int64_t) tracerecorder::DEFAULT_CAPACITY);
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDI::stopTrace(const Arguments& args)
+{
+  trace.stop();
+  return Undefined();
+}
+
+// The recorded events as a string in the trace event format, for
+// chrome://tracing
+Handle<Value>
+MIDI::dumpTrace(const Arguments& args)
+{
+  HandleScope scope;
+  ostringstream json;
+  trace.write(json);
+  return scope.Close(String::New(json.str().c_str(), json.str().size()));
+}
+
+// Options are throttle (limit to DIN MIDI bandwidth), jitter (maximum
+// random delay in microseconds) and seed (of the jitter)
+Handle<Value>
+MIDI::createVirtualPort(const Arguments& args)
+{
+  try {
+    if (args.Length() < 1 || args.Length() > 2 || !args[0]->IsString()
+        || (args.Length() == 2 && !args[1]->IsObject())) {
+      throw JSException("invalid arguments to MIDI.createVirtualPort(name, [options])");
+    }
+    bool throttle = false;
+    uint32_t jitter = 0;
+    uint32_t seed = 0;
+    if (args.Length() == 2) {
+      Local<Object> options = args[1]->ToObject();
+      throttle = options->Get(String::NewSymbol("throttle"))->BooleanValue();
+      Local<Value> value = options->Get(String::NewSymbol("jitter"));
+      if (!value->IsUndefined()) {
+        if (!value->IsNumber() || value->IntegerValue() < 0 || value->IntegerValue() > 1000000) {
+          throw JSException("virtual port jitter must be between 0 and 1000000 microseconds");
+        }
+        jitter = value->Uint32Value();
+      }
+      value = options->Get(String::NewSymbol("seed"));
+      if (!value->IsUndefined()) {
+        if (!value->IsNumber()) {
+          throw JSException("virtual port seed must be a number");
+        }
+        seed = value->Uint32Value();
+      }
+    }
+    VirtualPort::create(*String::Utf8Value(args[0]), throttle, jitter, seed);
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+void
+MIDI::Initialize(Handle<Object> target) {
+  HandleScope scope;
 
   target->Set(String::NewSymbol("inputPorts"), FunctionTemplate::New(inputPorts)->GetFunction());
   target->Set(String::NewSymbol("outputPorts"), FunctionTemplate::New(outputPorts)->GetFunction());
   target->Set(String::NewSymbol("currentTime"), FunctionTemplate::New(currentTime)->GetFunction());
   target->Set(String::NewSymbol("at"), FunctionTemplate::New(at)->GetFunction());
+  target->Set(String::NewSymbol("cancelAt"), FunctionTemplate::New(cancelAt)->GetFunction());
+  target->Set(String::NewSymbol("setLookahead"), FunctionTemplate::New(setLookahead)->GetFunction());
+  target->Set(String::NewSymbol("lookahead"), FunctionTemplate::New(lookahead)->GetFunction());
+  target->Set(String::NewSymbol("setTimeBase"), FunctionTemplate::New(setTimeBase)->GetFunction());
+  target->Set(String::NewSymbol("timeBase"), FunctionTemplate::New(timeBase)->GetFunction());
+  target->Set(String::NewSymbol("setTimerPriority"), FunctionTemplate::New(setTimerPriority)->GetFunction());
+  target->Set(String::NewSymbol("setTimerAffinity"), FunctionTemplate::New(setTimerAffinity)->GetFunction());
+  target->Set(String::NewSymbol("timerStats"), FunctionTemplate::New(timerStats)->GetFunction());
+  target->Set(String::NewSymbol("resetTimerStats"), FunctionTemplate::New(resetTimerStats)->GetFunction());
+  target->Set(String::NewSymbol("stats"), FunctionTemplate::New(stats)->GetFunction());
+  target->Set(String::NewSymbol("resetStats"), FunctionTemplate::New(resetStats)->GetFunction());
+  target->Set(String::NewSymbol("startTrace"), FunctionTemplate::New(startTrace)->GetFunction());
+  target->Set(String::NewSymbol("stopTrace"), FunctionTemplate::New(stopTrace)->GetFunction());
+  target->Set(String::NewSymbol("dumpTrace"), FunctionTemplate::New(dumpTrace)->GetFunction());
+  target->Set(String::NewSymbol("createVirtualPort"), FunctionTemplate::New(createVirtualPort)->GetFunction());
+
+  trace.name("javascript");
+
+  ev_async_init(&_timedCallbackNotifier, timedCallbacksDue);
+  ev_async_start(EV_DEFAULT_UC_ &_timedCallbackNotifier);
+  ev_unref(EV_DEFAULT_UC);
+
+  for (int i = 0; i < MESSAGE_TYPE_COUNT; i++) {
+    messageTypeSymbols[i] = NODE_PSYMBOL(_messageTypeNames[i]);
+  }
+
+  MIDIInput::Initialize(target);
+  MIDIOutput::Initialize(target);
+  Pattern::Initialize(target);
+  SMFPlayer::Initialize(target);
+  JournalPlayer::Initialize(target);
+  MIDIClock::Initialize(target);
+  Transform::Initialize(target);
+}
+
+// //////////////////////////////////////////////////////////////////
+// MIDIStream guts
+// //////////////////////////////////////////////////////////////////
+
+MIDIStream::MIDIStream(MIDI::PortDirection direction, const char* portNameArg)
+{
+  const char* environmentVariableName = (direction == MIDI::INPUT) ? "MIDI_INPUT" : "MIDI_OUTPUT";
+  const char* portNameFromEnvironment = getenv(environmentVariableName);
+  bool useFirst = false;
+
+  string portName = portNameArg ? portNameArg : "";
+  if (portNameArg) {
+    portName = portNameArg;
+  } else if (portNameFromEnvironment) {
+    portName = portNameFromEnvironment;
+  } else {
+    useFirst = true;
+  }
+
+  for (int id = 0; id < Pm_CountDevices(); id++) {
+    const PmDeviceInfo* deviceInfo = Pm_GetDeviceInfo(id);
+    if (((direction == MIDI::INPUT) ^ deviceInfo->output)
+        && (useFirst || (portName == deviceInfo->name))) {
+      _portName = deviceInfo->name;
+      _portId = id;
+      return;
+    }
+  }
+
+  // no matching port found
+  const char* directionName = (direction == MIDI::INPUT) ? "input" : "output";;
+  if (useFirst) {
+    throw JSException((string) "no MIDI " + directionName + " ports");
+  } else {
+    if (!portNameArg) {
+      throw JSException((string) "invalid MIDI " + directionName + " port name \"" + portName + "\" in " + environmentVariableName + " environment variable");
+    } else {
+      throw JSException((string) "invalid MIDI " + directionName + " port name \"" + portName + "\"");
+    }
+  }
+
+}
+
+int MIDIStream::_openStreams = 0;
+
+MIDIStream::~MIDIStream()
+{
+  closePort();
+}
+
+void
+MIDIStream::closePort()
+{
+  if (_pmMidiStream) {
+    Pm_Close(_pmMidiStream);
+    _pmMidiStream = 0;
+    _openStreams--;
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// VirtualPort guts
+// //////////////////////////////////////////////////////////////////
+
+vector<VirtualPort*> VirtualPort::_ports;
+
+pm_fns_node VirtualPort::_dictionary = {
+  VirtualPort::writeShort,
+  VirtualPort::beginSysex,
+  VirtualPort::endSysex,
+  VirtualPort::writeByte,
+  VirtualPort::writeShort,                      // realtime messages within sysex
+  VirtualPort::writeFlush,
+  VirtualPort::synchronize,
+  VirtualPort::openDevice,
+  VirtualPort::abortDevice,
+  VirtualPort::closeDevice,
+  VirtualPort::pollDevice,
+  VirtualPort::hasHostError,
+  VirtualPort::hostError
+};
+
+VirtualPort::VirtualPort(const string& name, bool throttle, uint32_t jitter, uint32_t seed)
+  : _name(name),
+    _throttle(throttle),
+    _jitter(jitter),
+    _random(seed ? seed : 1),
+    _input(0),
+    _lineFree(0),
+    _lastArrival(0)
+{
+}
+
+// Called in the JavaScript thread.  Adding a device may reallocate
+// portmidi's device table, which the reader and timer threads access
+// through open streams, so ports can only be created while no stream
+// is open.
+void
+VirtualPort::create(const string& name, bool throttle, uint32_t jitter, uint32_t seed)
+  throw(JSException)
+{
+  if (name.empty()) {
+    throw JSException("virtual MIDI port name must not be empty");
+  }
+  if (MIDIStream::openStreams()) {
+    throw JSException("virtual MIDI ports cannot be created while MIDI ports are open");
+  }
+  for (int id = 0; id < Pm_CountDevices(); id++) {
+    if (name == Pm_GetDeviceInfo(id)->name) {
+      throw JSException("MIDI port \"" + name + "\" already exists");
+    }
+  }
+
+  // portmidi keeps pointers to the name, ports are never deleted
+  VirtualPort* port = new VirtualPort(name, throttle, jitter, seed);
+  char* portName = const_cast<char*>(port->_name.c_str());
+  // Depending on the portmidi version, pm_add_device() returns
+  // pmNoError or the id of the new device
+  PmError e = pm_add_device(const_cast<char*>("virtual"), portName, true, port, &_dictionary);
+  if (e >= 0) {
+    e = pm_add_device(const_cast<char*>("virtual"), portName, false, port, &_dictionary);
+  }
+  if (e < 0) {
+    throw PortMidiJSException("could not create virtual MIDI port", e);
+  }
+  _ports.push_back(port);
+}
+
+void
+VirtualPort::createFromEnvironment()
+  throw(JSException)
+{
+  const char* names = getenv("MIDI_VIRTUAL_PORTS");
+  if (!names) {
+    return;
+  }
+  string list = names;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == string::npos) {
+      end = list.size();
+    }
+    if (end > start) {
+      create(list.substr(start, end - start), false, 0, 0);
+    }
+    start = end + 1;
+  }
+}
+
+// Called with the time at which a message is written, arrivals are
+// scheduled at the time at which the message leaves the output.
+// MIDIOutput writes messages that are to be sent immediately with a
+// timestamp of 0, portmidi ignores timestamps of outputs without
+// latency.
+void
+VirtualPort::transmit(PmInternal* output, PmTimestamp timestamp, PmMessage message, const vector<unsigned char>* sysex)
+{
+  const int64_t now = Porttime::microseconds();
+  int64_t time = now;
+  if (output->latency && timestamp) {
+    time = max(now, Porttime::expand(timestamp + output->latency));
+  }
+
+  unique_lock<mutex> lock(_mutex);
+  if (!_input) {
+    return;
+  }
+
+  if (_throttle) {
+    // Running status is not used, every message is sent in full
+    const size_t length = sysex ? sysex->size() : MIDI::messageLength(Pm_MessageStatus(message));
+    time = max(time, _lineFree) + length * DIN_BYTE_TIME;
+    _lineFree = time;
+  }
+  if (_jitter) {
+    // xorshift32
+    _random ^= _random << 13;
+    _random ^= _random >> 17;
+    _random ^= _random << 5;
+    time += _random % (_jitter + 1);
+  }
+  time = max(time, _lastArrival);
+  _lastArrival = time;
+
+  Arrival arrival;
+  arrival.time = time;
+  arrival.message = message;
+  arrival.sysex = 0;
+  arrival.length = 0;
+  if (sysex) {
+    // Sysex messages that cannot be copied for lack of memory are lost
+    arrival.sysex = static_cast<unsigned char*>(malloc(sysex->size()));
+    if (!arrival.sysex) {
+      return;
+    }
+    memcpy(arrival.sysex, &(*sysex)[0], sysex->size());
+    arrival.length = sysex->size();
+  }
+  _arrivals.push_back(arrival);
+}
+
+// Called with _mutex held
+void
+VirtualPort::discardArrivals()
+{
+  for (deque<Arrival>::iterator i = _arrivals.begin(); i != _arrivals.end(); i++) {
+    free(i->sysex);
+  }
+  _arrivals.clear();
+}
+
+PmError
+VirtualPort::openDevice(PmInternal* midi, void* driverInfo)
+{
+  VirtualPort* port = static_cast<VirtualPort*>(descriptors[midi->device_id].descriptor);
+  midi->descriptor = port;
+  if (!midi->write_flag) {
+    unique_lock<mutex> lock(port->_mutex);
+    if (port->_input) {
+      return pmInvalidDeviceId;
+    }
+    port->_input = midi;
+  }
+  return pmNoError;
+}
+
+PmError
+VirtualPort::closeDevice(PmInternal* midi)
+{
+  VirtualPort* port = portOf(midi);
+  if (!midi->write_flag) {
+    unique_lock<mutex> lock(port->_mutex);
+    port->_input = 0;
+    port->discardArrivals();
+    port->_lineFree = port->_lastArrival = 0;
+  }
+  midi->descriptor = 0;
+  return pmNoError;
+}
+
+PmError
+VirtualPort::abortDevice(PmInternal* midi)
+{
+  return pmNoError;
+}
+
+// Called by portmidi when the input is polled or read, hands the
+// messages that have arrived to portmidi, which filters and queues them
+PmError
+VirtualPort::pollDevice(PmInternal* midi)
+{
+  VirtualPort* port = portOf(midi);
+  const int64_t now = Porttime::microseconds();
+  unique_lock<mutex> lock(port->_mutex);
+  while (!port->_arrivals.empty() && port->_arrivals.front().time <= now) {
+    Arrival& arrival = port->_arrivals.front();
+    const PmTimestamp timestamp = Porttime::truncate(arrival.time);
+    if (arrival.sysex) {
+      pm_read_bytes(midi, arrival.sysex, arrival.length, timestamp);
+      free(arrival.sysex);
+    } else {
+      PmEvent event;
+      event.message = arrival.message;
+      event.timestamp = timestamp;
+      pm_read_short(midi, &event);
+    }
+    port->_arrivals.pop_front();
+  }
+  return pmNoError;
+}
+
+PmError
+VirtualPort::writeShort(PmInternal* midi, PmEvent* event)
+{
+  portOf(midi)->transmit(midi, event->timestamp, event->message, 0);
+  return pmNoError;
+}
+
+// The sysex bytes are collected by the writing thread, which portmidi
+// requires to be the only one writing to the output
+PmError
+VirtualPort::beginSysex(PmInternal* midi, PmTimestamp timestamp)
+{
+  portOf(midi)->_sysex.clear();
+  return pmNoError;
+}
+
+PmError
+VirtualPort::writeByte(PmInternal* midi, unsigned char byte, PmTimestamp timestamp)
+{
+  portOf(midi)->_sysex.push_back(byte);
+  return pmNoError;
+}
+
+PmError
+VirtualPort::endSysex(PmInternal* midi, PmTimestamp timestamp)
+{
+  VirtualPort* port = portOf(midi);
+  port->transmit(midi, timestamp, 0, &port->_sysex);
+  port->_sysex.clear();
+  return pmNoError;
+}
+
+PmError
+VirtualPort::writeFlush(PmInternal* midi, PmTimestamp timestamp)
+{
+  return pmNoError;
+}
+
+PmTimestamp
+VirtualPort::synchronize(PmInternal* midi)
+{
+  return Porttime::time();
+}
+
+unsigned int
+VirtualPort::hasHostError(PmInternal* midi)
+{
+  return 0;
+}
+
+void
+VirtualPort::hostError(PmInternal* midi, char* message, unsigned int length)
+{
+  if (length) {
+    message[0] = 0;
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// MIDIInput guts
+// //////////////////////////////////////////////////////////////////
+
+MIDIInput::MIDIInput(const char* portName)
+  throw(JSException)
+  : MIDIStream(MIDI::INPUT, portName),
+    _users(0),
+    _wakeupWatched(false),
+    _journal(0),
+    _routes(new vector<Route*>),
+    _lastRouteId(0),
+    _followingClock(false),
+    _listening(false),
+    _subscriptions(0),
+    _error(0),
+    _overflowCount(0),
+    _receivedCount(0),
+    _queuedSince(0),
+    _batchCount(0),
+    _sysexLimit(DEFAULT_SYSEX_LIMIT),
+    _discardingSysex(false),
+    _sysexOverflowCount(0),
+    _packed(false),
+    _coalescing(false),
+    _coalesceGeneration(0)
+{
+  memset(_coalesceSlots, 0, sizeof _coalesceSlots);
+  memset(_coalescedCounts, 0, sizeof _coalescedCounts);
+
+  PmError e = Pm_OpenInput(&_pmMidiStream, 
+                           portId(),
+                           0,                  // driver info
+                           MIDISTREAM_BUFSIZE, // buffer size
+                           Porttime::portmidiTime, // time proc
+                           0);                 // time info
+
+  if (e < 0) {
+    throw PortMidiJSException("could not open MIDI input port", e);
+  }
+  opened();
+
+  // The async watcher does not keep the event loop alive by itself,
+  // recv() references the loop while a callback is pending.
+  _dataReceivedNotifier.data = this;
+  ev_async_init(&_dataReceivedNotifier, dataReceived);
+  ev_async_start(EV_DEFAULT_UC_ &_dataReceivedNotifier);
+  ev_unref(EV_DEFAULT_UC);
+
+  startReaderThread();
+
+  unique_lock<mutex> lock(_receiversMutex);
+#ifdef HAVE_ALSA
+  _wakeupWatched = _wakeup && _wakeup->watch(this->portName());
+#endif
+  _receivers.insert(this);
+
+  // Polled inputs make the timer thread run every millisecond
+  if (!_wakeupWatched) {
+    Porttime::schedule(Porttime::time());
+  }
+}
+
+MIDIInput::~MIDIInput()
+{
+  closePort();
+  delete _routes;
+
+  ev_ref(EV_DEFAULT_UC);
+  ev_async_stop(EV_DEFAULT_UC_ &_dataReceivedNotifier);
+
+  if (_error) {
+    delete _error;
+  }
+}
+
+void
+MIDIInput::closePort()
+{
+  // Remove the receiver from the polling set first so that neither
+  // the Porttime thread nor the reader thread touch the stream after
+  // it has been closed.
+  {
+    unique_lock<mutex> receiversLock(_receiversMutex);
+    _receivers.erase(this);
+#ifdef HAVE_ALSA
+    if (_wakeupWatched) {
+      _wakeup->unwatch(portName());
+      _wakeupWatched = false;
+    }
+#endif
+    // Wait until the reader thread no longer reads from the stream
+    while (_users) {
+      _receiversReleased.wait(receiversLock);
+    }
+
+    unique_lock<mutex> lock(_mutex);
+    MIDIStream::closePort();
+  }
+
+  // Stopping the recording joins the journal writer and replacing the
+  // routes sends note-offs, neither needs the receivers lock
+  try {
+    stopRecording();
+  }
+  catch (JSException&) {
+  }
+
+  replaceRoutes(vector<Route*>());
+}
+
+// Called by the reader thread with _mutex held
+void
+MIDIInput::routeMessage(PmTimestamp timestamp, PmMessage message)
+{
+  for (vector<Route*>::const_iterator i = _routes->begin(); i != _routes->end(); i++) {
+    (*i)->forward(timestamp, message);
+  }
+}
+
+// Make routes the routing table.  Routes that are no longer used turn
+// off the notes that they have forwarded and are deleted.  Called in
+// the JavaScript thread.
+void
+MIDIInput::replaceRoutes(const vector<Route*>& routes)
+{
+  vector<Route*>* table = new vector<Route*>(routes);
+  {
+    unique_lock<mutex> lock(_mutex);
+    swap(table, _routes);
+  }
+  delete table;
+
+  for (vector<Route*>::iterator i = _routeList.begin(); i != _routeList.end(); i++) {
+    if (find(routes.begin(), routes.end(), *i) == routes.end()) {
+      (*i)->stopNotes();
+      delete *i;
+    }
+  }
+  _routeList = routes;
+}
+
+// The journal is closed outside of _mutex so that the reader thread
+// is not blocked while the last events are written.
+uint64_t
+MIDIInput::stopRecording()
+  throw(JSException)
+{
+  journalwriter* journal;
+  {
+    unique_lock<mutex> lock(_mutex);
+    journal = _journal;
+    _journal = 0;
+  }
+  if (!journal) {
+    return 0;
+  }
+  const bool ok = journal->close();
+  const uint64_t count = journal->eventCount();
+  delete journal;
+  if (!ok) {
+    throw JSException("error writing MIDI journal");
+  }
+  return count;
+}
+
+void
+MIDIInput::setFilters(int32_t channels,
+                      int32_t filters)
+  throw(JSException)
+{
+  if (!_pmMidiStream) {
+    throw JSException("cannot set filters for closed MIDI stream");
+  }
+
+  PmError e = Pm_SetChannelMask(_pmMidiStream, channels);
+  if (e < 0) {
+    throw PortMidiJSException("could not set MIDI channels", e);
+  }
+
+  e = Pm_SetFilter(_pmMidiStream, filters);
+  if (e < 0) {
+    throw PortMidiJSException("could not set MIDI filter", e);
+  }
+}
+
+// v8 interface
+
+Handle<Value>
+MIDIInput::New(const Arguments& args)
+{
+  if (!args.IsConstructCall()) {
+    return ThrowException(String::New("MIDIInput function can only be used as a constructor"));
+  }
+
+  HandleScope scope;
+
+  try {
+    MIDIInput* midiInput = new MIDIInput((args[0] != Undefined()) ? *String::Utf8Value(args[0]) : 0);
+    midiInput->Wrap(args.This());
+    args.This()->Set(String::New("portName"), String::New(midiInput->portName().c_str()), ReadOnly);
+
+    static Persistent<String> init_psymbol = NODE_PSYMBOL("init");
+
+    Local<Value> init = args.This()->Get(init_psymbol);
+
+    if (!init->IsFunction()) {
+      return ThrowException(String::New("MIDIInput.init function not found"));
+    }
+    Local<Function>::Cast(init)->Call(args.This(), 0, 0);
+    
+    return args.This();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDIInput::setFilters(const Arguments& args)
+{
+  HandleScope scope;
+
+  int32_t channels = 0xffff;
+  int32_t filters = PM_FILT_ACTIVE | PM_FILT_CLOCK | PM_FILT_PLAY | PM_FILT_UNDEFINED | PM_FILT_RESET | PM_FILT_TICK;
+
+  switch (args.Length()) {
+  case 2:
+    filters = args[1]->Int32Value();
+  case 1:
+    channels = args[0]->Int32Value();
+  case 0:
+    break;
+  default:
+      return ThrowException(String::New("too many arguments to MIDIInput setFilters"));
+  }
+
+  try {
+    MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+    midiInput->setFilters(channels, filters);
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+set<MIDIInput*> MIDIInput::_receivers;
+condition_variable MIDIInput::_receiversReleased;
+mutex MIDIInput::_receiversMutex;
+condition_variable MIDIInput::_readerCondition;
+bool MIDIInput::_readerRunning = false;
+bool MIDIInput::_readPending = false;
+#ifdef HAVE_ALSA
+alsawakeup* MIDIInput::_wakeup = 0;
+#endif
+
+void
+MIDIInput::startReaderThread()
+{
+  unique_lock<mutex> lock(_receiversMutex);
+
+  if (!_readerRunning) {
+#ifdef HAVE_ALSA
+    // Setting MIDI_INPUT_WAKEUP to "poll" disables the blocking reader
+    const char* wakeupMode = getenv("MIDI_INPUT_WAKEUP");
+    if (!wakeupMode || strcmp(wakeupMode, "poll")) {
+      _wakeup = new alsawakeup;
+      if (!_wakeup->available()) {
+        delete _wakeup;
+        _wakeup = 0;
+      }
+    }
+#endif
+    pthread_t thread;
+    if (pthread_create(&thread, 0, readerThread, 0)) {
+      throw JSException("could not start MIDI reader thread");
+    }
+    pthread_detach(thread);
+    _readerRunning = true;
+  }
+}
+
+void*
+MIDIInput::readerThread(void* arg)
+{
+  MIDI::trace.name("reader");
+
+#ifdef HAVE_ALSA
+  if (_wakeup) {
+    blockingReaderLoop();
+    return 0;
+  }
+#endif
+
+  vector<MIDIInput*> receivers;
+
+  while (true) {
+    {
+      unique_lock<mutex> lock(_receiversMutex);
+      while (!_readPending) {
+        _readerCondition.wait(lock);
+      }
+      _readPending = false;
+      acquireReceivers(receivers);
+    }
+
+    for (size_t i = 0; i < receivers.size(); i++) {
+      receivers[i]->readData();
+    }
+    releaseReceivers(receivers);
+  }
+
+  return 0;
+}
+
+// Called with _receiversMutex held
+void
+MIDIInput::acquireReceivers(vector<MIDIInput*>& receivers)
+{
+  receivers.assign(_receivers.begin(), _receivers.end());
+  for (size_t i = 0; i < receivers.size(); i++) {
+    receivers[i]->_users++;
+  }
+}
+
+void
+MIDIInput::releaseReceivers(const vector<MIDIInput*>& receivers)
+{
+  unique_lock<mutex> lock(_receiversMutex);
+  bool released = false;
+  for (size_t i = 0; i < receivers.size(); i++) {
+    released |= !--receivers[i]->_users;
+  }
+  if (released) {
+    _receiversReleased.notify_one();
+  }
+}
+
+#ifdef HAVE_ALSA
+void
+MIDIInput::blockingReaderLoop()
+{
+  int timeout = -1;
+  vector<MIDIInput*> receivers;
+
+  while (true) {
+    const int woken = _wakeup->wait(timeout);
+
+    {
+      // Draining and clearing _readPending together keeps
+      // notifyReader() from losing a wakeup
+      unique_lock<mutex> lock(_receiversMutex);
+      _wakeup->drain();
+      _readPending = false;
+      acquireReceivers(receivers);
+    }
+
+    bool received = false;
+    for (size_t i = 0; i < receivers.size(); i++) {
+      received |= receivers[i]->readData();
+    }
+    releaseReceivers(receivers);
+
+    // The wakeup client may have seen the event before portmidi did,
+    // look again shortly in that case.
+    timeout = ((woken & alsawakeup::RECEIVED) && !received) ? 1 : -1;
+  }
+}
+#endif
+
+// Called with _receiversMutex held
+void
+MIDIInput::notifyReader()
+{
+#ifdef HAVE_ALSA
+  if (_wakeup) {
+    if (!_readPending) {
+      _readPending = true;
+      _wakeup->notify();
+    }
+    return;
+  }
+#endif
+  _readPending = true;
+  _readerCondition.notify_one();
+}
+
+bool
+MIDIInput::pollAll()
+{
+  unique_lock<mutex> lock(_receiversMutex);
+  bool polled = false;
+  bool dataPending = false;
+  for (set<MIDIInput*>::iterator i = _receivers.begin(); i != _receivers.end(); i++) {
+    if (!(*i)->_wakeupWatched) {
+      polled = true;
+      dataPending |= (*i)->pollData();
+    }
+  }
+  if (dataPending) {
+    notifyReader();
+  }
+  return polled;
+}
+
+bool
+MIDIInput::pollData()
+{
+  unique_lock<mutex> lock(_mutex);
+  const int64_t start = Porttime::microseconds();
+  const bool pending = Pm_Poll(_pmMidiStream) == pmGotData;
+  _pollTime.record(Porttime::elapsed(start));
+  MIDI::trace.finish(MIDI::TRACE_POLL, start, pending);
+  return pending;
+}
+
+Local<Array>
+MIDIInput::allStats()
+{
+  vector<Stats> inputs;
+  {
+    unique_lock<mutex> lock(_receiversMutex);
+    inputs.resize(_receivers.size());
+    vector<Stats>::iterator stats = inputs.begin();
+    for (set<MIDIInput*>::iterator i = _receivers.begin(); i != _receivers.end(); i++, stats++) {
+      MIDIInput* input = *i;
+      stats->portName = input->portName();
+      stats->received = input->_receivedCount;
+      stats->batches = input->_batchCount;
+      stats->overflows = input->_overflowCount;
+      stats->poll = input->_pollTime.summarize();
+      stats->read = input->_readTime.summarize();
+      stats->queue = input->_queueTime.summarize();
+      stats->dispatch = input->_dispatchTime.summarize();
+    }
+  }
+
+  Local<Array> result = Array::New(inputs.size());
+  for (uint32_t i = 0; i < inputs.size(); i++) {
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("portName"), String::New(inputs[i].portName.c_str()));
+    stats->Set(String::NewSymbol("received"), Number::New(inputs[i].received));
+    stats->Set(String::NewSymbol("batches"), Number::New(inputs[i].batches));
+    stats->Set(String::NewSymbol("overflows"), Number::New(inputs[i].overflows));
+    stats->Set(String::NewSymbol("poll"), MIDI::histogramSummary(inputs[i].poll));
+    stats->Set(String::NewSymbol("read"), MIDI::histogramSummary(inputs[i].read));
+    stats->Set(String::NewSymbol("queue"), MIDI::histogramSummary(inputs[i].queue));
+    stats->Set(String::NewSymbol("dispatch"), MIDI::histogramSummary(inputs[i].dispatch));
+    result->Set(i, stats);
+  }
+  return result;
+}
+
+// The overflow count is not reset, it is reported by overflowCount()
+void
+MIDIInput::resetAllStats()
+{
+  unique_lock<mutex> lock(_receiversMutex);
+  for (set<MIDIInput*>::iterator i = _receivers.begin(); i != _receivers.end(); i++) {
+    MIDIInput* input = *i;
+    __sync_lock_test_and_set(&input->_receivedCount, 0);
+    input->_batchCount = 0;
+    input->_pollTime.reset();
+    input->_readTime.reset();
+    input->_queueTime.reset();
+    input->_dispatchTime.reset();
+  }
+}
+
+void
+MIDIInput::pushMessage(PmTimestamp timestamp, PmMessage message, int sysexIndex)
+{
+  ReceivedMessage receivedMessage;
+  receivedMessage.timestamp = timestamp;
+  receivedMessage.message = message;
+  receivedMessage.sysexIndex = sysexIndex;
+  _batch.push_back(receivedMessage);
+}
+
+void
+MIDIInput::unpackSysexMessage(PmEvent event)
+{
+  PmMessage message =  event.message;
+  unsigned long buf = static_cast<unsigned long>(message);
+
+  for (int i = 0; i < 4; i++) {
+    unsigned char b = buf & 0xff;
+    buf >>= 8;
+    if (b == MIDI::SYSEX_END) {
+      appendSysexByte(b);
+      if (_discardingSysex) {
+        _discardingSysex = false;
+      } else {
+        SysexMessage sysex;
+        sysex.data = _sysexArena.finish(sysex.chunk, sysex.length);
+        _sysexMessages.push_back(sysex);
+        MIDI::trace.instant(MIDI::TRACE_SYSEX_UNPACK, sysex.length);
+        pushMessage(event.timestamp, MIDI::SYSEX_START, _sysexMessages.size() - 1);
+      }
+      break;
+    } else if (MIDI::IS_REALTIME(b)) {
+      pushMessage(event.timestamp, b);
+    } else if ((b & 0x80)
+               && (_sysexArena.messageLength() > 1
+                   || _discardingSysex
+                   || (b != MIDI::SYSEX_START))) {
+      // We're receiving some non-realtime status while receiving a
+      // sysex message.  Assume that this is not an error, but flush
+      // the current sysex message (i.e. the user may have unplugged
+      // the cable while a sysex message was being transferred)
+      _sysexArena.discard();
+      _discardingSysex = false;
+      // Unfortunately, portmidi does not resync itself when it
+      // receives a new message inside a sysex message.  We can cope
+      // with another sysex message, but fail for others.
+      if (b == MIDI::SYSEX_START) {
+        _sysexArena.start();
+        appendSysexByte(b);
+      } else {
+        break;
+      }
+    } else {
+      if (!inSysexMessage()) {
+        _sysexArena.start();
+      }
+      appendSysexByte(b);
+    }
+  }
+}
+
+void
+MIDIInput::appendSysexByte(unsigned char b)
+{
+  if (_discardingSysex) {
+    return;
+  }
+
+  if (_sysexArena.messageLength() >= _sysexLimit) {
+    // Drop the message, the remaining bytes are ignored until the
+    // next status byte is received.
+    _sysexArena.discard();
+    _discardingSysex = true;
+    _sysexOverflowCount++;
+    return;
+  }
+
+  try {
+    _sysexArena.append(b);
+  }
+  catch (const bad_alloc& e) {
+    _sysexArena.discard();
+    _discardingSysex = true;
+    _sysexOverflowCount++;
+  }
+}
+
+void
+MIDIInput::releaseSysexBuffer(char* data, void* hint)
+{
+  sysexarena::release(static_cast<sysexarena::chunk*>(hint));
+}
+
+// Return a Buffer that views the sysex message in the arena.  The
+// reference to the arena chunk is released when the Buffer is
+// collected.
+Local<Object>
+MIDIInput::sysexBuffer(const SysexMessage& sysex)
+{
+  Buffer* buffer = Buffer::New(const_cast<char*>(reinterpret_cast<const char*>(sysex.data)),
+                               sysex.length,
+                               releaseSysexBuffer,
+                               sysex.chunk);
+  return Local<Object>::New(buffer->handle_);
+}
+
+bool
+MIDIInput::readData()
+{
+  bool received = false;
+  bool notify = false;
+  {
+    unique_lock<mutex> lock(_mutex);
+
+    while (Pm_Poll(_pmMidiStream) == pmGotData) {
+      const int RECV_EVENTS = 32;
+      PmEvent events[RECV_EVENTS];
+      const int64_t start = Porttime::microseconds();
+      int rc = Pm_Read(_pmMidiStream, events, RECV_EVENTS);
+      const int64_t read = Porttime::microseconds();
+      _readTime.record((uint32_t) (read - start));
+      MIDI::trace.complete(MIDI::TRACE_READ, start, read, max(rc, 0));
+      received = true;
+      if (rc < 0) {
+        PortMidiJSException* error = new PortMidiJSException("error receiving MIDI data", (PmError) rc);
+        if (!__sync_bool_compare_and_swap(&_error, 0, error)) {
+          // an earlier error has not been reported yet
+          delete error;
+        }
+        notify = true;
+        break;
+      }
+      const int64_t pushStart = MIDI::trace.now();
+      uint32_t pushed = 0;
+      for (int i = 0; i < rc; i++) {
+        if (!_routes->empty()) {
+          routeMessage(events[i].timestamp, events[i].message);
+        }
+        if (_followingClock && _clockFollower.process(events[i].timestamp, events[i].message)) {
+          continue;
+        }
+        notify = true;
+        __sync_bool_compare_and_swap(&_queuedSince, 0, read);
+        if (_readQueue.push(events[i])) {
+          pushed++;
+        } else {
+          __sync_fetch_and_add(&_overflowCount, 1);
+        }
+      }
+      MIDI::trace.finish(MIDI::TRACE_QUEUE_PUSH, pushStart, pushed);
+      __sync_fetch_and_add(&_receivedCount, rc);
+      if (_journal) {
+        _journal->append(events, rc);
+      }
+    }
+  }
+
+  // Absorbed clock only wakes the JavaScript thread to report a tempo
+  // change
+  if (notify || (_followingClock && _clockFollower.tempoChangePending())) {
+    ev_async_send(EV_DEFAULT_UC_ &_dataReceivedNotifier);
+  }
+  return received;
+}
+
+void
+MIDIInput::drainReadQueue()
+{
+  _batch.clear();
+  _sysexMessages.clear();
+
+  // Time that the oldest message waited, sampled once per batch
+  const int64_t queuedSince = __sync_lock_test_and_set(&_queuedSince, 0);
+  if (queuedSince && !_readQueue.empty()) {
+    _queueTime.record(Porttime::elapsed(queuedSince));
+  }
+
+  const int64_t popStart = MIDI::trace.now();
+  uint32_t popped = 0;
+  PmEvent event;
+  while (_readQueue.pop(event)) {
+    popped++;
+    const unsigned status = Pm_MessageStatus(event.message);
+
+    if (inSysexMessage()) {
+      if (MIDI::IS_REALTIME(status)) {
+        pushMessage(event.timestamp, event.message);
+      } else {
+        unpackSysexMessage(event);
+      }
+    } else {
+      if (status == MIDI::SYSEX_START) {
+        unpackSysexMessage(event);
+      } else {
+        pushMessage(event.timestamp, event.message);
+      }
+    }
+  }
+  MIDI::trace.finish(MIDI::TRACE_QUEUE_POP, popStart, popped);
+}
+
+// Returns the coalescing key of a message, or -1 if the message must
+// not be merged
+int
+MIDIInput::coalesceKey(PmMessage message) const
+{
+  const unsigned char status = Pm_MessageStatus(message);
+  const int channel = status & 0x0f;
+  const int data1 = Pm_MessageData1(message);
+
+  switch (MIDI::messageType(status)) {
+  case MIDI::CONTROL_CHANGE:
+    // Channel mode messages are commands rather than values
+    if (data1 >= 120) {
+      return -1;
+    }
+    // NRPN, RPN and 14 bit controller decoding needs to see every
+    // message of the controllers involved
+    if (_listening && (_subscriptions & PARAMETER_EVENTS)
+        && (data1 < 64 || (data1 >= 0x60 && data1 <= 0x65))) {
+      return -1;
+    }
+    return COALESCE_CONTROL_CHANGE + channel * 128 + data1;
+  case MIDI::POLYPHONIC_KEY_PRESSURE:
+    return COALESCE_POLYPHONIC_KEY_PRESSURE + channel * 128 + data1;
+  case MIDI::PITCH_WHEEL_CHANGE:
+    return COALESCE_PITCH_WHEEL_CHANGE + channel;
+  case MIDI::CHANNEL_PRESSURE:
+    return COALESCE_CHANNEL_PRESSURE + channel;
+  default:
+    return -1;
+  }
+}
+
+void
+MIDIInput::coalesceBatch()
+{
+  if (++_coalesceGeneration == 0) {
+    memset(_coalesceSlots, 0, sizeof _coalesceSlots);
+    _coalesceGeneration = 1;
+  }
+
+  // First pass: Find the last occurrence of each key
+  bool merged = false;
+  for (size_t i = 0; i < _batch.size(); i++) {
+    const int key = coalesceKey(_batch[i].message);
+    if (key < 0) {
+      continue;
+    }
+    CoalesceSlot& slot = _coalesceSlots[key];
+    if (slot.generation == _coalesceGeneration) {
+      _coalescedCounts[key]++;
+      merged = true;
+    }
+    slot.generation = _coalesceGeneration;
+    slot.lastIndex = i;
+  }
+
+  if (!merged) {
+    return;
+  }
+
+  // Second pass: Compact the batch, keeping the last occurrences
+  size_t to = 0;
+  for (size_t i = 0; i < _batch.size(); i++) {
+    const int key = coalesceKey(_batch[i].message);
+    if (key < 0 || _coalesceSlots[key].lastIndex == i) {
+      _batch[to++] = _batch[i];
+    }
+  }
+  _batch.resize(to);
+}
+
+void
+MIDIInput::readResultsToJSCallbackArguments(Local<Value> argv[])
+{
+  PortMidiJSException* error = __sync_lock_test_and_set(&_error, (PortMidiJSException*) 0);
+
+  if (error) {
+    argv[2] = Exception::Error(String::New(error->message().c_str()));
+    delete error;
+  }
+
+  if (_packed) {
+    readResultsToPackedCallbackArguments(argv);
+    return;
+  }
+
+  Local<Array> events = Array::New(_batch.size());
+  for (size_t i = 0; i < _batch.size(); i++) {
+    const ReceivedMessage& message = _batch[i];
+    Local<Array> jsMessage;
+    if (message.sysexIndex >= 0) {
+      jsMessage = Array::New(3);
+      jsMessage->Set(0, MIDI::timeValue(message.timestamp));
+      jsMessage->Set(1, v8::Integer::New(MIDI::SYSEX_START));
+      jsMessage->Set(2, sysexBuffer(_sysexMessages[message.sysexIndex]));
+    } else {
+      jsMessage = Array::New(4);
+      jsMessage->Set(0, MIDI::timeValue(message.timestamp));
+      jsMessage->Set(1, v8::Integer::New(Pm_MessageStatus(message.message)));
+      jsMessage->Set(2, v8::Integer::New(Pm_MessageData1(message.message)));
+      jsMessage->Set(3, v8::Integer::New(Pm_MessageData2(message.message)));
+    }
+    events->Set(i, jsMessage);
+  }
+  argv[1] = events;
+}
+
+void
+MIDIInput::readResultsToPackedCallbackArguments(Local<Value> argv[])
+{
+  size_t sysexBytes = 0;
+  for (size_t i = 0; i < _sysexMessages.size(); i++) {
+    sysexBytes += _sysexMessages[i].length;
+  }
+
+  Buffer* buffer = Buffer::New(_batch.size() * MIDI::PACKED_EVENT_SIZE + sysexBytes);
+  unsigned char* records = reinterpret_cast<unsigned char*>(Buffer::Data(buffer));
+  unsigned char* sysexData = records + _batch.size() * MIDI::PACKED_EVENT_SIZE;
+
+  for (size_t i = 0; i < _batch.size(); i++) {
+    const ReceivedMessage& message = _batch[i];
+    unsigned char* record = records + i * MIDI::PACKED_EVENT_SIZE;
+    if (message.sysexIndex >= 0) {
+      const SysexMessage& sysex = _sysexMessages[message.sysexIndex];
+      memcpy(sysexData, sysex.data, sysex.length);
+      MIDI::packEvent(record, message.timestamp, message.message, sysexData - records, sysex.length);
+      sysexData += sysex.length;
+      sysexarena::release(sysex.chunk);
+    } else {
+      MIDI::packEvent(record, message.timestamp, message.message);
+    }
+  }
+
+  argv[1] = Local<Object>::New(buffer->handle_);
+  argv[3] = v8::Integer::New(_batch.size());
+}
+
+void
+MIDIInput::dataReceived(EV_P_ ev_async* watcher, int revents)
+{
+  static_cast<MIDIInput*>(watcher->data)->deliverData();
+}
+
+void
+MIDIInput::emitEvent(MIDI::MessageType type, int argc, Local<Value> argv[])
+{
+  TryCatch tryCatch;
+  Emit(MIDI::messageTypeSymbols[type], argc, argv);
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+}
+
+void
+MIDIInput::emitMessages()
+{
+  static Persistent<String> error_psymbol = NODE_PSYMBOL("error");
+
+  PortMidiJSException* error = __sync_lock_test_and_set(&_error, (PortMidiJSException*) 0);
+
+  if (error) {
+    HandleScope scope;
+    Local<Value> argv[1];
+    argv[0] = Exception::Error(String::New(error->message().c_str()));
+    delete error;
+    TryCatch tryCatch;
+    Emit(error_psymbol, 1, argv);
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+
+  for (size_t i = 0; i < _batch.size(); i++) {
+    const ReceivedMessage& message = _batch[i];
+    const unsigned char status = Pm_MessageStatus(message.message);
+    const MIDI::MessageType type = MIDI::messageType(status);
+
+    const int data1 = Pm_MessageData1(message.message);
+    const int data2 = Pm_MessageData2(message.message);
+
+    ParameterDecoder::Update updates[ParameterDecoder::MAX_UPDATES];
+    int updateCount = 0;
+    if (type == MIDI::CONTROL_CHANGE && (_subscriptions & PARAMETER_EVENTS)) {
+      updateCount = _parameterDecoder.process(status & 0x0f, data1, data2, updates);
+    }
+
+    if (type == MIDI::UNDEFINED_MESSAGE
+        || (!(_subscriptions & (1 << type)) && !updateCount)) {
+      if (message.sysexIndex >= 0) {
+        sysexarena::release(_sysexMessages[message.sysexIndex].chunk);
+      }
+      continue;
+    }
+
+    HandleScope scope;
+
+    Local<Value> channel = v8::Integer::New((status & 0x0f) + 1);
+    Local<Value> time = MIDI::timeValue(message.timestamp);
+    Local<Value> argv[4];
+    int argc;
+
+    switch (type) {
+    case MIDI::NOTE_OFF:
+    case MIDI::NOTE_ON:
+    case MIDI::POLYPHONIC_KEY_PRESSURE:
+    case MIDI::CONTROL_CHANGE:
+      argv[0] = v8::Integer::New(data1);
+      argv[1] = v8::Integer::New(data2);
+      argv[2] = channel;
+      argv[3] = time;
+      argc = 4;
+      break;
+    case MIDI::PROGRAM_CHANGE:
+    case MIDI::CHANNEL_PRESSURE:
+      argv[0] = v8::Integer::New(data1);
+      argv[1] = channel;
+      argv[2] = time;
+      argc = 3;
+      break;
+    case MIDI::PITCH_WHEEL_CHANGE:
+      argv[0] = v8::Integer::New(0x2000 - ((data2 << 7) | data1));
+      argv[1] = channel;
+      argv[2] = time;
+      argc = 3;
+      break;
+    case MIDI::SYSEX:
+      argv[0] = sysexBuffer(_sysexMessages[message.sysexIndex]);
+      argv[1] = time;
+      argc = 2;
+      break;
+    case MIDI::MIDI_TIME_CODE:
+    case MIDI::SONG_SELECT:
+      argv[0] = v8::Integer::New(data1);
+      argv[1] = time;
+      argc = 2;
+      break;
+    case MIDI::SONG_POSITION_POINTER:
+      argv[0] = v8::Integer::New(data1);
+      argv[1] = v8::Integer::New(data2);
+      argv[2] = time;
+      argc = 3;
+      break;
+    default:
+      argv[0] = time;
+      argc = 1;
+    }
+
+    if (_subscriptions & (1 << type)) {
+      emitEvent(type, argc, argv);
+    }
+
+    for (int j = 0; j < updateCount; j++) {
+      if (_subscriptions & (1 << updates[j].type)) {
+        argv[0] = v8::Integer::New(updates[j].parameter);
+        argv[1] = v8::Integer::New(updates[j].value);
+        argv[2] = channel;
+        argv[3] = time;
+        emitEvent(updates[j].type, 4, argv);
+      }
+    }
+  }
+}
+
+void
+MIDIInput::deliverData()
+{
+  HandleScope scope;
+
+  if (_clockFollower.takeTempoChange()) {
+    static Persistent<String> tempo_psymbol = NODE_PSYMBOL("tempo");
+    Local<Value> argv[1] = { Number::New(_clockFollower.tempo()) };
+    TryCatch tryCatch;
+    Emit(tempo_psymbol, 1, argv);
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+
+  if (!_listening && _recvCallback.IsEmpty()) {
+    return;
+  }
+
+  drainReadQueue();
+
+  if (_coalescing) {
+    coalesceBatch();
+  }
+
+  if (_batch.empty() && !_error) {
+    return;
+  }
+
+  _batchCount++;
+  const int64_t start = Porttime::microseconds();
+
+  const uint32_t messages = _batch.size();
+
+  if (_listening) {
+    emitMessages();
+    _dispatchTime.record(Porttime::elapsed(start));
+    MIDI::trace.finish(MIDI::TRACE_DISPATCH, start, messages);
+    return;
+  }
+
+  // The callback is one-shot.  It is released before it is called so
+  // that it can call recv() again to receive the next batch.
+  Local<Function> callback = Local<Function>::New(_recvCallback);
+  _recvCallback.Dispose();
+  _recvCallback.Clear();
+  ev_unref(EV_DEFAULT_UC);
+
+  Local<Value> argv[4];
+  argv[0] = *handle_;
+  argv[1] = *Undefined();
+  argv[2] = *Undefined();
+  argv[3] = *Undefined();
+
+  readResultsToJSCallbackArguments(argv);
+  Unref();
+
+  TryCatch tryCatch;
+  callback->Call(Context::GetCurrent()->Global(), _packed ? 4 : 3, argv);
+  _dispatchTime.record(Porttime::elapsed(start));
+  MIDI::trace.finish(MIDI::TRACE_DISPATCH, start, messages);
+
+  if (tryCatch.HasCaught()) {
+    FatalException(tryCatch);
+  }
+}
+
+Handle<Value>
+MIDIInput::recv(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1
+      || !args[0]->IsFunction()) {
+    return ThrowException(String::New("need one callback function argument in recv"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+
+  if (!midiInput->_recvCallback.IsEmpty()) {
+    return ThrowException(String::New("MIDIInput recv already in progress"));
+  }
+  if (midiInput->_listening) {
+    return ThrowException(String::New("cannot use recv on MIDIInput that is listening"));
+  }
+
+  midiInput->Ref();
+  midiInput->_recvCallback = Persistent<Function>::New(Local<Function>::Cast(args[0]));
+  ev_ref(EV_DEFAULT_UC);
+
+  // Messages may have been queued while no callback was registered.
+  // They are delivered from the event loop rather than from within
+  // recv() so that the callback is never called recursively.
+  ev_async_send(EV_DEFAULT_UC_ &midiInput->_dataReceivedNotifier);
+
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::listen(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+
+  if (!midiInput->_recvCallback.IsEmpty()) {
+    return ThrowException(String::New("cannot listen on MIDIInput while recv is in progress"));
+  }
+
+  if (!midiInput->_listening) {
+    midiInput->_listening = true;
+    midiInput->Ref();
+    ev_ref(EV_DEFAULT_UC);
+    ev_async_send(EV_DEFAULT_UC_ &midiInput->_dataReceivedNotifier);
+  }
+
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::unlisten(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+
+  if (midiInput->_listening) {
+    midiInput->_listening = false;
+    midiInput->Unref();
+    ev_unref(EV_DEFAULT_UC);
+  }
+
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::subscription(const Arguments& args, bool subscribe)
+{
+  HandleScope scope;
+
+  try {
+    if (args.Length() != 1 || !args[0]->IsString()) {
+      throw JSException("need one message type name argument");
+    }
+
+    string typeName = *String::Utf8Value(args[0]);
+    MIDI::MessageType type = MIDI::messageType(typeName.c_str());
+    if (type == MIDI::UNDEFINED_MESSAGE) {
+      throw JSException("unknown MIDI message type " + typeName);
+    }
+
+    MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+    if (subscribe) {
+      midiInput->_subscriptions |= (1 << type);
+    } else {
+      midiInput->_subscriptions &= ~(1 << type);
+    }
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDIInput::subscribe(const Arguments& args)
+{
+  return subscription(args, true);
+}
+
+Handle<Value>
+MIDIInput::unsubscribe(const Arguments& args)
+{
+  return subscription(args, false);
+}
+
+Handle<Value>
+MIDIInput::setPacked(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    return ThrowException(String::New("need one boolean argument in setPacked"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  midiInput->_packed = args[0]->BooleanValue();
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::setSysexLimit(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 2) {
+    return ThrowException(String::New("need one numeric argument of at least 2 in setSysexLimit"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  midiInput->_sysexLimit = args[0]->IntegerValue();
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::sysexOverflowCount(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  return scope.Close(v8::Integer::NewFromUnsigned(midiInput->_sysexOverflowCount));
+}
+
+Handle<Value>
+MIDIInput::setCoalescing(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1) {
+    return ThrowException(String::New("need one boolean argument in setCoalescing"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  midiInput->_coalescing = args[0]->BooleanValue();
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::coalescedCounts(const Arguments& args)
+{
+  HandleScope scope;
+
+  static Persistent<String> type_symbol = NODE_PSYMBOL("type");
+  static Persistent<String> channel_symbol = NODE_PSYMBOL("channel");
+  static Persistent<String> number_symbol = NODE_PSYMBOL("number");
+  static Persistent<String> count_symbol = NODE_PSYMBOL("count");
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  Local<Array> counts = Array::New();
+  uint32_t n = 0;
+
+  for (int key = 0; key < COALESCE_KEY_COUNT; key++) {
+    if (!midiInput->_coalescedCounts[key]) {
+      continue;
+    }
+    Local<Object> entry = Object::New();
+    MIDI::MessageType type;
+    int channel;
+    int number = -1;
+    if (key < COALESCE_POLYPHONIC_KEY_PRESSURE) {
+      type = MIDI::CONTROL_CHANGE;
+      channel = (key - COALESCE_CONTROL_CHANGE) / 128;
+      number = (key - COALESCE_CONTROL_CHANGE) % 128;
+    } else if (key < COALESCE_PITCH_WHEEL_CHANGE) {
+      type = MIDI::POLYPHONIC_KEY_PRESSURE;
+      channel = (key - COALESCE_POLYPHONIC_KEY_PRESSURE) / 128;
+      number = (key - COALESCE_POLYPHONIC_KEY_PRESSURE) % 128;
+    } else if (key < COALESCE_CHANNEL_PRESSURE) {
+      type = MIDI::PITCH_WHEEL_CHANGE;
+      channel = key - COALESCE_PITCH_WHEEL_CHANGE;
+    } else {
+      type = MIDI::CHANNEL_PRESSURE;
+      channel = key - COALESCE_CHANNEL_PRESSURE;
+    }
+    entry->Set(type_symbol, MIDI::messageTypeSymbols[type]);
+    entry->Set(channel_symbol, v8::Integer::New(channel + 1));
+    if (number >= 0) {
+      entry->Set(number_symbol, v8::Integer::New(number));
+    }
+    entry->Set(count_symbol, v8::Integer::NewFromUnsigned(midiInput->_coalescedCounts[key]));
+    counts->Set(n++, entry);
+  }
+
+  return scope.Close(counts);
+}
+
+Handle<Value>
+MIDIInput::wakeupMode(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  return scope.Close(String::New(midiInput->_wakeupWatched ? "alsa" : "poll"));
+}
+
+// record(filename).  All events received are written to a journal file
+// by a background thread until stopRecording() is called or the input
+// is closed.
+Handle<Value>
+MIDIInput::record(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsString()) {
+    return ThrowException(String::New("need file name argument in record"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  if (!midiInput->_pmMidiStream) {
+    return ThrowException(String::New("cannot record closed MIDI stream"));
+  }
+
+  journalwriter* journal;
+  try {
+    journal = new journalwriter(*String::Utf8Value(args[0]));
+  }
+  catch (file_error& e) {
+    return ThrowException(String::New(e.what()));
+  }
+
+  {
+    unique_lock<mutex> lock(midiInput->_mutex);
+    if (!midiInput->_journal) {
+      midiInput->_journal = journal;
+      return Undefined();
+    }
+  }
+
+  delete journal;
+  return ThrowException(String::New("MIDI input is already being recorded"));
+}
+
+// Stop recording and write the rest of the journal.  Returns the
+// number of events recorded.
+Handle<Value>
+MIDIInput::stopRecording(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+
+  try {
+    return scope.Close(Number::New(midiInput->stopRecording()));
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+// setClockFollowing(enable, [window], [threshold]).  While enabled,
+// timing clock messages are absorbed and used to estimate the tempo
+// and beat position.  window is the number of clock pulses that the
+// estimate is averaged over, a 'tempo' event is emitted whenever the
+// estimate changes by threshold BPM or more.
+Handle<Value>
+MIDIInput::setClockFollowing(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || args.Length() > 3
+      || (args.Length() > 1 && !args[1]->IsNumber())
+      || (args.Length() > 2 && !args[2]->IsNumber())) {
+    return ThrowException(String::New("unexpected arguments to setClockFollowing"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  const size_t window = (args.Length() > 1) ? args[1]->Uint32Value() : ClockFollower::DEFAULT_WINDOW;
+  const double threshold = (args.Length() > 2) ? args[2]->NumberValue() : 0.5;
+  if (threshold < 0) {
+    return ThrowException(String::New("tempo threshold must not be negative"));
+  }
+
+  unique_lock<mutex> lock(midiInput->_mutex);
+  midiInput->_followingClock = args[0]->BooleanValue();
+  midiInput->_clockFollower.configure(window, threshold);
+
+  return Undefined();
+}
+
+// addRoute(output, [options]).  Forward messages received to output,
+// see Route::configure() for the options.  Returns the route id.
+Handle<Value>
+MIDIInput::addRoute(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || args.Length() > 2
+      || !args[0]->IsObject() || !MIDIOutput::constructorTemplate->HasInstance(args[0])
+      || (args.Length() > 1 && !args[1]->IsObject())) {
+    return ThrowException(String::New("need MIDIOutput and options arguments in addRoute"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  Local<Object> outputObject = args[0]->ToObject();
+  MIDIOutput* output = ObjectWrap::Unwrap<MIDIOutput>(outputObject);
+
+  Route* route = new Route(++midiInput->_lastRouteId, output, outputObject);
+  try {
+    if (args.Length() > 1) {
+      route->configure(args[1]->ToObject());
+    }
+  }
+  catch (const JSException& e) {
+    delete route;
+    return e.asV8Exception();
+  }
+
+  vector<Route*> routes(midiInput->_routeList);
+  routes.push_back(route);
+  midiInput->replaceRoutes(routes);
+
+  return scope.Close(v8::Integer::NewFromUnsigned(route->id()));
+}
+
+// updateRoute(id, options).  The route is replaced by one to the same
+// output with the new options.  Notes forwarded by the old route are
+// turned off.
+Handle<Value>
+MIDIInput::updateRoute(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 2 || !args[0]->IsNumber() || !args[1]->IsObject()) {
+    return ThrowException(String::New("need route id and options arguments in updateRoute"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  const uint32_t id = args[0]->Uint32Value();
+  vector<Route*> routes(midiInput->_routeList);
+  for (vector<Route*>::iterator i = routes.begin(); i != routes.end(); i++) {
+    if ((*i)->id() == id) {
+      Local<Object> outputObject = (*i)->outputObject();
+      Route* route = new Route(id, ObjectWrap::Unwrap<MIDIOutput>(outputObject), outputObject);
+      try {
+        route->configure(args[1]->ToObject());
+      }
+      catch (const JSException& e) {
+        delete route;
+        return e.asV8Exception();
+      }
+      *i = route;
+      midiInput->replaceRoutes(routes);
+      return Undefined();
+    }
+  }
+
+  return ThrowException(String::New("unknown route id in updateRoute"));
+}
+
+// removeRoute(id).  Notes forwarded by the route are turned off.
+Handle<Value>
+MIDIInput::removeRoute(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return ThrowException(String::New("need route id argument in removeRoute"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  const uint32_t id = args[0]->Uint32Value();
+  vector<Route*> routes;
+  for (vector<Route*>::iterator i = midiInput->_routeList.begin(); i != midiInput->_routeList.end(); i++) {
+    if ((*i)->id() != id) {
+      routes.push_back(*i);
+    }
+  }
+  if (routes.size() == midiInput->_routeList.size()) {
+    return ThrowException(String::New("unknown route id in removeRoute"));
+  }
+  midiInput->replaceRoutes(routes);
+
+  return Undefined();
+}
+
+Handle<Value>
+MIDIInput::clearRoutes(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  midiInput->replaceRoutes(vector<Route*>());
+  return Undefined();
+}
+
+// Estimated tempo of the received clock in BPM, or 0 if unknown
+Handle<Value>
+MIDIInput::tempo(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  return scope.Close(Number::New(midiInput->_clockFollower.tempo()));
+}
+
+// beatPosition([time]).  Song position in beats (quarter notes) at the
+// given time, which defaults to now.
+Handle<Value>
+MIDIInput::beatPosition(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() > 1 || (args.Length() == 1 && !args[0]->IsNumber())) {
+    return ThrowException(String::New("unexpected arguments to beatPosition"));
+  }
+
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  const PmTimestamp time = args.Length()
+    ? Porttime::truncate(MIDI::timeArgument(args[0]) + 500)
+    : Porttime::time();
+  return scope.Close(Number::New(midiInput->_clockFollower.beatPosition(time)));
+}
+
+Handle<Value>
+MIDIInput::clockRunning(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  return scope.Close(Boolean::New(midiInput->_clockFollower.running()));
+}
+
+Handle<Value>
+MIDIInput::overflowCount(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  return scope.Close(v8::Integer::NewFromUnsigned(midiInput->_overflowCount));
+}
+
+void
+MIDIInput::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  Handle<FunctionTemplate> midiInputTemplate = FunctionTemplate::New(New);
+  midiInputTemplate->Inherit(EventEmitter::constructor_template);
+  midiInputTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "close", close);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setFilters", setFilters);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "recv", recv);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "listen", listen);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "unlisten", unlisten);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "subscribe", subscribe);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "unsubscribe", unsubscribe);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "overflowCount", overflowCount);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setPacked", setPacked);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setSysexLimit", setSysexLimit);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "sysexOverflowCount", sysexOverflowCount);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setCoalescing", setCoalescing);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "coalescedCounts", coalescedCounts);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "wakeupMode", wakeupMode);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "record", record);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "stopRecording", stopRecording);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setClockFollowing", setClockFollowing);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "addRoute", addRoute);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "updateRoute", updateRoute);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "removeRoute", removeRoute);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "clearRoutes", clearRoutes);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "tempo", tempo);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "beatPosition", beatPosition);
+  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "clockRunning", clockRunning);
+
+  target->Set(String::NewSymbol("MIDIInput"), midiInputTemplate->GetFunction());
+}
+
+Handle<Value>
+MIDIInput::close(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
+  midiInput->closePort();
+  return Undefined();
+}
+
+// //////////////////////////////////////////////////////////////////
+// MIDIOutput guts
+// //////////////////////////////////////////////////////////////////
+
+mutex MIDIOutput::_lastScheduledSendLock;
+PmTimestamp MIDIOutput::_lastScheduledSend = 0;
+set<MIDIOutput*> MIDIOutput::_outputs;
+mutex MIDIOutput::_outputsMutex;
+Persistent<FunctionTemplate> MIDIOutput::constructorTemplate;
+
+MIDIOutput::MIDIOutput(const char* portName, int32_t latency)
+  throw(JSException)
+  : MIDIStream(MIDI::OUTPUT, portName),
+    _latency(latency),
+    _scheduled(Porttime::time()),
+    _sentCount(0),
+    _queuedCount(0),
+    _releasedCount(0),
+    _lateCount(0)
+{
+  PmError e = Pm_OpenOutput(&_pmMidiStream, 
+                            portId(), 
+                            0,                  // driver info
+                            MIDISTREAM_BUFSIZE, // queue size
+                            Porttime::portmidiTime, // time proc
+                            0,                  // time info
+                            latency);           // latency
+
+  if (e < 0) {
+    throw PortMidiJSException("could not open MIDI output port", e);
+  }
+  opened();
+
+  unique_lock<mutex> lock(_outputsMutex);
+  _outputs.insert(this);
+}
+
+MIDIOutput::~MIDIOutput()
+{
+  closePort();
+}
+
+void
+MIDIOutput::closePort()
+{
+  unique_lock<mutex> outputsLock(_outputsMutex);
+  _outputs.erase(this);
+
+  unique_lock<mutex> lock(_writeMutex);
+  _scheduled.clear(FreeSysex());
+  MIDIStream::closePort();
+}
+
+void
+MIDIOutput::send(const unsigned char* message, size_t length, PmTimestamp when, uint32_t tag)
+  throw(JSException)
+{
+  if (!_pmMidiStream) {
+    throw JSException("cannot send to closed MIDI stream");
+  }
+
+  if (length < 1) {
+    throw JSException("cannot send message without content");
+  }
+
+  const unsigned char statusByte = message[0];
+  unsigned char arg1 = 0;
+  unsigned char arg2 = 0;
+
+  if (statusByte == MIDI::SYSEX_START) {
+    if (message[length - 1] != 0xf7) {
+      throw JSException("sysex message must be terminated by 0xf7");
+    }
+  } else {
+    switch (length) {
+    case 3:
+      arg2 = message[2];
+    case 2:
+      arg1 = message[1];
+    case 1:
+      break;
+    default:
+      throw JSException("unexpected message length");
+    }
+  }
+
+  if (when) {
+    if (Porttime::before(when, Porttime::time())) {
+      throw JSException("message sending time has already passed");
+    }
+    unique_lock<mutex> lock(_writeMutex);
+    enqueue(when, Pm_Message(statusByte, arg1, arg2),
+            (statusByte == MIDI::SYSEX_START) ? message : 0, length, tag);
+    scheduleSend(when);
+    Porttime::schedule(when - RELEASE_AHEAD);
+    return;
+  }
+
+  unique_lock<mutex> lock(_writeMutex);
+  const int64_t start = MIDI::trace.now();
+  if (statusByte == MIDI::SYSEX_START) {
+    // portmidi reads the message up to the terminating 0xf7 directly
+    // from the caller's memory
+    PmError e = Pm_WriteSysEx(_pmMidiStream, when, const_cast<unsigned char*>(message));
+    if (e < 0) {
+      throw PortMidiJSException("could not send MIDI sysex message", e);
+    }
+  } else {
+    PmError e = Pm_WriteShort(_pmMidiStream, when, Pm_Message(statusByte, arg1, arg2));
+    if (e < 0) {
+      throw PortMidiJSException("could not send MIDI message", e);
+    }
+  }
+  MIDI::trace.finish(MIDI::TRACE_WRITE, start, 1);
+  _sentCount++;
+}
+
+// Decode a string of whitespace separated hexadecimal byte values,
+// each optionally prefixed by 0x, into bytes
+void
+MIDIOutput::decodeHex(const char* string, size_t length, vector<unsigned char>& bytes)
+  throw(JSException)
+{
+  static signed char digitValues[256];
+  if (!digitValues['1']) {
+    memset(digitValues, -1, sizeof digitValues);
+    for (int i = 0; i < 10; i++) {
+      digitValues['0' + i] = i;
+    }
+    for (int i = 0; i < 6; i++) {
+      digitValues['a' + i] = digitValues['A' + i] = 10 + i;
+    }
+  }
+
+  bytes.clear();
+  bytes.reserve(length / 3 + 1);
+
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(string);
+  const unsigned char* end = p + length;
+
+  while (true) {
+    while (p < end && isspace(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && digitValues[p[2]] >= 0) {
+      p += 2;
+    }
+    unsigned value = 0;
+    int digits = 0;
+    while (p < end && digitValues[*p] >= 0) {
+      value = (value << 4) | digitValues[*p++];
+      digits++;
+    }
+    if (!digits || digits > 2 || (p < end && !isspace(*p))) {
+      throw JSException("error decoding hex byte in MIDI message");
+    }
+    bytes.push_back(value);
+  }
+}
+
+void
+MIDIOutput::scheduleSend(PmTimestamp when)
+{
+  // Reference the default evlib queue so that the node process does
+  // not exit until the last message has been sent.  See also
+  // MIDIOutput::checkScheduledSends()
+  unique_lock<mutex> lock(_lastScheduledSendLock);
+  if (!_lastScheduledSend || Porttime::before(_lastScheduledSend, when + _latency)) {
+    if (_lastScheduledSend == 0) {
+      ev_ref(EV_DEFAULT_UC);
+    }
+    _lastScheduledSend = when + _latency;
+  }
+}
+
+void
+MIDIOutput::sendBatch(const unsigned char* buffer, size_t length, size_t count, uint32_t tag)
+  throw(JSException)
+{
+  if (!_pmMidiStream) {
+    throw JSException("cannot send to closed MIDI stream");
+  }
+
+  if (count > length / MIDI::PACKED_EVENT_SIZE) {
+    throw JSException("batch buffer too short for the number of events");
+  }
+
+  // Validate the complete batch before anything is sent or queued
+  const PmTimestamp now = Porttime::time();
+  PmTimestamp firstTime = 0;
+  PmTimestamp lastTime = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char* record = buffer + i * MIDI::PACKED_EVENT_SIZE;
+    const PmTimestamp when = MIDI::unpackUint32(record + MIDI::PACKED_TIMESTAMP);
+    const unsigned char status = record[MIDI::PACKED_STATUS];
+
+    if (when) {
+      if (!_latency) {
+        throw JSException("can't delay message sending on MIDI output stream opened with zero latency");
+      }
+      if (Porttime::before(when, now)) {
+        throw JSException("message sending time has already passed");
+      }
+      firstTime = firstTime ? min(firstTime, when) : when;
+      lastTime = max(lastTime, when);
+    }
+
+    if (!(status & 0x80)) {
+      throw JSException("invalid status byte in batch");
+    }
+
+    if (status == MIDI::SYSEX_START) {
+      const uint32_t offset = MIDI::unpackUint32(record + MIDI::PACKED_SYSEX_OFFSET);
+      const uint32_t sysexLength = MIDI::unpackUint32(record + MIDI::PACKED_SYSEX_LENGTH);
+      if (offset > length || sysexLength > length - offset || sysexLength < 2) {
+        throw JSException("sysex message in batch out of buffer bounds");
+      }
+      const unsigned char* sysex = buffer + offset;
+      if (sysex[0] != MIDI::SYSEX_START || sysex[sysexLength - 1] != 0xf7) {
+        throw JSException("sysex message must start with 0xf0 and be terminated by 0xf7");
+      }
+    } else if ((record[MIDI::PACKED_DATA1] | record[MIDI::PACKED_DATA2]) & 0x80) {
+      throw JSException("invalid data byte in batch");
+    }
+  }
+
+  // Queue the timed messages and translate the others into PmEvents.
+  // Sysex messages are packed four bytes per PmEvent, first byte in
+  // the least significant byte, as expected by Pm_Write.
+  unique_lock<mutex> lock(_writeMutex);
+  _batchEvents.clear();
+  size_t sent = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char* record = buffer + i * MIDI::PACKED_EVENT_SIZE;
+    const PmTimestamp when = MIDI::unpackUint32(record + MIDI::PACKED_TIMESTAMP);
+    const unsigned char status = record[MIDI::PACKED_STATUS];
+    const PmMessage message = Pm_Message(status, record[MIDI::PACKED_DATA1], record[MIDI::PACKED_DATA2]);
+    const unsigned char* sysex = 0;
+    uint32_t sysexLength = 0;
+
+    if (status == MIDI::SYSEX_START) {
+      sysex = buffer + MIDI::unpackUint32(record + MIDI::PACKED_SYSEX_OFFSET);
+      sysexLength = MIDI::unpackUint32(record + MIDI::PACKED_SYSEX_LENGTH);
+    }
+
+    if (when) {
+      enqueue(when, message, sysex, sysexLength, tag);
+      continue;
+    }
+
+    sent++;
+    PmEvent event;
+    event.timestamp = 0;
+    if (sysex) {
+      for (uint32_t j = 0; j < sysexLength; j += 4) {
+        event.message = 0;
+        for (uint32_t k = 0; k < 4 && j + k < sysexLength; k++) {
+          event.message |= (PmMessage) sysex[j + k] << (8 * k);
+        }
+        _batchEvents.push_back(event);
+      }
+    } else {
+      event.message = message;
+      _batchEvents.push_back(event);
+    }
+  }
+
+  if (lastTime) {
+    scheduleSend(lastTime);
+    Porttime::schedule(firstTime - RELEASE_AHEAD);
+  }
+
+  if (!_batchEvents.empty()) {
+    const int64_t start = MIDI::trace.now();
+    PmError e = Pm_Write(_pmMidiStream, &_batchEvents[0], _batchEvents.size());
+    if (e < 0) {
+      throw PortMidiJSException("could not send MIDI batch", e);
+    }
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, _batchEvents.size());
+    _sentCount += sent;
+  }
+}
+
+// Queue a message in the scheduler.  Sysex messages are copied.
+// Called with _writeMutex held.
+void
+MIDIOutput::enqueue(PmTimestamp when, PmMessage message, const unsigned char* sysex, size_t sysexLength, uint32_t tag)
+{
+  ScheduledMessage scheduled;
+  scheduled.message = message;
+  if (sysex) {
+    scheduled.sysex = static_cast<unsigned char*>(malloc(sysexLength));
+    if (!scheduled.sysex) {
+      throw JSException("out of memory queueing sysex message");
+    }
+    memcpy(scheduled.sysex, sysex, sysexLength);
+  }
+  _scheduled.insert(when, scheduled, tag);
+  _queuedCount++;
+}
+
+void
+MIDIOutput::sendFromTimer(PmTimestamp when, PmMessage message)
+{
+  unique_lock<mutex> lock(_writeMutex);
+  if (!_pmMidiStream) {
+    return;
+  }
+  if (_latency) {
+    ScheduledMessage scheduled;
+    scheduled.message = message;
+    _scheduled.insert(when, scheduled);
+    _queuedCount++;
+  } else {
+    const int64_t start = MIDI::trace.now();
+    Pm_WriteShort(_pmMidiStream, 0, message);
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, 1);
+    _sentCount++;
+  }
+}
+
+void
+MIDIOutput::sendThru(PmTimestamp timestamp, PmMessage message)
+{
+  unique_lock<mutex> lock(_writeMutex);
+  if (_pmMidiStream) {
+    const int64_t start = MIDI::trace.now();
+    Pm_WriteShort(_pmMidiStream, timestamp, message);
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, 1);
+    _sentCount++;
+  }
+}
+
+// Sysex messages that cannot be queued for lack of memory are dropped
+void
+MIDIOutput::sendSysexFromTimer(PmTimestamp when, const unsigned char* sysex, size_t length)
+{
+  unique_lock<mutex> lock(_writeMutex);
+  if (!_pmMidiStream) {
+    return;
+  }
+  if (_latency) {
+    try {
+      enqueue(when, 0, sysex, length, 0);
+    }
+    catch (JSException&) {
+    }
+  } else {
+    const int64_t start = MIDI::trace.now();
+    Pm_WriteSysEx(_pmMidiStream, 0, const_cast<unsigned char*>(sysex));
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, 1);
+    _sentCount++;
+  }
+}
+
+size_t
+MIDIOutput::cancel(uint32_t tag)
+{
+  unique_lock<mutex> lock(_writeMutex);
+  return _scheduled.cancel(tag, FreeSysex());
+}
+
+// Called by the Porttime thread with _writeMutex held.  Short messages
+// are collected and written with one Pm_Write call, sysex messages
+// are written directly after the short messages before them.
+void
+MIDIOutput::releaseMessage(uint32_t when, const ScheduledMessage& scheduled, int64_t now)
+{
+  _releasedCount++;
+  const int64_t slack = Porttime::expand(when) - now;
+  if (slack >= 0) {
+    _releaseSlack.record((uint32_t) slack);
+  } else {
+    _lateCount++;
+    _releaseLateness.record((uint32_t) -slack);
+  }
+
+  if (scheduled.sysex) {
+    flushReleased();
+    const int64_t start = MIDI::trace.now();
+    Pm_WriteSysEx(_pmMidiStream, when, scheduled.sysex);
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, 1);
+    free(scheduled.sysex);
+  } else {
+    PmEvent event;
+    event.timestamp = when;
+    event.message = scheduled.message;
+    _releaseEvents.push_back(event);
+  }
+}
+
+void
+MIDIOutput::flushReleased()
+{
+  if (!_releaseEvents.empty()) {
+    const int64_t start = MIDI::trace.now();
+    Pm_Write(_pmMidiStream, &_releaseEvents[0], _releaseEvents.size());
+    MIDI::trace.finish(MIDI::TRACE_WRITE, start, _releaseEvents.size());
+    _releaseEvents.clear();
+  }
+}
+
+void
+MIDIOutput::releaseAll(PmTimestamp timestamp)
+{
+  unique_lock<mutex> outputsLock(_outputsMutex);
+  const int64_t now = Porttime::microseconds();
+
+  for (set<MIDIOutput*>::iterator i = _outputs.begin(); i != _outputs.end(); i++) {
+    MIDIOutput* output = *i;
+    unique_lock<mutex> lock(output->_writeMutex);
+    Releaser releaser = { output, now };
+    output->_scheduled.expire(timestamp + RELEASE_AHEAD, releaser);
+    output->flushReleased();
+  }
+}
+
+void
+MIDIOutput::checkScheduledSends(PmTimestamp timestamp)
+{
+  unique_lock<mutex> lock(_lastScheduledSendLock);
+  if (_lastScheduledSend && Porttime::before(_lastScheduledSend, timestamp)) {
+    ev_unref(EV_DEFAULT_UC);
+    _lastScheduledSend = 0;
+  }
+}
+
+void
+MIDIOutput::nextDue(PmTimestamp& next)
+{
+  {
+    unique_lock<mutex> outputsLock(_outputsMutex);
+
+    for (set<MIDIOutput*>::iterator i = _outputs.begin(); i != _outputs.end(); i++) {
+      unique_lock<mutex> lock((*i)->_writeMutex);
+      timingwheel<ScheduledMessage>::time_type when;
+      if ((*i)->_scheduled.next(when)) {
+        next = Porttime::earliest(next, when - RELEASE_AHEAD);
+      }
+    }
+  }
+
+  unique_lock<mutex> lock(_lastScheduledSendLock);
+  if (_lastScheduledSend) {
+    next = Porttime::earliest(next, _lastScheduledSend + 1);
+  }
+}
+
+Local<Array>
+MIDIOutput::allStats()
+{
+  vector<Stats> outputs;
+  {
+    unique_lock<mutex> outputsLock(_outputsMutex);
+    outputs.resize(_outputs.size());
+    vector<Stats>::iterator stats = outputs.begin();
+    for (set<MIDIOutput*>::iterator i = _outputs.begin(); i != _outputs.end(); i++, stats++) {
+      MIDIOutput* output = *i;
+      stats->portName = output->portName();
+      stats->sent = output->_sentCount;
+      stats->queued = output->_queuedCount;
+      stats->released = output->_releasedCount;
+      stats->late = output->_lateCount;
+      stats->slack = output->_releaseSlack.summarize();
+      stats->lateness = output->_releaseLateness.summarize();
+    }
+  }
+
+  Local<Array> result = Array::New(outputs.size());
+  for (uint32_t i = 0; i < outputs.size(); i++) {
+    Local<Object> stats = Object::New();
+    stats->Set(String::NewSymbol("portName"), String::New(outputs[i].portName.c_str()));
+    stats->Set(String::NewSymbol("sent"), Number::New(outputs[i].sent));
+    stats->Set(String::NewSymbol("queued"), Number::New(outputs[i].queued));
+    stats->Set(String::NewSymbol("released"), Number::New(outputs[i].released));
+    stats->Set(String::NewSymbol("late"), Number::New(outputs[i].late));
+    stats->Set(String::NewSymbol("slack"), MIDI::histogramSummary(outputs[i].slack));
+    stats->Set(String::NewSymbol("lateness"), MIDI::histogramSummary(outputs[i].lateness));
+    result->Set(i, stats);
+  }
+  return result;
+}
+
+void
+MIDIOutput::resetAllStats()
+{
+  unique_lock<mutex> outputsLock(_outputsMutex);
+  for (set<MIDIOutput*>::iterator i = _outputs.begin(); i != _outputs.end(); i++) {
+    MIDIOutput* output = *i;
+    unique_lock<mutex> lock(output->_writeMutex);
+    output->_sentCount = 0;
+    output->_queuedCount = 0;
+    output->_releasedCount = 0;
+    output->_lateCount = 0;
+    output->_releaseSlack.reset();
+    output->_releaseLateness.reset();
+  }
+}
+
+// v8 interface
+
+Handle<Value>
+MIDIOutput::New(const Arguments& args)
+{
+  if (!args.IsConstructCall()) {
+    return ThrowException(String::New("MIDIOutput function can only be used as a constructor"));
+  }
+  HandleScope scope;
+
+  try {
+    int32_t latency = 0;
+    if (args.Length() > 1) {
+      latency = args[1]->Int32Value();
+    }
+
+    MIDIOutput* midiOutput = new MIDIOutput((args[0] != Undefined()) ? *String::Utf8Value(args[0]) : 0,
+                                            latency);
+    midiOutput->Wrap(args.This());
+    args.This()->Set(String::New("portName"), String::New(midiOutput->portName().c_str()), ReadOnly);
+
+    return args.This();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDIOutput::send(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
+  PmTimestamp when = 0;
+
+  try {
+    if (args.Length() < 1) {
+      throw JSException("missing argument to MIDIOut::send");
+    }
+
+    if (args.Length() > 1) {
+      if (!midiOutput->latency() && (args[1] != Undefined())) {
+        throw JSException("can't delay message sending on MIDI output stream opened with zero latency");
+      }
+
+      if (args[1] != Undefined()) {
+        // Portmidi times are milliseconds, round to the nearest one
+        when = Porttime::truncate(MIDI::timeArgument(args[1]) + 500);
+      }
+    }
+
+    uint32_t tag = 0;
+    if (args.Length() > 2 && args[2] != Undefined()) {
+      if (!args[2]->IsNumber() || args[2]->IntegerValue() < 1 || args[2]->IntegerValue() > 0xffffffffLL) {
+        throw JSException("message tag must be a positive 32 bit integer");
+      }
+      tag = args[2]->Uint32Value();
+    }
+
+    // Buffers and byte arrays are sent from their own memory, strings
+    // and arrays are decoded into _messageBytes
+    vector<unsigned char>& bytes = midiOutput->_messageBytes;
+    if (Buffer::HasInstance(args[0])) {
+      Local<Object> buffer = args[0]->ToObject();
+      midiOutput->send(reinterpret_cast<const unsigned char*>(Buffer::Data(buffer)),
+                       Buffer::Length(buffer),
+                       when, tag);
+    } else if (args[0]->IsObject()
+               && args[0]->ToObject()->HasIndexedPropertiesInExternalArrayData()) {
+      Local<Object> array = args[0]->ToObject();
+      switch (array->GetIndexedPropertiesExternalArrayDataType()) {
+      case kExternalByteArray:
+      case kExternalUnsignedByteArray:
+        break;
+      default:
+        throw JSException("unexpected element type of typed array to send, expecting bytes");
+      }
+      midiOutput->send(static_cast<const unsigned char*>(array->GetIndexedPropertiesExternalArrayData()),
+                       array->GetIndexedPropertiesExternalArrayDataLength(),
+                       when, tag);
+    } else if (args[0]->IsString()) {
+      String::Utf8Value messageString(args[0]);
+      decodeHex(*messageString, messageString.length(), bytes);
+      midiOutput->send(bytes.empty() ? 0 : &bytes[0], bytes.size(), when, tag);
+    } else if (args[0]->IsArray()) {
+      Local<Array> messageArray = Local<Array>::Cast(args[0]);
+      const unsigned length = messageArray->Length();
+      bytes.resize(length);
+      for (unsigned i = 0; i < length; i++) {
+        Local<Value> element = messageArray->Get(i);
+        if (!element->IsNumber()) {
+          throw JSException("unexpected array element in array to send, expecting only integers");
+        }
+        bytes[i] = element->Int32Value();
+      }
+      midiOutput->send(length ? &bytes[0] : 0, length, when, tag);
+    } else {
+      throw JSException("unexpected type for MIDI message argument");
+    }
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDIOutput::sendBatch(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
+
+  try {
+    if (args.Length() < 1 || !Buffer::HasInstance(args[0])) {
+      throw JSException("need a Buffer argument in MIDIOutput::sendBatch");
+    }
+
+    Local<Object> buffer = args[0]->ToObject();
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(Buffer::Data(buffer));
+    const size_t length = Buffer::Length(buffer);
+
+    size_t count;
+    if (args.Length() > 1 && args[1] != Undefined()) {
+      if (!args[1]->IsNumber() || args[1]->IntegerValue() < 0) {
+        throw JSException("invalid event count in MIDIOutput::sendBatch");
+      }
+      count = args[1]->IntegerValue();
+    } else {
+      if (length % MIDI::PACKED_EVENT_SIZE) {
+        throw JSException("batch buffer length is not a multiple of the event record size");
+      }
+      count = length / MIDI::PACKED_EVENT_SIZE;
+    }
+
+    uint32_t tag = 0;
+    if (args.Length() > 2 && args[2] != Undefined()) {
+      if (!args[2]->IsNumber() || args[2]->IntegerValue() < 1 || args[2]->IntegerValue() > 0xffffffffLL) {
+        throw JSException("message tag must be a positive 32 bit integer");
+      }
+      tag = args[2]->Uint32Value();
+    }
+
+    midiOutput->sendBatch(data, length, count, tag);
+
+    return Undefined();
+  }
+  catch (const JSException& e) {
+    return e.asV8Exception();
+  }
+}
+
+Handle<Value>
+MIDIOutput::cancel(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber()) {
+    return ThrowException(String::New("need one numeric tag argument in cancel"));
+  }
+
+  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
+  return scope.Close(v8::Integer::NewFromUnsigned(midiOutput->cancel(args[0]->Uint32Value())));
+}
+
+Handle<Value>
+MIDIOutput::queueDepth(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
+  unique_lock<mutex> lock(midiOutput->_writeMutex);
+  return scope.Close(v8::Integer::NewFromUnsigned(midiOutput->_scheduled.size()));
+}
+
+Handle<Value>
+MIDIOutput::close(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
+  midiOutput->closePort();
+  return Undefined();
+}
+
+void
+MIDIOutput::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  Handle<FunctionTemplate> midiOutputTemplate = FunctionTemplate::New(New);
+  midiOutputTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate = Persistent<FunctionTemplate>::New(midiOutputTemplate);
+
+  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "close", close);
+  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "send", send);
+  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "sendBatch", sendBatch);
+  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "cancel", cancel);
+  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "queueDepth", queueDepth);
+
+  target->Set(String::NewSymbol("MIDIOutput"), midiOutputTemplate->GetFunction());
+}
+
+// //////////////////////////////////////////////////////////////////
+// SoundingNotes guts
+// //////////////////////////////////////////////////////////////////
+
+void
+SoundingNotes::track(PmMessage message)
+{
+  const unsigned char status = Pm_MessageStatus(message);
+  const int channel = status & 0x0f;
+  const int key = Pm_MessageData1(message);
+  const uint32_t bit = 1u << (key % 32);
+
+  if ((status & 0xf0) == MIDI::NOTE_ON_STATUS && Pm_MessageData2(message)) {
+    _notes[channel][key / 32] |= bit;
+  } else if ((status & 0xf0) == MIDI::NOTE_OFF_STATUS
+             || (status & 0xf0) == MIDI::NOTE_ON_STATUS) {
+    _notes[channel][key / 32] &= ~bit;
+  }
+}
+
+void
+SoundingNotes::stopAll(MIDIOutput* output, PmTimestamp when)
+{
+  for (int channel = 0; channel < 16; channel++) {
+    for (int word = 0; word < 4; word++) {
+      for (int bit = 0; _notes[channel][word]; bit++) {
+        if (_notes[channel][word] & (1u << bit)) {
+          output->sendFromTimer(when, Pm_Message(MIDI::NOTE_OFF_STATUS | channel, word * 32 + bit, 0));
+          _notes[channel][word] &= ~(1u << bit);
+        }
+      }
+    }
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// Route guts
+// //////////////////////////////////////////////////////////////////
+
+Route::Route(uint32_t id, MIDIOutput* output, Handle<Object> outputObject)
+  : _id(id),
+    _output(output),
+    _outputObject(Persistent<Object>::New(outputObject)),
+    _types(~(1u << MIDI::SYSEX)),
+    _channels(0xffff),
+    _lowKey(0),
+    _highKey(127),
+    _channel(-1),
+    _transpose(0),
+    _velocity(0)
+{
+}
+
+Route::~Route()
+{
+  _outputObject.Dispose();
+}
+
+int
+Route::intOption(Handle<Object> options, const char* name, int defaultValue, int min, int max)
+  throw(JSException)
+{
+  Local<Value> value = options->Get(String::NewSymbol(name));
+  if (value->IsUndefined()) {
+    return defaultValue;
+  }
+  if (!value->IsNumber() || value->IntegerValue() < min || value->IntegerValue() > max) {
+    throw JSException(string("invalid route option ") + name);
+  }
+  return value->IntegerValue();
+}
+
+// Options are types (array of message type names), channels (array of
+// channel numbers, one based), keys ([low, high]), channel (target
+// channel), transpose and velocity.
+void
+Route::configure(Handle<Object> options)
+  throw(JSException)
+{
+  Local<Value> types = options->Get(String::NewSymbol("types"));
+  if (!types->IsUndefined()) {
+    if (!types->IsArray()) {
+      throw JSException("route types must be an array of message type names");
+    }
+    Local<Array> array = Local<Array>::Cast(types);
+    _types = 0;
+    for (uint32_t i = 0; i < array->Length(); i++) {
+      const MIDI::MessageType type = MIDI::messageType(*String::Utf8Value(array->Get(i)));
+      if (type == MIDI::UNDEFINED_MESSAGE || type == MIDI::SYSEX || type >= MIDI::NRPN7) {
+        throw JSException(string("cannot route message type ") + *String::Utf8Value(array->Get(i)));
+      }
+      _types |= 1u << type;
+    }
+  }
+
+  Local<Value> channels = options->Get(String::NewSymbol("channels"));
+  if (!channels->IsUndefined()) {
+    if (!channels->IsArray()) {
+      throw JSException("route channels must be an array of channel numbers");
+    }
+    Local<Array> array = Local<Array>::Cast(channels);
+    _channels = 0;
+    for (uint32_t i = 0; i < array->Length(); i++) {
+      const int64_t channel = array->Get(i)->IntegerValue();
+      if (channel < 1 || channel > 16) {
+        throw JSException("route channel numbers must be between 1 and 16");
+      }
+      _channels |= 1 << (channel - 1);
+    }
+  }
+
+  Local<Value> keys = options->Get(String::NewSymbol("keys"));
+  if (!keys->IsUndefined()) {
+    if (!keys->IsArray() || Local<Array>::Cast(keys)->Length() != 2) {
+      throw JSException("route keys must be a [low, high] array");
+    }
+    Local<Array> array = Local<Array>::Cast(keys);
+    _lowKey = array->Get(0)->Int32Value();
+    _highKey = array->Get(1)->Int32Value();
+    if (_lowKey < 0 || _highKey > 127 || _lowKey > _highKey) {
+      throw JSException("invalid route key range");
+    }
+  }
+
+  _channel = intOption(options, "channel", 0, 0, 16) - 1;
+  _transpose = intOption(options, "transpose", 0, -127, 127);
+  _velocity = intOption(options, "velocity", 0, 0, 127);
+}
+
+bool
+Route::map(PmMessage& message) const
+{
+  unsigned status = Pm_MessageStatus(message);
+  const MIDI::MessageType type = MIDI::messageType(status);
+  if (type == MIDI::UNDEFINED_MESSAGE || !(_types & (1u << type))) {
+    return false;
+  }
+  if (status >= 0xf0) {
+    return true;
+  }
+
+  if (!(_channels & (1 << (status & 0x0f)))) {
+    return false;
+  }
+  if (_channel >= 0) {
+    status = (status & 0xf0) | _channel;
+  }
+
+  int data1 = Pm_MessageData1(message);
+  int data2 = Pm_MessageData2(message);
+  if (type == MIDI::NOTE_ON || type == MIDI::NOTE_OFF || type == MIDI::POLYPHONIC_KEY_PRESSURE) {
+    if (data1 < _lowKey || data1 > _highKey) {
+      return false;
+    }
+    data1 += _transpose;
+    if (data1 < 0 || data1 > 127) {
+      return false;
+    }
+    // A note on with velocity 0 is a note off
+    if (type == MIDI::NOTE_ON && data2 && _velocity) {
+      data2 = _velocity;
+    }
+  }
+
+  message = Pm_Message(status, data1, data2);
+  return true;
+}
+
+void
+Route::forward(PmTimestamp timestamp, PmMessage message)
+{
+  if (map(message)) {
+    _soundingNotes.track(message);
+    _output->sendThru(timestamp, message);
+  }
+}
+
+void
+Route::stopNotes()
+{
+  _soundingNotes.stopAll(_output, Porttime::time());
+}
+
+// //////////////////////////////////////////////////////////////////
+// Pattern guts
+// //////////////////////////////////////////////////////////////////
+
+// Swing delays the second half of each pair of swing units: The first
+// unit is stretched by (1 + swing), the second one compressed by
+// (1 - swing).
+double
+Pattern::Configuration::swungTick(uint32_t tick) const
+{
+  if (swing == 0 || swingUnit == 0) {
+    return tick;
+  }
+  const uint32_t pair = 2 * swingUnit;
+  const uint32_t position = tick % pair;
+  const double pairStart = tick - position;
+  const double swung = (position < swingUnit)
+    ? position * (1 + swing)
+    : swingUnit * (1 + swing) + (position - swingUnit) * (1 - swing);
+  return min(pairStart + swung, (double) length);
+}
+
+Pattern::Pattern(MIDIOutput* output, Handle<Object> outputObject)
+  : _output(output),
+    _outputObject(Persistent<Object>::New(outputObject)),
+    _changed(false),
+    _playing(false),
+    _loopStart(0),
+    _nextEvent(0),
+    _loopCount(0),
+    _lastSendTime(0)
+{
+  _next.length = 4 * DEFAULT_TICKS_PER_BEAT;
+  _next.ticksPerBeat = DEFAULT_TICKS_PER_BEAT;
+  _next.tempo = 120;
+  _next.swing = 0;
+  _next.swingUnit = DEFAULT_TICKS_PER_BEAT / 4;
+  _current = _next;
+}
+
+Pattern::~Pattern()
+{
+  Porttime::removeClient(this);
+  _outputObject.Dispose();
+}
+
+// Called in the Porttime thread
+void
+Pattern::tick(int64_t microseconds)
+{
+  unique_lock<mutex> lock(_mutex);
+
+  if (!_playing) {
+    return;
+  }
+
+  const int64_t horizon = microseconds + (_output->latency() ? LOOKAHEAD * 1000 : 0);
+
+  while (true) {
+    if (_nextEvent == _current.events.size()) {
+      const double length = _current.length * _current.microsecondsPerTick();
+      const int64_t loopEnd = _loopStart + (int64_t) floor(length + 0.5);
+      if (loopEnd > horizon) {
+        break;
+      }
+      _loopStart = loopEnd;
+      _nextEvent = 0;
+      _loopCount++;
+      if (_changed) {
+        _current = _next;
+        _changed = false;
+      }
+      continue;
+    }
+
+    const Event& event = _current.events[_nextEvent];
+    const double offset = _current.swungTick(event.tick) * _current.microsecondsPerTick();
+    const int64_t time = _loopStart + (int64_t) floor(offset + 0.5);
+    if (time > horizon) {
+      break;
+    }
+    _lastSendTime = Porttime::truncate(time + 500);
+    _output->sendFromTimer(_lastSendTime, event.message);
+    _soundingNotes.track(event.message);
+    _nextEvent++;
+  }
+}
+
+// v8 interface
+
+Handle<Value>
+Pattern::New(const Arguments& args)
+{
+  if (!args.IsConstructCall()) {
+    return ThrowException(String::New("Pattern function can only be used as a constructor"));
+  }
+  HandleScope scope;
+
+  if (args.Length() < 1 || !MIDIOutput::constructorTemplate->HasInstance(args[0])) {
+    return ThrowException(String::New("need MIDIOutput argument in Pattern constructor"));
+  }
+
+  Local<Object> outputObject = args[0]->ToObject();
+  Pattern* pattern = new Pattern(ObjectWrap::Unwrap<MIDIOutput>(outputObject), outputObject);
+  pattern->Wrap(args.This());
+
+  return args.This();
+}
+
+// setEvents(events, lengthInTicks, [ticksPerBeat]).  events is an array
+// of [ tick, status, data1, data2 ] arrays.
+Handle<Value>
+Pattern::setEvents(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 2 || !args[0]->IsArray() || !args[1]->IsNumber() || args[1]->IntegerValue() < 1) {
+    return ThrowException(String::New("need events array and positive length arguments in setEvents"));
+  }
+
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+  Local<Array> eventsArray = Local<Array>::Cast(args[0]);
+  const uint32_t length = args[1]->Uint32Value();
+  uint32_t ticksPerBeat = DEFAULT_TICKS_PER_BEAT;
+  if (args.Length() > 2 && args[2] != Undefined()) {
+    if (!args[2]->IsNumber() || args[2]->IntegerValue() < 1) {
+      return ThrowException(String::New("ticks per beat must be a positive number"));
+    }
+    ticksPerBeat = args[2]->Uint32Value();
+  }
+
+  vector<Event> events;
+  events.reserve(eventsArray->Length());
+  for (uint32_t i = 0; i < eventsArray->Length(); i++) {
+    Local<Value> element = eventsArray->Get(i);
+    if (!element->IsArray()) {
+      return ThrowException(String::New("pattern events must be arrays [ tick, status, data1, data2 ]"));
+    }
+    Local<Array> eventArray = Local<Array>::Cast(element);
+    const uint32_t tick = eventArray->Get(0)->Uint32Value();
+    const int status = eventArray->Get(1)->Int32Value();
+    const int data1 = eventArray->Get(2)->Int32Value();
+    const int data2 = eventArray->Get(3)->Int32Value();
+    if (tick >= length) {
+      return ThrowException(String::New("pattern event tick beyond pattern length"));
+    }
+    if (status < 0x80 || status >= MIDI::SYSEX_START || (data1 & ~0x7f) || (data2 & ~0x7f)) {
+      return ThrowException(String::New("invalid MIDI message in pattern, only channel messages are supported"));
+    }
+    Event event;
+    event.tick = tick;
+    event.message = Pm_Message(status, data1, data2);
+    events.push_back(event);
+  }
+  stable_sort(events.begin(), events.end());
+
+  unique_lock<mutex> lock(pattern->_mutex);
+  pattern->_next.events.swap(events);
+  pattern->_next.length = length;
+  pattern->_next.ticksPerBeat = ticksPerBeat;
+  pattern->_changed = true;
+  if (!pattern->_playing) {
+    pattern->_current = pattern->_next;
+    pattern->_changed = false;
+  }
+
+  return Undefined();
+}
+
+Handle<Value>
+Pattern::setTempo(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->NumberValue() <= 0) {
+    return ThrowException(String::New("need one positive numeric argument in setTempo"));
+  }
+
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+  unique_lock<mutex> lock(pattern->_mutex);
+  pattern->_next.tempo = args[0]->NumberValue();
+  pattern->_changed = true;
+  if (!pattern->_playing) {
+    pattern->_current = pattern->_next;
+    pattern->_changed = false;
+  }
+
+  return Undefined();
+}
+
+// setSwing(amount, [unitInTicks]).  amount is between 0 (straight) and
+// 1, the unit defaults to a sixteenth note.
+Handle<Value>
+Pattern::setSwing(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() < 1 || !args[0]->IsNumber()
+      || args[0]->NumberValue() < 0 || args[0]->NumberValue() >= 1) {
+    return ThrowException(String::New("swing amount must be a number from 0 to below 1"));
+  }
+
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+  unique_lock<mutex> lock(pattern->_mutex);
+  pattern->_next.swing = args[0]->NumberValue();
+  pattern->_next.swingUnit = (args.Length() > 1 && args[1]->IsNumber())
+    ? args[1]->Uint32Value()
+    : pattern->_next.ticksPerBeat / 4;
+  pattern->_changed = true;
+  if (!pattern->_playing) {
+    pattern->_current = pattern->_next;
+    pattern->_changed = false;
+  }
+
+  return Undefined();
+}
+
+// start([time]).  The pattern starts at the given absolute time, or
+// right away.
+Handle<Value>
+Pattern::start(const Arguments& args)
+{
+  HandleScope scope;
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+
+  PmTimestamp when = Porttime::time();
+  if (args.Length() > 0 && args[0] != Undefined()) {
+    when = MIDI::startTimeArgument(args[0]);
+  }
+
+  {
+    unique_lock<mutex> lock(pattern->_mutex);
+    if (pattern->_playing) {
+      return ThrowException(String::New("pattern is already playing"));
+    }
+    if (pattern->_changed) {
+      pattern->_current = pattern->_next;
+      pattern->_changed = false;
+    }
+    pattern->_loopStart = Porttime::expand(when);
+    pattern->_nextEvent = 0;
+    pattern->_loopCount = 0;
+    pattern->_playing = true;
+  }
+
+  // Keep the pattern and the event loop alive while playing
+  pattern->Ref();
+  ev_ref(EV_DEFAULT_UC);
+  Porttime::addClient(pattern);
+
+  return Undefined();
+}
+
+Handle<Value>
+Pattern::stop(const Arguments& args)
+{
+  HandleScope scope;
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
 
-  MIDIInput::Initialize(target);
-  MIDIOutput::Initialize(target);
+  {
+    unique_lock<mutex> lock(pattern->_mutex);
+    if (!pattern->_playing) {
+      return Undefined();
+    }
+    pattern->_playing = false;
+    // Events up to LOOKAHEAD ahead may have been queued already
+    pattern->_soundingNotes.stopAll(pattern->_output, Porttime::latest(Porttime::time(), pattern->_lastSendTime));
+  }
+
+  Porttime::removeClient(pattern);
+  ev_unref(EV_DEFAULT_UC);
+  pattern->Unref();
+
+  return Undefined();
+}
+
+Handle<Value>
+Pattern::playing(const Arguments& args)
+{
+  HandleScope scope;
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+  unique_lock<mutex> lock(pattern->_mutex);
+  return scope.Close(Boolean::New(pattern->_playing));
+}
+
+Handle<Value>
+Pattern::loopCount(const Arguments& args)
+{
+  HandleScope scope;
+  Pattern* pattern = ObjectWrap::Unwrap<Pattern>(args.This());
+  unique_lock<mutex> lock(pattern->_mutex);
+  return scope.Close(v8::Integer::NewFromUnsigned(pattern->_loopCount));
+}
+
+void
+Pattern::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  Handle<FunctionTemplate> patternTemplate = FunctionTemplate::New(New);
+  patternTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "setEvents", setEvents);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "setTempo", setTempo);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "setSwing", setSwing);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "start", start);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "stop", stop);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "playing", playing);
+  NODE_SET_PROTOTYPE_METHOD(patternTemplate, "loopCount", loopCount);
+
+  target->Set(String::NewSymbol("Pattern"), patternTemplate->GetFunction());
 }
 
 // //////////////////////////////////////////////////////////////////
-// MIDIStream guts
+// SequencePlayer guts
 // //////////////////////////////////////////////////////////////////
 
-MIDIStream::MIDIStream(MIDI::PortDirection direction, const char* portNameArg)
+SequencePlayer::SequencePlayer(MIDIOutput* output, Handle<Object> outputObject)
+  : _output(output),
+    _playing(false),
+    _lastSendTime(0),
+    _ended(false),
+    _active(false)
 {
-  const char* environmentVariableName = (direction == MIDI::INPUT) ? "MIDI_INPUT" : "MIDI_OUTPUT";
-  const char* portNameFromEnvironment = getenv(environmentVariableName);
-  bool useFirst = false;
+  if (output) {
+    _outputObject = Persistent<Object>::New(outputObject);
+  }
 
-  string portName = portNameArg ? portNameArg : "";
-  if (portNameArg) {
-    portName = portNameArg;
-  } else if (portNameFromEnvironment) {
-    portName = portNameFromEnvironment;
-  } else {
-    useFirst = true;
+  // Like the input notifier, the watcher does not keep the event loop
+  // alive by itself, play() does.
+  _notifier.data = this;
+  ev_async_init(&_notifier, notified);
+  ev_async_start(EV_DEFAULT_UC_ &_notifier);
+  ev_unref(EV_DEFAULT_UC);
+}
+
+SequencePlayer::~SequencePlayer()
+{
+  Porttime::removeClient(this);
+  ev_ref(EV_DEFAULT_UC);
+  ev_async_stop(EV_DEFAULT_UC_ &_notifier);
+  if (!_outputObject.IsEmpty()) {
+    _outputObject.Dispose();
+  }
+}
+
+// Called in the Porttime thread
+void
+SequencePlayer::tick(int64_t microseconds)
+{
+  unique_lock<mutex> lock(_mutex);
+
+  if (!_playing) {
+    return;
   }
 
-  for (int id = 0; id < Pm_CountDevices(); id++) {
-    const PmDeviceInfo* deviceInfo = Pm_GetDeviceInfo(id);
-    if (((direction == MIDI::INPUT) ^ deviceInfo->output)
-        && (useFirst || (portName == deviceInfo->name))) {
-      _portName = deviceInfo->name;
-      _portId = id;
-      return;
+  const int64_t horizon = microseconds + ((_output && _output->latency()) ? LOOKAHEAD * 1000 : 0);
+  const size_t played = _played.size();
+
+  if (!playUntil(horizon)) {
+    _playing = false;
+    _ended = true;
+    if (_output) {
+      _soundingNotes.stopAll(_output, _lastSendTime);
     }
   }
 
-  // no matching port found
-  const char* directionName = (direction == MIDI::INPUT) ? "input" : "output";;
-  if (useFirst) {
-    throw JSException((string) "no MIDI " + directionName + " ports");
-  } else {
-    if (!portNameArg) {
-      throw JSException((string) "invalid MIDI " + directionName + " port name \"" + portName + "\" in " + environmentVariableName + " environment variable");
-    } else {
-      throw JSException((string) "invalid MIDI " + directionName + " port name \"" + portName + "\"");
+  if (_ended || _played.size() != played) {
+    ev_async_send(EV_DEFAULT_UC_ &_notifier);
+  }
+}
+
+void
+SequencePlayer::sendMessage(PmTimestamp when, PmMessage message)
+{
+  if (_output) {
+    _output->sendFromTimer(when, message);
+    _soundingNotes.track(message);
+    return;
+  }
+
+  const unsigned char status = Pm_MessageStatus(message);
+  PlayedMessage played;
+  played.time = when;
+  played.offset = _playedBytes.size();
+  played.length = MIDI::messageLength(status);
+  for (size_t i = 0; i < played.length; i++) {
+    _playedBytes.push_back((message >> (8 * i)) & 0xff);
+  }
+  _played.push_back(played);
+}
+
+void
+SequencePlayer::sendSysex(PmTimestamp when, const unsigned char* sysex, size_t length)
+{
+  if (_output) {
+    _output->sendSysexFromTimer(when, sysex, length);
+    return;
+  }
+
+  PlayedMessage played;
+  played.time = when;
+  played.offset = _playedBytes.size();
+  played.length = length;
+  _playedBytes.insert(_playedBytes.end(), sysex, sysex + length);
+  _played.push_back(played);
+}
+
+void
+SequencePlayer::restart()
+{
+  if (_playing) {
+    const PmTimestamp when = Porttime::latest(Porttime::time(), _lastSendTime);
+    if (_output) {
+      _soundingNotes.stopAll(_output, when);
+    }
+    startAt(Porttime::expand(when));
+  }
+}
+
+// Release the references taken by play()
+void
+SequencePlayer::deactivate()
+{
+  _active = false;
+  Porttime::removeClient(this);
+  ev_unref(EV_DEFAULT_UC);
+  Unref();
+}
+
+void
+SequencePlayer::notified(EV_P_ ev_async* watcher, int revents)
+{
+  static Persistent<String> message_psymbol = NODE_PSYMBOL("message");
+  static Persistent<String> end_psymbol = NODE_PSYMBOL("end");
+
+  SequencePlayer* player = static_cast<SequencePlayer*>(watcher->data);
+
+  vector<PlayedMessage> played;
+  vector<unsigned char> bytes;
+  bool ended;
+  {
+    unique_lock<mutex> lock(player->_mutex);
+    played.swap(player->_played);
+    bytes.swap(player->_playedBytes);
+    ended = player->_ended && !player->_playing;
+    player->_ended = false;
+  }
+
+  HandleScope scope;
+  // Keep the object alive while the listeners run, they may play again
+  player->Ref();
+
+  for (size_t i = 0; i < played.size(); i++) {
+    Local<Array> message = Array::New(played[i].length);
+    for (size_t j = 0; j < played[i].length; j++) {
+      message->Set(j, v8::Integer::New(bytes[played[i].offset + j]));
+    }
+    Local<Value> argv[2] = { message, MIDI::timeValue(played[i].time) };
+    TryCatch tryCatch;
+    player->Emit(message_psymbol, 2, argv);
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+
+  if (ended && player->_active) {
+    player->deactivate();
+    TryCatch tryCatch;
+    player->Emit(end_psymbol, 0, 0);
+    if (tryCatch.HasCaught()) {
+      FatalException(tryCatch);
+    }
+  }
+
+  player->Unref();
+}
+
+// v8 interface
+
+// play([time]).  Playing starts at the current position at the given
+// absolute time, or right away.  At the end, playing starts from the
+// beginning.
+Handle<Value>
+SequencePlayer::play(const Arguments& args)
+{
+  HandleScope scope;
+  SequencePlayer* player = ObjectWrap::Unwrap<SequencePlayer>(args.This());
+
+  PmTimestamp when = Porttime::time();
+  if (args.Length() > 0 && args[0] != Undefined()) {
+    when = MIDI::startTimeArgument(args[0]);
+  }
+
+  {
+    unique_lock<mutex> lock(player->_mutex);
+    if (player->_playing) {
+      return ThrowException(String::New("already playing"));
+    }
+    if (player->atEnd()) {
+      player->rewind();
+    }
+    player->startAt(Porttime::expand(when));
+    player->_lastSendTime = when;
+    player->_ended = false;
+    player->_playing = true;
+  }
+
+  // Keep the player and the event loop alive while playing.  If the
+  // end of the previous play has not been delivered yet, the
+  // references are still held.
+  if (!player->_active) {
+    player->_active = true;
+    player->Ref();
+    ev_ref(EV_DEFAULT_UC);
+    Porttime::addClient(player);
+  }
+
+  return Undefined();
+}
+
+Handle<Value>
+SequencePlayer::stop(const Arguments& args)
+{
+  HandleScope scope;
+  SequencePlayer* player = ObjectWrap::Unwrap<SequencePlayer>(args.This());
+
+  {
+    unique_lock<mutex> lock(player->_mutex);
+    if (player->_playing) {
+      player->_playing = false;
+      // Messages up to LOOKAHEAD ahead may have been queued already
+      if (player->_output) {
+        player->_soundingNotes.stopAll(player->_output, Porttime::latest(Porttime::time(), player->_lastSendTime));
+      }
+    }
+  }
+
+  if (player->_active) {
+    player->deactivate();
+  }
+
+  return Undefined();
+}
+
+Handle<Value>
+SequencePlayer::playing(const Arguments& args)
+{
+  HandleScope scope;
+  SequencePlayer* player = ObjectWrap::Unwrap<SequencePlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  return scope.Close(Boolean::New(player->_playing));
+}
+
+void
+SequencePlayer::SetPrototypeMethods(Handle<FunctionTemplate> playerTemplate)
+{
+  playerTemplate->Inherit(EventEmitter::constructor_template);
+  playerTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "play", play);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "stop", stop);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "playing", playing);
+}
+
+// //////////////////////////////////////////////////////////////////
+// SMFPlayer guts
+// //////////////////////////////////////////////////////////////////
+
+SMFPlayer::SMFPlayer(MIDIOutput* output, Handle<Object> outputObject, const char* filename)
+  throw(JSException)
+  : SequencePlayer(output, outputObject),
+    _file(0),
+    _sequence(0),
+    _timeOrigin(0),
+    _startMicros(0)
+{
+  try {
+    _file = new smffile(filename);
+    _sequence = new smfsequence(*_file);
+  }
+  catch (file_error& e) {
+    delete _file;
+    throw JSException(e.what());
+  }
+}
+
+SMFPlayer::~SMFPlayer()
+{
+  delete _sequence;
+  delete _file;
+}
+
+bool
+SMFPlayer::atEnd() const
+{
+  return _sequence->done();
+}
+
+void
+SMFPlayer::rewind()
+{
+  _sequence->seek(0);
+}
+
+void
+SMFPlayer::startAt(int64_t when)
+{
+  _timeOrigin = when;
+  _startMicros = _sequence->micros();
+}
+
+bool
+SMFPlayer::playUntil(int64_t horizon)
+{
+  smfevent event;
+  while (!_sequence->done()) {
+    const int64_t time = _timeOrigin + (int64_t) floor(_sequence->micros() - _startMicros + 0.5);
+    if (time > horizon) {
+      return true;
+    }
+    _sequence->next(event);
+    _lastSendTime = Porttime::truncate(time + 500);
+
+    if (event.status < MIDI::SYSEX_START) {
+      sendMessage(_lastSendTime, Pm_Message(event.status, event.data1, event.data2));
+    } else if (event.status == smfevent::SYSEX
+               && event.length && event.data[event.length - 1] == MIDI::SYSEX_END) {
+      // Sysex messages split into several events are not supported
+      _sysex.assign(1, MIDI::SYSEX_START);
+      _sysex.insert(_sysex.end(), event.data, event.data + event.length);
+      sendSysex(_lastSendTime, &_sysex[0], _sysex.size());
+    }
+  }
+  return false;
+}
+
+// v8 interface
+
+// SMFPlayer(output, filename)
+Handle<Value>
+SMFPlayer::New(const Arguments& args)
+{
+  if (!args.IsConstructCall()) {
+    return ThrowException(String::New("SMFPlayer function can only be used as a constructor"));
+  }
+  HandleScope scope;
+
+  if (args.Length() < 2 || !MIDIOutput::constructorTemplate->HasInstance(args[0]) || !args[1]->IsString()) {
+    return ThrowException(String::New("need MIDIOutput and file name arguments in SMFPlayer constructor"));
+  }
+
+  try {
+    Local<Object> outputObject = args[0]->ToObject();
+    SMFPlayer* player = new SMFPlayer(ObjectWrap::Unwrap<MIDIOutput>(outputObject),
+                                      outputObject,
+                                      *String::Utf8Value(args[1]));
+    player->Wrap(args.This());
+
+    args.This()->Set(String::NewSymbol("format"), v8::Integer::New(player->_file->format()));
+    args.This()->Set(String::NewSymbol("tracks"), v8::Integer::New(player->_file->tracks().size()));
+    args.This()->Set(String::NewSymbol("ticksPerQuarter"),
+                     v8::Integer::NewFromUnsigned(player->_sequence->ticksPerQuarter()));
+  }
+  catch (JSException& e) {
+    return e.asV8Exception();
+  }
+
+  return args.This();
+}
+
+Handle<Value>
+SMFPlayer::seek(const Arguments& args)
+{
+  return seekTo(args, false);
+}
+
+// Bars are counted from 0 and follow the time signature meta events
+Handle<Value>
+SMFPlayer::seekBar(const Arguments& args)
+{
+  return seekTo(args, true);
+}
+
+// Move to the given tick or bar.  While playing, the new position is
+// played right after the events that have been queued already.
+Handle<Value>
+SMFPlayer::seekTo(const Arguments& args, bool bar)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+    return ThrowException(String::New("need one non-negative numeric argument in seek"));
+  }
+
+  SMFPlayer* player = ObjectWrap::Unwrap<SMFPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+
+  uint32_t tick = args[0]->Uint32Value();
+  if (bar) {
+    if (!player->_sequence->ticksPerQuarter()) {
+      return ThrowException(String::New("file with SMPTE time division has no bars"));
     }
+    tick = player->_sequence->barToTick(tick);
+  }
+  player->_sequence->seek(tick);
+  player->restart();
+
+  return Undefined();
+}
+
+// Tick of the next event to be played
+Handle<Value>
+SMFPlayer::position(const Arguments& args)
+{
+  HandleScope scope;
+  SMFPlayer* player = ObjectWrap::Unwrap<SMFPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  return scope.Close(v8::Integer::NewFromUnsigned(player->_sequence->tick()));
+}
+
+// Duration in milliseconds
+Handle<Value>
+SMFPlayer::duration(const Arguments& args)
+{
+  HandleScope scope;
+  SMFPlayer* player = ObjectWrap::Unwrap<SMFPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  return scope.Close(Number::New(player->_sequence->durationMicros() / 1000));
+}
+
+void
+SMFPlayer::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  Handle<FunctionTemplate> playerTemplate = FunctionTemplate::New(New);
+  SetPrototypeMethods(playerTemplate);
+
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "seek", seek);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "seekBar", seekBar);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "position", position);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "duration", duration);
+
+  target->Set(String::NewSymbol("SMFPlayer"), playerTemplate->GetFunction());
+}
+
+// //////////////////////////////////////////////////////////////////
+// JournalPlayer guts
+// //////////////////////////////////////////////////////////////////
+
+JournalPlayer::JournalPlayer(const char* filename, MIDIOutput* output, Handle<Object> outputObject)
+  throw(JSException)
+  : SequencePlayer(output, outputObject),
+    _journal(0),
+    _speed(1),
+    _timeOrigin(0),
+    _startTimestamp(0),
+    _inSysex(false)
+{
+  try {
+    _journal = new journalreader(filename);
+  }
+  catch (file_error& e) {
+    throw JSException(e.what());
   }
+  _position = _journal->begin();
+}
 
+JournalPlayer::~JournalPlayer()
+{
+  delete _journal;
 }
 
-MIDIStream::~MIDIStream()
+bool
+JournalPlayer::atEnd() const
 {
-  closePort();
+  return _journal->atEnd(_position);
 }
 
 void
-MIDIStream::closePort()
+JournalPlayer::rewind()
 {
-  if (_pmMidiStream) {
-    Pm_Close(_pmMidiStream);
-    _pmMidiStream = 0;
-  }
+  _position = _journal->begin();
 }
 
-// //////////////////////////////////////////////////////////////////
-// MIDIInput guts
-// //////////////////////////////////////////////////////////////////
-
-MIDIInput::MIDIInput(const char* portName)
-  throw(JSException)
-  : MIDIStream(MIDI::INPUT, portName)
+void
+JournalPlayer::startAt(int64_t when)
 {
-  PmError e = Pm_OpenInput(&_pmMidiStream, 
-                           portId(),
-                           0,                  // driver info
-                           MIDISTREAM_BUFSIZE, // buffer size
-                           0,                  // time proc
-                           0);                 // time info
-
-  if (e < 0) {
-    throw PortMidiJSException("could not open MIDI input port", e);
-  }
-
-  unique_lock<mutex> lock(_receiversMutex);
-  _receivers.insert(this);
+  _timeOrigin = when;
+  _startTimestamp = atEnd() ? 0 : _journal->at(_position).timestamp;
+  _inSysex = false;
 }
 
-MIDIInput::~MIDIInput()
+bool
+JournalPlayer::playUntil(int64_t horizon)
 {
-  unique_lock<mutex> lock(_receiversMutex);
-  _receivers.erase(this);
+  while (!_journal->atEnd(_position)) {
+    const journalevent event = _journal->at(_position);
+    const double offset = (int32_t) (event.timestamp - _startTimestamp) * 1000.0 / _speed;
+    const int64_t time = _timeOrigin + (int64_t) floor(offset + 0.5);
+    if (time > horizon) {
+      return true;
+    }
+    _journal->advance(_position);
+    _lastSendTime = Porttime::truncate(time + 500);
+    playEvent(_lastSendTime, event.message);
+  }
+  return false;
 }
 
+// Sysex messages are recorded as they are read from portmidi, four
+// bytes per event, possibly interleaved with realtime messages.
+// Bytes of a sysex message that started before the position at which
+// playing started are skipped.
 void
-MIDIInput::setFilters(int32_t channels,
-                      int32_t filters)
-  throw(JSException)
+JournalPlayer::playEvent(PmTimestamp when, PmMessage message)
 {
-  if (!_pmMidiStream) {
-    throw JSException("cannot set filters for closed MIDI stream");
-  }
+  const unsigned char status = Pm_MessageStatus(message);
 
-  PmError e = Pm_SetChannelMask(_pmMidiStream, channels);
-  if (e < 0) {
-    throw PortMidiJSException("could not set MIDI channels", e);
+  if (MIDI::IS_REALTIME(status)) {
+    sendMessage(when, message);
+    return;
+  }
+  if (status == MIDI::SYSEX_START) {
+    _sysex.clear();
+    _inSysex = true;
+  } else if ((status & 0x80) && status != MIDI::SYSEX_END) {
+    // A status byte ends an incomplete sysex message
+    _inSysex = false;
+    sendMessage(when, message);
+    return;
+  } else if (!_inSysex) {
+    return;
   }
 
-  e = Pm_SetFilter(_pmMidiStream, filters);
-  if (e < 0) {
-    throw PortMidiJSException("could not set MIDI filter", e);
+  for (int i = 0; i < 4; i++) {
+    const unsigned char b = (message >> (8 * i)) & 0xff;
+    _sysex.push_back(b);
+    if (b == MIDI::SYSEX_END) {
+      sendSysex(when, &_sysex[0], _sysex.size());
+      _inSysex = false;
+      return;
+    }
+  }
+  if (_sysex.size() > MAX_SYSEX_LENGTH) {
+    _inSysex = false;
   }
 }
 
 // v8 interface
 
+// JournalPlayer(filename, [output]).  Without an output, messages are
+// emitted as 'message' events.
 Handle<Value>
-MIDIInput::New(const Arguments& args)
+JournalPlayer::New(const Arguments& args)
 {
   if (!args.IsConstructCall()) {
-    return ThrowException(String::New("MIDIInput function can only be used as a constructor"));
+    return ThrowException(String::New("JournalPlayer function can only be used as a constructor"));
   }
-
   HandleScope scope;
 
+  if (args.Length() < 1 || !args[0]->IsString()
+      || (args.Length() > 1 && args[1] != Undefined()
+          && !MIDIOutput::constructorTemplate->HasInstance(args[1]))) {
+    return ThrowException(String::New("need file name and optional MIDIOutput arguments in JournalPlayer constructor"));
+  }
+
   try {
-    MIDIInput* midiInput = new MIDIInput((args[0] != Undefined()) ? *String::Utf8Value(args[0]) : 0);
-    midiInput->Wrap(args.This());
-    args.This()->Set(String::New("portName"), String::New(midiInput->portName().c_str()), ReadOnly);
+    MIDIOutput* output = 0;
+    Local<Object> outputObject;
+    if (args.Length() > 1 && args[1] != Undefined()) {
+      outputObject = args[1]->ToObject();
+      output = ObjectWrap::Unwrap<MIDIOutput>(outputObject);
+    }
+    JournalPlayer* player = new JournalPlayer(*String::Utf8Value(args[0]), output, outputObject);
+    player->Wrap(args.This());
 
-    static Persistent<String> init_psymbol = NODE_PSYMBOL("init");
+    args.This()->Set(String::NewSymbol("events"), Number::New(player->_journal->eventCount()));
+    args.This()->Set(String::NewSymbol("startTime"), v8::Integer::New(player->_journal->firstTimestamp()));
+    args.This()->Set(String::NewSymbol("endTime"), v8::Integer::New(player->_journal->lastTimestamp()));
+  }
+  catch (JSException& e) {
+    return e.asV8Exception();
+  }
 
-    Local<Value> init = args.This()->Get(init_psymbol);
+  return args.This();
+}
 
-    if (!init->IsFunction()) {
-      return ThrowException(String::New("MIDIInput.init function not found"));
-    }
-    Local<Function>::Cast(init)->Call(args.This(), 0, 0);
-    
-    return args.This();
+// seek(time).  Move to the first message recorded at or after time.
+Handle<Value>
+JournalPlayer::seek(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->IntegerValue() < 0) {
+    return ThrowException(String::New("need one non-negative numeric argument in seek"));
   }
-  catch (const JSException& e) {
-    return e.asV8Exception();
+
+  JournalPlayer* player = ObjectWrap::Unwrap<JournalPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  player->_position = player->_journal->seek(args[0]->Uint32Value());
+  player->restart();
+
+  return Undefined();
+}
+
+// setSpeed(factor).  2 plays twice as fast as recorded.
+Handle<Value>
+JournalPlayer::setSpeed(const Arguments& args)
+{
+  HandleScope scope;
+
+  if (args.Length() != 1 || !args[0]->IsNumber() || args[0]->NumberValue() <= 0) {
+    return ThrowException(String::New("need one positive numeric argument in setSpeed"));
   }
+
+  JournalPlayer* player = ObjectWrap::Unwrap<JournalPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  player->_speed = args[0]->NumberValue();
+  player->restart();
+
+  return Undefined();
 }
 
+// Recorded time of the next message to be played
 Handle<Value>
-MIDIInput::setFilters(const Arguments& args)
+JournalPlayer::position(const Arguments& args)
 {
   HandleScope scope;
+  JournalPlayer* player = ObjectWrap::Unwrap<JournalPlayer>(args.This());
+  unique_lock<mutex> lock(player->_mutex);
+  const uint32_t timestamp = player->atEnd()
+    ? player->_journal->lastTimestamp()
+    : player->_journal->at(player->_position).timestamp;
+  return scope.Close(v8::Integer::New(timestamp));
+}
 
-  int32_t channels = 0xffff;
-  int32_t filters = PM_FILT_ACTIVE | PM_FILT_CLOCK | PM_FILT_PLAY | PM_FILT_UNDEFINED | PM_FILT_RESET | PM_FILT_TICK;
+void
+JournalPlayer::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
 
-  switch (args.Length()) {
-  case 2:
-    filters = args[1]->Int32Value();
-  case 1:
-    channels = args[0]->Int32Value();
-  case 0:
-    break;
-  default:
-      return ThrowException(String::New("too many arguments to MIDIInput setFilters"));
+  Handle<FunctionTemplate> playerTemplate = FunctionTemplate::New(New);
+  SetPrototypeMethods(playerTemplate);
+
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "seek", seek);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "setSpeed", setSpeed);
+  NODE_SET_PROTOTYPE_METHOD(playerTemplate, "position", position);
+
+  target->Set(String::NewSymbol("JournalPlayer"), playerTemplate->GetFunction());
+}
+
+// //////////////////////////////////////////////////////////////////
+// MIDIClock guts
+// //////////////////////////////////////////////////////////////////
+
+double
+MIDIClock::Segment::tempoAt(int64_t time) const
+{
+  const double t = (time - startTime) / 1000.0;
+  if (rampDuration == 0 || t >= rampDuration) {
+    return endTempo;
   }
+  return startTempo + (endTempo - startTempo) * t / rampDuration;
+}
 
-  try {
-    MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
-    midiInput->setFilters(channels, filters);
-    return Undefined();
+double
+MIDIClock::Segment::pulsesAt(int64_t time) const
+{
+  const double perMillisecond = PULSES_PER_QUARTER / 60000.0;   // per bpm
+  const double t = (time - startTime) / 1000.0;
+  if (rampDuration == 0 || t >= rampDuration) {
+    const double rampPulses = perMillisecond * (startTempo + endTempo) / 2 * rampDuration;
+    return startPulse + rampPulses + perMillisecond * endTempo * (t - rampDuration);
   }
-  catch (const JSException& e) {
-    return e.asV8Exception();
+  return startPulse + perMillisecond * (startTempo * t + (endTempo - startTempo) * t * t / (2 * rampDuration));
+}
+
+// The inverse of pulsesAt().  During a ramp, the pulse count is a
+// quadratic function of time, solved in the form that is stable for
+// small tempo changes.
+int64_t
+MIDIClock::Segment::timeOfPulse(double pulse) const
+{
+  const double perMillisecond = PULSES_PER_QUARTER / 60000.0;
+  const double q = pulse - startPulse;
+  const double rampPulses = perMillisecond * (startTempo + endTempo) / 2 * rampDuration;
+  double t;
+  if (rampDuration == 0 || q >= rampPulses) {
+    t = rampDuration + (q - rampPulses) / (perMillisecond * endTempo);
+  } else {
+    const double a = perMillisecond * (endTempo - startTempo) / (2 * rampDuration);
+    const double b = perMillisecond * startTempo;
+    t = 2 * q / (b + sqrt(b * b + 4 * a * q));
   }
+  return startTime + (int64_t) floor(t * 1000 + 0.5);
 }
 
-set<MIDIInput*> MIDIInput::_receivers;
-mutex MIDIInput::_receiversMutex;
+MIDIClock::MIDIClock(double bpm)
+  : _allLatency(true),
+    _running(false),
+    _pulse(0),
+    _lastSendTime(0),
+    _jitterCount(0),
+    _jitterMean(0),
+    _jitterM2(0),
+    _jitterMin(0),
+    _jitterMax(0)
+{
+  _segment.startTime = 0;
+  _segment.startPulse = 0;
+  _segment.startTempo = _segment.endTempo = bpm;
+  _segment.rampDuration = 0;
+}
+
+MIDIClock::~MIDIClock()
+{
+  Porttime::removeClient(this);
+  for (size_t i = 0; i < _outputObjects.size(); i++) {
+    _outputObjects[i].Dispose();
+  }
+}
 
 void
-MIDIInput::pollAll()
+MIDIClock::addOutput(MIDIOutput* output, Handle<Object> outputObject)
 {
-  unique_lock<mutex> lock(_receiversMutex);
-  for (set<MIDIInput*>::iterator i = _receivers.begin(); i != _receivers.end(); i++) {
-    (*i)->pollData();
+  _outputs.push_back(output);
+  _outputObjects.push_back(Persistent<Object>::New(outputObject));
+  _allLatency = _allLatency && output->latency();
+}
+
+// Called with _mutex held
+void
+MIDIClock::send(PmTimestamp when, PmMessage message)
+{
+  for (size_t i = 0; i < _outputs.size(); i++) {
+    _outputs[i]->sendFromTimer(when, message);
   }
+  _lastSendTime = when;
 }
 
 void
-MIDIInput::pollData()
+MIDIClock::recordJitter(double error)
 {
-  unique_lock<mutex> lock(_mutex);
-  if (Pm_Poll(_pmMidiStream)) {
-    _dataReceivedCondition.notify_one();
+  _jitterCount++;
+  const double delta = error - _jitterMean;
+  _jitterMean += delta / _jitterCount;
+  _jitterM2 += delta * (error - _jitterMean);
+  if (_jitterCount == 1 || error < _jitterMin) {
+    _jitterMin = error;
+  }
+  if (_jitterCount == 1 || error > _jitterMax) {
+    _jitterMax = error;
   }
 }
 
+// Called in the Porttime thread
 void
-MIDIInput::unpackSysexMessage(PmEvent event)
+MIDIClock::tick(int64_t microseconds)
 {
-  PmMessage message =  event.message;
-  unsigned long buf = static_cast<unsigned long>(message);
+  unique_lock<mutex> lock(_mutex);
 
-  for (int i = 0; i < 4; i++) {
-    unsigned char b = buf & 0xff;
-    buf >>= 8;
-    if (b == MIDI::SYSEX_END) {
-      _currentSysexMessage.data.push_back(b);
-      _currentSysexMessage.timestamp = event.timestamp;
-      _sysexQueue.push(_currentSysexMessage);
-      _currentSysexMessage.data.clear();
+  if (!_running) {
+    return;
+  }
+
+  const int64_t horizon = microseconds + (_allLatency ? LOOKAHEAD * 1000 : 0);
+
+  while (true) {
+    const int64_t deadline = _segment.timeOfPulse(_pulse);
+    if (deadline > horizon) {
       break;
-    } else if (MIDI::IS_REALTIME(b)) {
-      PmEvent rtEvent;
-      rtEvent.message = b;
-      rtEvent.timestamp = event.timestamp;
-      _readQueue.push(rtEvent);
-    } else if ((b & 0x80)
-               && (_currentSysexMessage.data.size() > 1
-                   || (b != MIDI::SYSEX_START))) {
-      // We're receiving some non-realtime status while receiving a
-      // sysex message.  Assume that this is not an error, but flush
-      // the current sysex message (i.e. the user may have unplugged
-      // the cable while a sysex message was being transferred)
-      _currentSysexMessage.data.clear();
-      // Unfortunately, portmidi does not resync itself when it
-      // receives a new message inside a sysex message.  We can cope
-      // with another sysex message, but fail for others.
-      if (b == MIDI::SYSEX_START) {
-        _currentSysexMessage.data.push_back(b);
-      } else {
-        break;
-      }
-    } else {
-      _currentSysexMessage.data.push_back(b);
     }
+    // Outputs with latency send the pulse at its timestamp, the
+    // others right away
+    const PmTimestamp when = Porttime::truncate(deadline + 500);
+    send(when, Pm_Message(TIMING_CLOCK, 0, 0));
+    const int64_t sent = _allLatency ? max(Porttime::expand(when), microseconds) : microseconds;
+    recordJitter((sent - deadline) / 1000.0);
+    _pulse++;
   }
 }
 
+// Called with _mutex held.  The transport message is sent at time,
+// followed by the first pulse.
 void
-MIDIInput::waitForData(ReceiveIOCB* iocb)
+MIDIClock::startAt(int64_t time, unsigned char status)
 {
-  unique_lock<mutex> lock(_mutex);
-  while (!Pm_Poll(_pmMidiStream)) {
-    _dataReceivedCondition.wait(lock);
+  _segment.startTime = time;
+  _segment.startPulse = _pulse;
+  _segment.startTempo = _segment.endTempo;
+  _segment.rampDuration = 0;
+  send(Porttime::truncate(time), Pm_Message(status, 0, 0));
+  _running = true;
+}
+
+void
+MIDIClock::deactivate()
+{
+  Porttime::removeClient(this);
+  ev_unref(EV_DEFAULT_UC);
+  Unref();
+}
+
+// v8 interface
+
+// MIDIClock(outputs, [bpm]).  outputs is a MIDIOutput or an array of
+// MIDIOutputs, the tempo defaults to 120 beats per minute.
+Handle<Value>
+MIDIClock::New(const Arguments& args)
+{
+  if (!args.IsConstructCall()) {
+    return ThrowException(String::New("MIDIClock function can only be used as a constructor"));
   }
+  HandleScope scope;
 
-  const int RECV_EVENTS = 32;                   // xxx fixme move constant
-  PmEvent events[RECV_EVENTS];
-  int rc = Pm_Read(_pmMidiStream, events, RECV_EVENTS);
-  if (rc < 0) {
-    iocb->_error = new PortMidiJSException("error receiving MIDI data", (PmError) rc);
-    while (!_readQueue.empty()) {
-      _readQueue.pop();
-    }
-    while (!_sysexQueue.empty()) {
-      _sysexQueue.pop();
+  vector< Local<Object> > outputObjects;
+  if (args.Length() > 0 && args[0]->IsArray()) {
+    Local<Array> array = Local<Array>::Cast(args[0]);
+    for (uint32_t i = 0; i < array->Length(); i++) {
+      if (!MIDIOutput::constructorTemplate->HasInstance(array->Get(i))) {
+        return ThrowException(String::New("MIDIClock outputs must be MIDIOutput objects"));
+      }
+      outputObjects.push_back(array->Get(i)->ToObject());
     }
-  } else {
-    for (int i = 0; i < rc; i++) {
-      const PmMessage& message = events[i].message;
-      const unsigned status = Pm_MessageStatus(message);
+  } else if (args.Length() > 0 && MIDIOutput::constructorTemplate->HasInstance(args[0])) {
+    outputObjects.push_back(args[0]->ToObject());
+  }
+  if (outputObjects.empty()) {
+    return ThrowException(String::New("need MIDIOutput or array of MIDIOutputs argument in MIDIClock constructor"));
+  }
 
-      if (inSysexMessage()) {
-        if (MIDI::IS_REALTIME(status)) {
-          _readQueue.push(events[i]);
-        } else {
-          unpackSysexMessage(events[i]);
-        }
-      } else {
-        if (status == MIDI::SYSEX_START) {
-          unpackSysexMessage(events[i]);
-        } else {
-          _readQueue.push(events[i]);
-        }
-      }
+  double bpm = 120;
+  if (args.Length() > 1 && args[1] != Undefined()) {
+    if (!args[1]->IsNumber() || args[1]->NumberValue() <= 0) {
+      return ThrowException(String::New("MIDIClock tempo must be a positive number"));
     }
+    bpm = args[1]->NumberValue();
+  }
+
+  MIDIClock* clock = new MIDIClock(bpm);
+  for (size_t i = 0; i < outputObjects.size(); i++) {
+    clock->addOutput(ObjectWrap::Unwrap<MIDIOutput>(outputObjects[i]), outputObjects[i]);
   }
+  clock->Wrap(args.This());
+
+  return args.This();
 }
 
-void
-MIDIInput::readResultsToJSCallbackArguments(ReceiveIOCB* iocb, Local<Value> argv[])
+// setTempo(bpm, [rampDuration]).  With a ramp duration in ms, the
+// tempo changes linearly from the current tempo, continuing from the
+// current clock phase.
+Handle<Value>
+MIDIClock::setTempo(const Arguments& args)
 {
-  unique_lock<mutex> lock(_mutex);
+  HandleScope scope;
 
-  if (iocb->_error) {
-    argv[2] = Exception::Error(String::New(iocb->_error->message().c_str()));
-  } else {
-    Local<Array> events = Array::New(_sysexQueue.size() + _readQueue.size());
-    int i = 0;
-    // xxx order?
-    while (_sysexQueue.size()) {
-      const SysexMessageBuffer& message = _sysexQueue.front();
-      Local<Array> jsMessage = Array::New(message.data.size() + 1);
-      jsMessage->Set(0, v8::Integer::New(message.timestamp));
-      for (size_t j = 0; j < message.data.size(); j++) {
-        jsMessage->Set(j + 1, v8::Integer::New(message.data[j]));
-      }
-      events->Set(i++, jsMessage);
-      _sysexQueue.pop();
+  if (args.Length() < 1 || !args[0]->IsNumber() || args[0]->NumberValue() <= 0) {
+    return ThrowException(String::New("need positive tempo argument in setTempo"));
+  }
+  double rampDuration = 0;
+  if (args.Length() > 1 && args[1] != Undefined()) {
+    if (!args[1]->IsNumber() || args[1]->NumberValue() < 0) {
+      return ThrowException(String::New("tempo ramp duration must be a non-negative number"));
     }
-    while (_readQueue.size()) {
-      PmMessage message = _readQueue.front().message;
-      Local<Array> jsMessage = Array::New(4);
-      jsMessage->Set(0, v8::Integer::New(_readQueue.front().timestamp));
-      jsMessage->Set(1, v8::Integer::New(Pm_MessageStatus(message)));
-      jsMessage->Set(2, v8::Integer::New(Pm_MessageData1(message)));
-      jsMessage->Set(3, v8::Integer::New(Pm_MessageData2(message)));
-      events->Set(i++, jsMessage);
-      _readQueue.pop();
+    rampDuration = args[1]->NumberValue();
+  }
+
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+
+  Segment& segment = clock->_segment;
+  if (clock->_running) {
+    // Pulses before now or before the last queued pulse keep their
+    // deadlines, the new segment starts in phase at the later of both.
+    const int64_t lastPulseTime = (clock->_pulse > segment.startPulse)
+      ? segment.timeOfPulse(clock->_pulse - 1.0)
+      : segment.startTime;
+    const int64_t now = max(Porttime::microseconds(), lastPulseTime);
+    const double tempo = segment.tempoAt(now);
+    segment.startPulse = segment.pulsesAt(now);
+    segment.startTime = now;
+    segment.startTempo = tempo;
+  } else {
+    segment.startTempo = args[0]->NumberValue();
+    rampDuration = 0;
+  }
+  segment.endTempo = args[0]->NumberValue();
+  segment.rampDuration = rampDuration;
+
+  return Undefined();
+}
+
+// Current tempo in beats per minute
+Handle<Value>
+MIDIClock::tempo(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+  return scope.Close(Number::New(clock->_running
+                                 ? clock->_segment.tempoAt(Porttime::microseconds())
+                                 : clock->_segment.endTempo));
+}
+
+static Handle<Value>
+clockStartTime(const Arguments& args, PmTimestamp& when)
+{
+  when = Porttime::time();
+  if (args.Length() > 0 && args[0] != Undefined()) {
+    if (!args[0]->IsNumber()) {
+      return ThrowException(String::New("clock start time must be a number"));
     }
-    argv[1] = events;
+    when = MIDI::startTimeArgument(args[0]);
   }
+  return Handle<Value>();
 }
 
-int
-MIDIInput::EIO_recv(eio_req* req)
+// start([time]).  Sends Start and starts the clock from the beginning
+// of the song at the given absolute time, or right away.
+Handle<Value>
+MIDIClock::start(const Arguments& args)
 {
-  ReceiveIOCB* iocb = static_cast<ReceiveIOCB*>(req->data);
-  MIDIInput* midiInput = iocb->_midiInput;
+  HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
 
-  while (!midiInput->dataAvailable()) {
-    midiInput->waitForData(iocb);
+  PmTimestamp when;
+  Handle<Value> error = clockStartTime(args, when);
+  if (!error.IsEmpty()) {
+    return error;
   }
 
-  return 0;
+  {
+    unique_lock<mutex> lock(clock->_mutex);
+    if (clock->_running) {
+      return ThrowException(String::New("clock is already running"));
+    }
+    clock->_pulse = 0;
+    clock->startAt(Porttime::expand(when), START);
+  }
+
+  clock->Ref();
+  ev_ref(EV_DEFAULT_UC);
+  Porttime::addClient(clock);
+
+  return Undefined();
 }
 
-int
-MIDIInput::EIO_recvDone(eio_req* req)
+// continue([time]).  Sends Continue and resumes the clock at the
+// current song position.
+Handle<Value>
+MIDIClock::continue_(const Arguments& args)
 {
   HandleScope scope;
-  ReceiveIOCB* iocb = static_cast<ReceiveIOCB*>(req->data);
-  ev_unref(EV_DEFAULT_UC);
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
 
-  Local<Value> argv[3];
-  argv[0] = *iocb->_this;
-  argv[1] = *Undefined();
-  argv[2] = *Undefined();
+  PmTimestamp when;
+  Handle<Value> error = clockStartTime(args, when);
+  if (!error.IsEmpty()) {
+    return error;
+  }
 
-  iocb->_midiInput->readResultsToJSCallbackArguments(iocb, argv);
-  iocb->_midiInput->Unref();
+  {
+    unique_lock<mutex> lock(clock->_mutex);
+    if (clock->_running) {
+      return ThrowException(String::New("clock is already running"));
+    }
+    clock->startAt(Porttime::expand(when), CONTINUE);
+  }
 
-  TryCatch tryCatch;
-  iocb->_callback->Call(Context::GetCurrent()->Global(), 2, argv);
+  clock->Ref();
+  ev_ref(EV_DEFAULT_UC);
+  Porttime::addClient(clock);
 
-  if (tryCatch.HasCaught()) {
-    FatalException(tryCatch);
-  }
+  return Undefined();
+}
+
+// Sends Stop after the pulses that have been queued already.  The song
+// position is kept.
+Handle<Value>
+MIDIClock::stop(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
 
-  iocb->_this.Dispose();
-  iocb->_callback.Dispose();
+  {
+    unique_lock<mutex> lock(clock->_mutex);
+    if (!clock->_running) {
+      return Undefined();
+    }
+    clock->_running = false;
+    clock->send(Porttime::latest(Porttime::time(), clock->_lastSendTime), Pm_Message(STOP, 0, 0));
+  }
 
-  delete iocb;
+  clock->deactivate();
 
-  return 0;
+  return Undefined();
 }
 
+// setSongPosition(sixteenths).  Sends a Song Position Pointer, only
+// allowed while the clock is stopped.
 Handle<Value>
-MIDIInput::recv(const Arguments& args)
+MIDIClock::setSongPosition(const Arguments& args)
 {
   HandleScope scope;
 
-  if (args.Length() != 1
-      || !args[0]->IsFunction()) {
-    return ThrowException(String::New("need one callback function argument in recv"));
+  if (args.Length() != 1 || !args[0]->IsNumber()
+      || args[0]->IntegerValue() < 0 || args[0]->IntegerValue() > 0x3fff) {
+    return ThrowException(String::New("song position must be a number of sixteenth notes from 0 to 16383"));
   }
 
-  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
-  midiInput->Ref();
-
-  eio_custom(EIO_recv,
-             EIO_PRI_DEFAULT,
-             EIO_recvDone,
-             new ReceiveIOCB(midiInput,
-                             Persistent<Object>::New(Local<Object>::Cast(args.This())),
-                             Persistent<Function>::New(Local<Function>::Cast(args[0]))));
-  ev_ref(EV_DEFAULT_UC);
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+  if (clock->_running) {
+    return ThrowException(String::New("cannot set song position while the clock is running"));
+  }
+  const uint32_t sixteenths = args[0]->Uint32Value();
+  clock->_pulse = sixteenths * PULSES_PER_SIXTEENTH;
+  clock->send(Porttime::latest(Porttime::time(), clock->_lastSendTime),
+              Pm_Message(SONG_POSITION_POINTER, sixteenths & 0x7f, sixteenths >> 7));
 
   return Undefined();
 }
 
-void
-MIDIInput::Initialize(Handle<Object> target)
+// Song position of the next pulse in sixteenth notes, fractional
+// between sixteenths
+Handle<Value>
+MIDIClock::songPosition(const Arguments& args)
 {
   HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+  return scope.Close(Number::New((double) clock->_pulse / PULSES_PER_SIXTEENTH));
+}
 
-  Handle<FunctionTemplate> midiInputTemplate = FunctionTemplate::New(New);
-  midiInputTemplate->Inherit(EventEmitter::constructor_template);
-  midiInputTemplate->InstanceTemplate()->SetInternalFieldCount(1);
-
-  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "close", close);
-  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "setFilters", setFilters);
-  NODE_SET_PROTOTYPE_METHOD(midiInputTemplate, "recv", recv);
+Handle<Value>
+MIDIClock::running(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+  return scope.Close(Boolean::New(clock->_running));
+}
 
-  target->Set(String::NewSymbol("MIDIInput"), midiInputTemplate->GetFunction());
+// Returns { count, mean, stddev, min, max } of the difference between
+// the send time and the deadline of the pulses, in ms
+Handle<Value>
+MIDIClock::jitter(const Arguments& args)
+{
+  HandleScope scope;
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+
+  Local<Object> result = Object::New();
+  result->Set(String::NewSymbol("count"), v8::Integer::NewFromUnsigned(clock->_jitterCount));
+  result->Set(String::NewSymbol("mean"), Number::New(clock->_jitterMean));
+  result->Set(String::NewSymbol("stddev"),
+              Number::New(clock->_jitterCount > 1 ? sqrt(clock->_jitterM2 / (clock->_jitterCount - 1)) : 0));
+  result->Set(String::NewSymbol("min"), Number::New(clock->_jitterMin));
+  result->Set(String::NewSymbol("max"), Number::New(clock->_jitterMax));
+  return scope.Close(result);
 }
 
 Handle<Value>
-MIDIInput::close(const Arguments& args)
+MIDIClock::resetJitter(const Arguments& args)
 {
   HandleScope scope;
-  MIDIInput* midiInput = ObjectWrap::Unwrap<MIDIInput>(args.This());
-  midiInput->closePort();
+  MIDIClock* clock = ObjectWrap::Unwrap<MIDIClock>(args.This());
+  unique_lock<mutex> lock(clock->_mutex);
+  clock->_jitterCount = 0;
+  clock->_jitterMean = clock->_jitterM2 = clock->_jitterMin = clock->_jitterMax = 0;
   return Undefined();
 }
 
+void
+MIDIClock::Initialize(Handle<Object> target)
+{
+  HandleScope scope;
+
+  Handle<FunctionTemplate> clockTemplate = FunctionTemplate::New(New);
+  clockTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "setTempo", setTempo);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "tempo", tempo);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "start", start);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "stop", stop);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "continue", continue_);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "setSongPosition", setSongPosition);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "songPosition", songPosition);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "running", running);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "jitter", jitter);
+  NODE_SET_PROTOTYPE_METHOD(clockTemplate, "resetJitter", resetJitter);
+
+  target->Set(String::NewSymbol("MIDIClock"), clockTemplate->GetFunction());
+}
+
 // //////////////////////////////////////////////////////////////////
-// MIDIOutput guts
+// Transform guts
 // //////////////////////////////////////////////////////////////////
 
-mutex MIDIOutput::_lastScheduledSendLock;
-PmTimestamp MIDIOutput::_lastScheduledSend = 0;
+Persistent<FunctionTemplate> Transform::constructorTemplate;
 
-MIDIOutput::MIDIOutput(const char* portName, int32_t latency)
+// Bit mask of the channels given as array of channel numbers in
+// options.channels, all channels by default
+uint16_t
+Transform::channelsOption(Handle<Object> options)
   throw(JSException)
-  : MIDIStream(MIDI::OUTPUT, portName),
-    _latency(latency),
-    _lastSendTime(0)
 {
-  PmError e = Pm_OpenOutput(&_pmMidiStream, 
-                            portId(), 
-                            0,                  // driver info
-                            MIDISTREAM_BUFSIZE, // queue size
-                            0,                  // time proc
-                            0,                  // time info
-                            latency);           // latency
-
-  if (e < 0) {
-    throw PortMidiJSException("could not open MIDI output port", e);
+  Local<Value> channels = options->Get(String::NewSymbol("channels"));
+  if (channels->IsUndefined()) {
+    return 0xffff;
   }
+  if (!channels->IsArray()) {
+    throw JSException("transform channels must be an array of channel numbers");
+  }
+  Local<Array> array = Local<Array>::Cast(channels);
+  uint16_t mask = 0;
+  for (uint32_t i = 0; i < array->Length(); i++) {
+    const int64_t channel = array->Get(i)->IntegerValue();
+    if (channel < 1 || channel > 16) {
+      throw JSException("transform channel numbers must be between 1 and 16");
+    }
+    mask |= 1 << (channel - 1);
+  }
+  return mask;
 }
 
+// Select the keys or controllers in options.keys ([low, high]) or
+// options.controllers (number or array of numbers)
 void
-MIDIOutput::send(const vector<unsigned char>& message, PmTimestamp when)
+Transform::keysOption(Handle<Object> options, transformprogram::operation& op)
   throw(JSException)
 {
-  if (!_pmMidiStream) {
-    throw JSException("cannot send to closed MIDI stream");
+  Local<Value> keys = options->Get(String::NewSymbol("keys"));
+  if (!keys->IsUndefined()) {
+    if (!keys->IsArray() || Local<Array>::Cast(keys)->Length() != 2) {
+      throw JSException("transform keys must be a [low, high] array");
+    }
+    Local<Array> array = Local<Array>::Cast(keys);
+    const int low = array->Get(0)->Int32Value();
+    const int high = array->Get(1)->Int32Value();
+    if (low < 0 || high > 127 || low > high) {
+      throw JSException("invalid transform key range");
+    }
+    for (int key = 0; key < 128; key++) {
+      op.data1[key] = (key >= low && key <= high);
+    }
   }
 
-  if (message.size() < 1) {
-    throw JSException("cannot send message without content");
+  Local<Value> controllers = options->Get(String::NewSymbol("controllers"));
+  if (!controllers->IsUndefined()) {
+    memset(op.data1, 0, sizeof op.data1);
+    Local<Array> array;
+    if (controllers->IsArray()) {
+      array = Local<Array>::Cast(controllers);
+    } else {
+      array = Array::New(1);
+      array->Set(0, controllers);
+    }
+    for (uint32_t i = 0; i < array->Length(); i++) {
+      const int64_t controller = array->Get(i)->IntegerValue();
+      if (!array->Get(i)->IsNumber() || controller < 0 || controller > 127) {
+        throw JSException("transform controller numbers must be between 0 and 127");
+      }
+      op.data1[controller] = 1;
+    }
   }
+}
 
-  if (when) {
-    if (when < Pt_Time()) {
-      throw JSException("message sending time has already passed");
-    }
-    if (_lastSendTime && (when < _lastSendTime)) {
-      throw JSException("message send times must be monotonically increasing for one MIDIOutput object");
+// Fill op.table for values 0 to 127 from options.table (array of 128
+// values), options.gamma or options.scale and options.offset.  Values
+// are rounded and clamped to minimum to 127, 0 stays 0.
+void
+Transform::curveOption(Handle<Object> options, transformprogram::operation& op, int minimum)
+  throw(JSException)
+{
+  Local<Value> table = options->Get(String::NewSymbol("table"));
+  Local<Value> gamma = options->Get(String::NewSymbol("gamma"));
+  Local<Value> scale = options->Get(String::NewSymbol("scale"));
+  Local<Value> offset = options->Get(String::NewSymbol("offset"));
+
+  if (!table->IsUndefined()
+      && (!table->IsArray() || Local<Array>::Cast(table)->Length() != 128)) {
+    throw JSException("transform table must be an array of 128 values");
+  }
+  if ((!gamma->IsUndefined() && (!gamma->IsNumber() || gamma->NumberValue() <= 0))
+      || (!scale->IsUndefined() && !scale->IsNumber())
+      || (!offset->IsUndefined() && !offset->IsNumber())) {
+    throw JSException("invalid transform curve");
+  }
+
+  for (int value = 1; value < 128; value++) {
+    double result = value;
+    if (!table->IsUndefined()) {
+      result = Local<Array>::Cast(table)->Get(value)->NumberValue();
+    } else if (!gamma->IsUndefined()) {
+      result = 127 * pow(value / 127.0, gamma->NumberValue());
+    } else {
+      result = value * (scale->IsUndefined() ? 1 : scale->NumberValue())
+        + (offset->IsUndefined() ? 0 : offset->NumberValue());
     }
-    _lastSendTime = when;
+    result = floor(result + 0.5);
+    op.table[value] = (result != result) ? minimum : (unsigned char) max((double) minimum, min(127.0, result));
+  }
+  op.table[0] = table->IsUndefined() ? 0 : max(0, min(127, Local<Array>::Cast(table)->Get(0)->Int32Value()));
+}
 
-    // Reference the default evlib queue so that the node process does
-    // not exit until the last message has been sent.  See also
-    // MIDIOutput::checkScheduledSends()
-    unique_lock<mutex> lock(_lastScheduledSendLock);
-    if ((when + _latency) > _lastScheduledSend) {
-      if (_lastScheduledSend == 0) {
-        ev_ref(EV_DEFAULT_UC);
+// Operations are objects with an op property:
+//
+// { op: 'filter', types, channels }: keep only the messages of the
+// given types and, for channel messages, on the given channels
+// { op: 'transpose', semitones, channels, keys }: notes transposed out
+// of range are dropped
+// { op: 'channel', channel, channels }: move channel messages
+// { op: 'velocity', table | gamma | scale & offset, channels, keys }:
+// note on velocity curve
+// { op: 'controller', controllers, table | gamma | scale & offset, channels }:
+// controller value curve
+void
+Transform::compile(Handle<Object> options)
+  throw(JSException)
+{
+  const string name = *String::Utf8Value(options->Get(String::NewSymbol("op")));
+  const uint16_t channels = channelsOption(options);
+
+  if (name == "filter") {
+    uint32_t types = ~0u;
+    Local<Value> typeNames = options->Get(String::NewSymbol("types"));
+    if (!typeNames->IsUndefined()) {
+      if (!typeNames->IsArray()) {
+        throw JSException("transform types must be an array of message type names");
+      }
+      Local<Array> array = Local<Array>::Cast(typeNames);
+      types = 0;
+      for (uint32_t i = 0; i < array->Length(); i++) {
+        const MIDI::MessageType type = MIDI::messageType(*String::Utf8Value(array->Get(i)));
+        if (type == MIDI::UNDEFINED_MESSAGE || type >= MIDI::NRPN7) {
+          throw JSException(string("cannot filter message type ") + *String::Utf8Value(array->Get(i)));
+        }
+        types |= 1u << type;
       }
-      _lastScheduledSend = when + _latency;
     }
+    transformprogram::operation op = transformprogram::identity();
+    op.filter = true;
+    for (int status = 0x80; status < 0x100; status++) {
+      const MIDI::MessageType type = MIDI::messageType(status);
+      op.statuses[status] = (type != MIDI::UNDEFINED_MESSAGE
+                             && (types & (1u << type))
+                             && (status >= 0xf0 || (channels & (1 << (status & 0x0f)))));
+    }
+    _program.add(op);
+    return;
   }
 
-  unsigned int statusByte = message[0];
+  transformprogram::operation op = transformprogram::identity();
+  memset(op.statuses, 0, sizeof op.statuses);
 
-  if (statusByte == 0xf0) {
-
-    // send sysex message
-    int count = message.size();
-    if (message[count - 1] != 0xf7) {
-      throw JSException("sysex message must be terminated by 0xf7");
+  if (name == "transpose") {
+    Local<Value> semitones = options->Get(String::NewSymbol("semitones"));
+    if (!semitones->IsNumber()) {
+      throw JSException("need semitones in transpose operation");
     }
-    unsigned char buf[count];
-    for (int i = 0; i < count; i++) {
-      buf[i] = message[i];
+    const int delta = semitones->Int32Value();
+    for (int key = 0; key < 128; key++) {
+      const int result = key + delta;
+      op.table[key] = (result < 0 || result > 127) ? (int) transformprogram::DROP : result;
     }
-    PmError e = Pm_WriteSysEx(_pmMidiStream, when, buf);
-    if (e < 0) {
-      throw PortMidiJSException("could not send MIDI sysex message", e);
+    for (int channel = 0; channel < 16; channel++) {
+      if (channels & (1 << channel)) {
+        op.statuses[MIDI::NOTE_OFF_STATUS | channel] = 1;
+        op.statuses[MIDI::NOTE_ON_STATUS | channel] = 1;
+        op.statuses[0xa0 | channel] = 1;
+      }
     }
-
-  } else {
-    unsigned char arg1 = 0;
-    unsigned char arg2 = 0;
-    switch (message.size()) {
-    case 3:
-      arg2 = message[2];
-    case 2:
-      arg1 = message[1];
-    case 1:
-      break;
-    default:
-      throw JSException("unexpected message length");
+    keysOption(options, op);
+  } else if (name == "channel") {
+    Local<Value> channel = options->Get(String::NewSymbol("channel"));
+    if (!channel->IsNumber() || channel->IntegerValue() < 1 || channel->IntegerValue() > 16) {
+      throw JSException("need channel between 1 and 16 in channel operation");
     }
-    PmError e = Pm_WriteShort(_pmMidiStream, when, Pm_Message(statusByte, message[1], message[2]));
-
-    if (e < 0) {
-      throw PortMidiJSException("could not send MIDI message", e);
+    op.target = transformprogram::STATUS;
+    for (int status = 0x80; status < 0xf0; status++) {
+      op.statuses[status] = (channels >> (status & 0x0f)) & 1;
+      op.table[status] = (status & 0xf0) | (channel->Int32Value() - 1);
+    }
+  } else if (name == "velocity") {
+    op.target = transformprogram::DATA2;
+    for (int channel = 0; channel < 16; channel++) {
+      op.statuses[MIDI::NOTE_ON_STATUS | channel] = (channels >> channel) & 1;
+    }
+    keysOption(options, op);
+    // A note on with velocity 0 is a note off and stays one, other
+    // velocities are not mapped to 0
+    curveOption(options, op, 1);
+    op.table[0] = 0;
+  } else if (name == "controller") {
+    op.target = transformprogram::DATA2;
+    for (int channel = 0; channel < 16; channel++) {
+      op.statuses[0xb0 | channel] = (channels >> channel) & 1;
     }
+    keysOption(options, op);
+    curveOption(options, op, 0);
+  } else {
+    throw JSException("unknown transform operation " + name);
   }
-}
 
-void
-MIDIOutput::checkScheduledSends(PmTimestamp timestamp)
-{
-  unique_lock<mutex> lock(_lastScheduledSendLock);
-  if (_lastScheduledSend && (timestamp > _lastScheduledSend)) {
-    ev_unref(EV_DEFAULT_UC);
-    _lastScheduledSend = 0;
-  }
+  _program.add(op);
 }
 
-// v8 interface
-
+// Transform(operations).  operations is an array of operation
+// objects, see compile().
 Handle<Value>
-MIDIOutput::New(const Arguments& args)
+Transform::New(const Arguments& args)
 {
   if (!args.IsConstructCall()) {
-    return ThrowException(String::New("MIDIOutput function can only be used as a constructor"));
+    return ThrowException(String::New("Transform function can only be used as a constructor"));
   }
   HandleScope scope;
 
+  if (args.Length() != 1 || !args[0]->IsArray()) {
+    return ThrowException(String::New("need array of operations argument in Transform constructor"));
+  }
+
+  Transform* transform = new Transform();
   try {
-    int32_t latency = 0;
-    if (args.Length() > 1) {
-      latency = args[1]->Int32Value();
+    Local<Array> operations = Local<Array>::Cast(args[0]);
+    for (uint32_t i = 0; i < operations->Length(); i++) {
+      if (!operations->Get(i)->IsObject()) {
+        throw JSException("transform operations must be objects");
+      }
+      transform->compile(operations->Get(i)->ToObject());
     }
-
-    MIDIOutput* midiOutput = new MIDIOutput((args[0] != Undefined()) ? *String::Utf8Value(args[0]) : 0,
-                                            latency);
-    midiOutput->Wrap(args.This());
-    args.This()->Set(String::New("portName"), String::New(midiOutput->portName().c_str()), ReadOnly);
-
-    return args.This();
   }
   catch (const JSException& e) {
+    delete transform;
     return e.asV8Exception();
   }
+
+  transform->Wrap(args.This());
+  return args.This();
 }
 
+// MIDI.transform(buffer, transform, [count]).  Applies the transform
+// in place to the first count packed event records in buffer, which
+// default to all records.  Returns the number of records left at the
+// start of the buffer.
 Handle<Value>
-MIDIOutput::send(const Arguments& args)
+Transform::transform(const Arguments& args)
 {
   HandleScope scope;
-  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
-  PmTimestamp when = 0;
 
   try {
-    if (args.Length() < 1) {
-      throw JSException("missing argument to MIDIOut::send");
+    if (args.Length() < 2 || !Buffer::HasInstance(args[0])
+        || !args[1]->IsObject() || !constructorTemplate->HasInstance(args[1])) {
+      throw JSException("need Buffer and Transform arguments in MIDI.transform");
     }
 
-    if (args.Length() > 1) {
-      if (!midiOutput->latency() && (args[1] != Undefined())) {
-        throw JSException("can't delay message sending on MIDI output stream opened with zero latency");
-      }
+    Local<Object> buffer = args[0]->ToObject();
+    unsigned char* data = reinterpret_cast<unsigned char*>(Buffer::Data(buffer));
+    const size_t length = Buffer::Length(buffer);
 
-      if (args[1] != Undefined()) {
-        when = args[1]->Int32Value();
+    size_t count = length / MIDI::PACKED_EVENT_SIZE;
+    if (args.Length() > 2 && args[2] != Undefined()) {
+      if (!args[2]->IsNumber() || args[2]->IntegerValue() < 0
+          || (size_t) args[2]->IntegerValue() > count) {
+        throw JSException("invalid event count in MIDI.transform");
       }
-    }
-
-    vector<unsigned char> message;
-    if (args[0]->IsString()) {
-      string messageString = *String::Utf8Value(args[0]);
-      istringstream is(messageString);
-      while (!is.eof()) {
-        unsigned byte;
-        is >> hex >> byte;
-        if (is.fail()) {
-          throw JSException("error decoding hex byte in sysex message");
+      count = args[2]->IntegerValue();
+    } else {
+      // The bytes of sysex messages follow the records, which end at
+      // the lowest sysex offset
+      size_t end = length;
+      for (size_t offset = 0; offset + MIDI::PACKED_EVENT_SIZE <= end; offset += MIDI::PACKED_EVENT_SIZE) {
+        if (data[offset + MIDI::PACKED_STATUS] == MIDI::SYSEX_START) {
+          end = min(end, (size_t) MIDI::unpackUint32(data + offset + MIDI::PACKED_SYSEX_OFFSET));
         }
-        message.push_back(byte);
       }
-    } else if (args[0]->IsArray()) {
-      Local<Array> messageArray = Local<Array>::Cast(args[0]);
-      for (unsigned i = 0; i < messageArray->Length(); i++) {
-        if (!messageArray->Get(i)->IsNumber()) {
-          throw JSException("unexpected array element in array to send, expecting only integers");
-        }
-        message.push_back(messageArray->Get(i)->Int32Value());
+      if (end % MIDI::PACKED_EVENT_SIZE) {
+        throw JSException("packed records do not end at a multiple of the event record size");
       }
-    } else {
-      throw JSException("unexpected type for MIDI message argument");
+      count = end / MIDI::PACKED_EVENT_SIZE;
     }
 
-    midiOutput->send(message, when);
-
-    return Undefined();
+    Transform* transform = ObjectWrap::Unwrap<Transform>(args[1]->ToObject());
+    const size_t kept = transform->_program.run(data, count, MIDI::PACKED_EVENT_SIZE, MIDI::PACKED_STATUS);
+    return scope.Close(Number::New(kept));
   }
   catch (const JSException& e) {
     return e.asV8Exception();
   }
 }
 
-Handle<Value>
-MIDIOutput::close(const Arguments& args)
+void
+Transform::Initialize(Handle<Object> target)
 {
   HandleScope scope;
-  MIDIOutput* midiOutput = ObjectWrap::Unwrap<MIDIOutput>(args.This());
-  midiOutput->closePort();
-  return Undefined();
+
+  Handle<FunctionTemplate> transformTemplate = FunctionTemplate::New(New);
+  transformTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+  constructorTemplate = Persistent<FunctionTemplate>::New(transformTemplate);
+
+  target->Set(String::NewSymbol("Transform"), transformTemplate->GetFunction());
+  target->Set(String::NewSymbol("transform"), FunctionTemplate::New(transform)->GetFunction());
 }
 
+// //////////////////////////////////////////////////////////////////
+// Porttime guts
+// //////////////////////////////////////////////////////////////////
+
 void
-MIDIOutput::Initialize(Handle<Object> target)
+Porttime::start()
+  throw(JSException)
 {
-  HandleScope scope;
-
-  Handle<FunctionTemplate> midiOutputTemplate = FunctionTemplate::New(New);
-  midiOutputTemplate->InstanceTemplate()->SetInternalFieldCount(1);
+  unique_lock<mutex> lock(_mutex);
 
-  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "close", close);
-  NODE_SET_PROTOTYPE_METHOD(midiOutputTemplate, "send", send);
+  if (!_running) {
+    _epoch = monotonicNanoseconds();
+    _stopping = false;
+    if (pthread_create(&_thread, 0, timerThread, 0)) {
+      throw JSException("could not start MIDI timer thread");
+    }
+    _running = true;
+  }
+}
 
-  target->Set(String::NewSymbol("MIDIOutput"), midiOutputTemplate->GetFunction());
+void
+Porttime::stop()
+{
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (!_running) {
+      return;
+    }
+    _stopping = true;
+    _condition.notify_one();
+  }
+  pthread_join(_thread, 0);
+  _running = false;
 }
 
-// //////////////////////////////////////////////////////////////////
-// Initialization interface
-// //////////////////////////////////////////////////////////////////
+void
+Porttime::schedule(PmTimestamp when)
+{
+  unique_lock<mutex> lock(_mutex);
+  if (!_wakeRequested || before(when, _wakeTime)) {
+    _wakeRequested = true;
+    _wakeTime = when;
+  }
+  if (_sleeping && before(when, _deadline)) {
+    _condition.notify_one();
+  }
+}
 
+void
+Porttime::setPriority(int priority)
+  throw(JSException)
+{
+  if (!_running) {
+    throw JSException("MIDI timer thread is not running");
+  }
+  struct sched_param parameters;
+  memset(&parameters, 0, sizeof parameters);
+  int policy = SCHED_OTHER;
+  if (priority > 0) {
+    if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO)) {
+      throw JSException("timer thread priority out of range");
+    }
+    policy = SCHED_FIFO;
+    parameters.sched_priority = priority;
+  }
+  const int rc = pthread_setschedparam(_thread, policy, &parameters);
+  if (rc) {
+    throw JSException(string("could not set timer thread priority: ") + strerror(rc));
+  }
+}
 
 void
-Porttime::pollAll(PtTimestamp timestamp, void* userData)
+Porttime::setAffinity(const vector<int>& cpus)
+  throw(JSException)
+{
+  if (!_running) {
+    throw JSException("MIDI timer thread is not running");
+  }
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (size_t i = 0; i < cpus.size(); i++) {
+    if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+      throw JSException("invalid CPU number");
+    }
+    CPU_SET(cpus[i], &set);
+  }
+  if (cpus.empty()) {
+    // All CPUs
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  const int rc = pthread_setaffinity_np(_thread, sizeof set, &set);
+  if (rc) {
+    throw JSException(string("could not set timer thread affinity: ") + strerror(rc));
+  }
+#else
+  throw JSException("timer thread affinity is not supported on this platform");
+#endif
+}
+
+int64_t
+Porttime::monotonicNanoseconds()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int64_t
+Porttime::expand(PmTimestamp time)
+{
+  const int64_t now = microseconds() / 1000;
+  return (now + (int32_t) ((uint32_t) time - (uint32_t) now)) * 1000;
+}
+
+// One pass of the timer thread, returns true if it needs to run again
+// in the next millisecond
+bool
+Porttime::pollAll(int64_t microseconds)
 {
-  MIDIInput::pollAll();
+  const PmTimestamp timestamp = truncate(microseconds);
+  bool periodic = MIDIInput::pollAll();
+  periodic |= tickClients(microseconds);
+  MIDIOutput::releaseAll(timestamp);
   MIDIOutput::checkScheduledSends(timestamp);
   MIDI::runTimedCallbacks(timestamp);
+  return periodic;
+}
+
+PmTimestamp
+Porttime::nextDeadline(PmTimestamp now, bool periodic)
+{
+  PmTimestamp next = now + (periodic ? 1 : MAXIMUM_SLEEP);
+  MIDIOutput::nextDue(next);
+  MIDI::nextTimedCallback(next);
+  // Everything up to now has been done
+  return before(now, next) ? next : now + 1;
+}
+
+void*
+Porttime::timerThread(void* arg)
+{
+  MIDI::trace.name("timer");
+
+  PmTimestamp deadline = 0;
+  bool timedOut = false;
+
+  while (true) {
+    const int64_t woken = monotonicNanoseconds();
+    uint32_t late = 0;
+    if (timedOut) {
+      late = (uint32_t) (max((int64_t) 0, woken - nanosecondsAt(deadline)) / 1000);
+      jitter.record(late);
+    }
+    const int64_t wokenMicroseconds = (woken - _epoch) / 1000;
+
+    __sync_fetch_and_add(&passes, 1);
+    deadline = nextDeadline(truncate(wokenMicroseconds), pollAll(wokenMicroseconds));
+
+    const int64_t finished = monotonicNanoseconds();
+    MIDI::trace.complete(MIDI::TRACE_TIMER_PASS, wokenMicroseconds, (finished - _epoch) / 1000, late);
+    if (finished > nanosecondsAt(deadline)) {
+      overruns.record((uint32_t) ((finished - nanosecondsAt(deadline)) / 1000));
+    }
+
+    unique_lock<mutex> lock(_mutex);
+    timedOut = false;
+    _sleeping = true;
+    _deadline = deadline;
+    while (!_stopping) {
+      if (_wakeRequested && before(_wakeTime, _deadline)) {
+        // Something was scheduled earlier than the deadline
+        _wakeRequested = false;
+        if (!before(time(), _wakeTime)) {
+          __sync_fetch_and_add(&earlyWakeups, 1);
+          break;
+        }
+        _deadline = deadline = _wakeTime;
+      }
+      _wakeRequested = false;
+      const int64_t nanoseconds = nanosecondsAt(deadline);
+      if (nanoseconds <= monotonicNanoseconds()) {
+        // Overrun, run the next pass right away
+        break;
+      }
+      struct timespec until;
+      until.tv_sec = nanoseconds / 1000000000;
+      until.tv_nsec = nanoseconds % 1000000000;
+      if (!_condition.wait_until(lock, until)) {
+        timedOut = true;
+        break;
+      }
+    }
+    _sleeping = false;
+    if (_stopping) {
+      break;
+    }
+  }
+
+  return 0;
 }
 
+// //////////////////////////////////////////////////////////////////
+// Initialization interface
+// //////////////////////////////////////////////////////////////////
+
+
 extern "C" {
   
   static void init (Handle<Object> target)
   {
-    Porttime::start();
+    try {
+      Porttime::start();
+    }
+    catch (const JSException& e) {
+      e.asV8Exception();
+      return;
+    }
 
     Pm_Initialize();
     HandleScope handleScope;
+
+    try {
+      VirtualPort::createFromEnvironment();
+    }
+    catch (const JSException& e) {
+      e.asV8Exception();
+      return;
+    }
     
     MIDI::Initialize(target);
     atexit(Porttime::stop);
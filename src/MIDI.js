@@ -115,11 +115,12 @@ for (var messageType in midiMessageDefs) {
 // Define functions for those message types that require more argument
 // processing than the autogenerated convenience function can provide.
 
+// Strings are decoded by the native send() function, Buffers and byte
+// arrays are passed to portmidi without copying.
 MIDI.MIDIOutput.prototype.sysex = function (data, time) {
-    if (typeof data == 'string') {
-        data = _.map(data.split(/ +/), function (string) { return parseInt(string, 16); });
-    }
-    if (data[0] != 0xf0 || data[data.length - 1] != 0xf7) {
+    if ((typeof data == 'string')
+        ? !/^\s*(0x)?f0\s(.*\s)?(0x)?f7\s*$/i.test(data)
+        : (data[0] != 0xf0 || data[data.length - 1] != 0xf7)) {
         throw "invalid sysex message, must start with 0xf0 and end with 0xf7";
     }
     this.send(data, time);
@@ -227,211 +228,247 @@ MIDI.MIDIInput.prototype.recvText = function(callback) {
     this.recv(function (midiInput, data) {
         var stringData = [];
         for (var i in data) {
-            stringData.push(messageToString(data[i]));
+            var message = data[i];
+            if (message[1] == 0xf0) {
+                // sysex message bytes are passed as Buffer
+                stringData.push(message[0].toString(16) + ' ' + messageToString(message[2]));
+            } else {
+                stringData.push(messageToString(message));
+            }
         }
         callback(midiInput, stringData);
     });
 }
 
-// This function is called from the low-level library interface to
-// translate received MIDI messages into events that are delivered to
-// the application.
-function generateEvents(midiInput, messages, error)
-{
-    if (error) {
-        midiInput.emit('error', error);
-        return;
-    }
-    for (var i in messages) {
-        var message = messages[i];
-        if (message.length < 2) {
-            console.log('short message ignored, message:', message);
-            continue;
-        }
-        var time = message[0];
-        var status = message[1];
-        var arg1 = message[2];
-        var arg2 = message[3];
-        var channel = (status & 0x0f) + 1;
-        switch (status & 0xf0) {
-        case 0x80:
-            midiInput.emit('noteOff', arg1, arg2, channel, time);
-            break;
-        case 0x90:
-            midiInput.emit('noteOn',  arg1, arg2, channel, time);
-            break;
-        case 0xA0:
-            midiInput.emit('polyphonicKeyPressure',  arg1, arg2, channel, time);
-            break;
-        case 0xB0:
-            midiInput.emit('controlChange',  arg1, arg2, channel, time);
-            break;
-        case 0xC0:
-            midiInput.emit('programChange', arg1, channel, time);
-            break;
-        case 0xD0:
-            midiInput.emit('channelPressure', arg1, channel, time);
-            break;
-        case 0xE0:
-            value = 0x2000 - ((arg2 << 7) | arg1);
-            midiInput.emit('pitchWheelChange',  value, channel, time);
-            break;
-        case 0xF0:
-            switch (status & 0x0f) {
-            // system common messages
-            case 0x00:
-                midiInput.emit('sysex', message.slice(1), time);
-                break;
-            case 0x01:
-                midiInput.emit('midiTimeCode', arg1, time);
-                break;
-            case 0x02:
-                midiInput.emit('songPositionPointer', arg1, arg2, time);
-                break;
-            case 0x03:
-                midiInput.emit('songSelect', arg1, time);
-                break;
-            case 0x04:
-            case 0x05:
-                console.log("unexpected MIDI message code 0x" + status.toString(16));
-                break;
-            case 0x06:
-                midiInput.emit('tuneRequest', time);
-                break;
-            case 0x07:
-                console.log("unexpected end of sysex byte at the beginning of a message");
-                break;
-            // system real time messages
-            case 0x08:
-                midiInput.emit('timingClock', time);
-                break;
-            case 0x09:
-                midiInput.emit('tick', time);
-                break;
-            case 0x0A:
-                midiInput.emit('start', time);
-                break;
-            case 0x0B:
-                midiInput.emit('continue', time);
-                break;
-            case 0x0C:
-                midiInput.emit('stop', time);
-                break;
-            case 0x0D:
-                console.log("unexpected system real time message 0x" + status.toString(16));
-                break;
-            case 0x0E:
-                midiInput.emit('activeSensing', time);
-                break;
-            case 0x0F:
-                midiInput.emit('reset', time);
-            }
-            break;
-        default:
-            console.log("illegal MIDI message status code 0x" + status.toString(16));
-        }
-    }
-            
-    midiInput.recv(arguments.callee);
+// Accessors for the packed message batches that are delivered by
+// MIDIInput objects in packed mode (see MIDIInput.setPacked()).  Each
+// message is represented by a fixed size record, the bytes of sysex
+// messages are stored after the records.
+
+var PACKED_EVENT_SIZE = 16;
+
+function packedUint32(buffer, offset) {
+    return buffer[offset]
+        | (buffer[offset + 1] << 8)
+        | (buffer[offset + 2] << 16)
+        | (buffer[offset + 3] * 0x1000000);
 }
 
-function NRPN(is14Bit) {
-    this.is14Bit = is14Bit;
-    this.parameterMsb = 0;
-    this.parameterLsb = 0;
-    this.valueMsb = 0;
-    this.valueLsb = 0;
+function packedEventTime(buffer, index) {
+    return packedUint32(buffer, index * PACKED_EVENT_SIZE);
 }
 
-NRPN.prototype.parameter = function () {
-    return this.parameterMsb << 7 | this.parameterLsb;
+function packedEventStatus(buffer, index) {
+    return buffer[index * PACKED_EVENT_SIZE + 4];
 }
 
-NRPN.prototype.value = function () {
-    if (this.is14Bit) {
-        return this.valueMsb << 7 | this.valueLsb;
-    } else {
-        return this.valueMsb;
-    }
+function packedEventData1(buffer, index) {
+    return buffer[index * PACKED_EVENT_SIZE + 5];
+}
+
+function packedEventData2(buffer, index) {
+    return buffer[index * PACKED_EVENT_SIZE + 6];
+}
+
+// Returns the bytes of a sysex message, including the 0xf0 and 0xf7
+// delimiters, as a slice of the batch buffer.
+function packedEventSysex(buffer, index) {
+    var offset = packedUint32(buffer, index * PACKED_EVENT_SIZE + 8);
+    var length = packedUint32(buffer, index * PACKED_EVENT_SIZE + 12);
+    return buffer.slice(offset, offset + length);
+}
+
+exports.PACKED_EVENT_SIZE = PACKED_EVENT_SIZE;
+exports.packedEventTime = packedEventTime;
+exports.packedEventStatus = packedEventStatus;
+exports.packedEventData1 = packedEventData1;
+exports.packedEventData2 = packedEventData2;
+exports.packedEventSysex = packedEventSysex;
+
+// Pack messages into a Buffer of event records as expected by
+// MIDIOutput.sendBatch().  Each message is an array [ time, status,
+// data1, data2 ] or, for sysex messages, [ time, 0xf0, bytes ], with
+// bytes being an array or a Buffer that includes the 0xf0 and 0xf7
+// delimiters.  Use a time of 0 to send immediately.
+
+function packedSetUint32(buffer, offset, value) {
+    buffer[offset] = value & 0xff;
+    buffer[offset + 1] = (value >> 8) & 0xff;
+    buffer[offset + 2] = (value >> 16) & 0xff;
+    buffer[offset + 3] = (value >>> 24) & 0xff;
 }
 
-NRPN.prototype.increment = function (delta) {
-    if (this.is14Bit) {
-        var value = this.value() + delta;
-        if (value < 0) {
-            value = 0;
-        } else if (value > 0x3fff) {
-            value = 0x3fff;
+function packEvents(messages) {
+    var sysexBytes = 0;
+    for (var i = 0; i < messages.length; i++) {
+        if (messages[i][1] == 0xf0) {
+            sysexBytes += messages[i][2].length;
         }
-        this.valueLsb = value & 0x7f;
-        this.valueMsb = (value >> 7);
-    } else {
-        this.valueMsb += delta;
-        if (this.valueMsb < 0) {
-            this.valueMsb = 0;
-        } else if (this.valueMsb > 0x7f) {
-            this.valueMsb = 0x7f;
+    }
+    var buffer = new Buffer(messages.length * PACKED_EVENT_SIZE + sysexBytes);
+    var sysexOffset = messages.length * PACKED_EVENT_SIZE;
+    for (var i = 0; i < messages.length; i++) {
+        var message = messages[i];
+        var record = i * PACKED_EVENT_SIZE;
+        packedSetUint32(buffer, record, message[0] || 0);
+        buffer[record + 4] = message[1];
+        buffer[record + 7] = 0;
+        if (message[1] == 0xf0) {
+            var sysex = message[2];
+            buffer[record + 5] = buffer[record + 6] = 0;
+            packedSetUint32(buffer, record + 8, sysexOffset);
+            packedSetUint32(buffer, record + 12, sysex.length);
+            for (var j = 0; j < sysex.length; j++) {
+                buffer[sysexOffset++] = sysex[j];
+            }
+        } else {
+            buffer[record + 5] = message[2] || 0;
+            buffer[record + 6] = message[3] || 0;
+            packedSetUint32(buffer, record + 8, 0);
+            packedSetUint32(buffer, record + 12, 0);
         }
     }
+    return buffer;
 }
 
-NRPN.prototype.clearValue = function () {
-    this.valueMsb = 0;
-    this.valueLsb = 0;
-}
+exports.packEvents = packEvents;
 
-NRPN.prototype.clear = function () {
-    this.parameterMsb = 0;
-    this.parameterLsb = 0;
-    this.clearValue();
+// Send an array of messages, as accepted by packEvents(), in one batch
+MIDI.MIDIOutput.prototype.sendMessages = function (messages) {
+    this.sendBatch(packEvents(messages), messages.length);
 }
 
-function processNrpn(controllerNumber, value, channel, time) {
-    // console.log('controllerNumber', controllerNumber.toString(16), 'value', value, 'channel', channel, 'nrpn', this.nrpn);
-    var nrpn = this.nrpn;
-    switch (controllerNumber) {
-    case 0x63:
-        nrpn.parameterMsb = value;
-        nrpn.clearValue();
+// Emit the event corresponding to one received MIDI message.  sysex
+// is only used for sysex messages and contains the complete message.
+function emitMessage(midiInput, time, status, arg1, arg2, sysex)
+{
+    var channel = (status & 0x0f) + 1;
+    switch (status & 0xf0) {
+    case 0x80:
+        midiInput.emit('noteOff', arg1, arg2, channel, time);
         break;
-    case 0x62:
-        nrpn.parameterLsb = value;
-        if (nrpn.parameter() == 0x3fff) {
-            this.nrpn.clear();
-        } else {
-            nrpn.clearValue();
-        }
+    case 0x90:
+        midiInput.emit('noteOn',  arg1, arg2, channel, time);
         break;
-    case 0x06:
-        nrpn.valueMsb = value;
-        if (!nrpn.is14Bit) {
-            this.emit('nrpn7', nrpn.parameter(), nrpn.value(), channel, time);
-        }
+    case 0xA0:
+        midiInput.emit('polyphonicKeyPressure',  arg1, arg2, channel, time);
         break;
-    case 0x26:
-        nrpn.valueLsb = value;
-        // If LSB value is received in 7 bit mode, it is just ignored.
-        if (nrpn.is14Bit) {
-            this.emit('nrpn14', nrpn.parameter(), nrpn.value(), channel, time);
-        }
+    case 0xB0:
+        midiInput.emit('controlChange',  arg1, arg2, channel, time);
+        break;
+    case 0xC0:
+        midiInput.emit('programChange', arg1, channel, time);
+        break;
+    case 0xD0:
+        midiInput.emit('channelPressure', arg1, channel, time);
         break;
-    case 0x60:
-        nrpn.increment(value);
-        this.emit('nrpn14', nrpn.parameter(), nrpn.value(), channel, time);
+    case 0xE0:
+        var value = 0x2000 - ((arg2 << 7) | arg1);
+        midiInput.emit('pitchWheelChange',  value, channel, time);
         break;
-    case 0x61:
-        nrpn.increment(-value);
-        this.emit('nrpn14', nrpn.parameter(), nrpn.value(), channel, time);
+    case 0xF0:
+        switch (status & 0x0f) {
+        // system common messages
+        case 0x00:
+            midiInput.emit('sysex', sysex, time);
+            break;
+        case 0x01:
+            midiInput.emit('midiTimeCode', arg1, time);
+            break;
+        case 0x02:
+            midiInput.emit('songPositionPointer', arg1, arg2, time);
+            break;
+        case 0x03:
+            midiInput.emit('songSelect', arg1, time);
+            break;
+        case 0x04:
+        case 0x05:
+            console.log("unexpected MIDI message code 0x" + status.toString(16));
+            break;
+        case 0x06:
+            midiInput.emit('tuneRequest', time);
+            break;
+        case 0x07:
+            console.log("unexpected end of sysex byte at the beginning of a message");
+            break;
+        // system real time messages
+        case 0x08:
+            midiInput.emit('timingClock', time);
+            break;
+        case 0x09:
+            midiInput.emit('tick', time);
+            break;
+        case 0x0A:
+            midiInput.emit('start', time);
+            break;
+        case 0x0B:
+            midiInput.emit('continue', time);
+            break;
+        case 0x0C:
+            midiInput.emit('stop', time);
+            break;
+        case 0x0D:
+            console.log("unexpected system real time message 0x" + status.toString(16));
+            break;
+        case 0x0E:
+            midiInput.emit('activeSensing', time);
+            break;
+        case 0x0F:
+            midiInput.emit('reset', time);
+        }
         break;
+    default:
+        console.log("illegal MIDI message status code 0x" + status.toString(16));
+    }
+}
+
+// This function can be passed to MIDIInput.recv() to translate
+// received MIDI messages into events in JavaScript rather than having
+// the native library emit them (see MIDIInput.listen()).  In packed
+// mode, messages is a Buffer holding count packed message records.
+function generateEvents(midiInput, messages, error, count)
+{
+    if (error) {
+        midiInput.emit('error', error);
+    }
+    if (Buffer.isBuffer(messages)) {
+        for (var i = 0; i < count; i++) {
+            var status = packedEventStatus(messages, i);
+            emitMessage(midiInput,
+                        packedEventTime(messages, i),
+                        status,
+                        packedEventData1(messages, i),
+                        packedEventData2(messages, i),
+                        (status == 0xf0) ? packedEventSysex(messages, i) : undefined);
+        }
+    } else {
+        for (var i in messages) {
+            var message = messages[i];
+            if (message.length < 2) {
+                console.log('short message ignored, message:', message);
+                continue;
+            }
+            emitMessage(midiInput, message[0], message[1], message[2], message[3],
+                        (message[1] == 0xf0) ? message[2] : undefined);
+        }
     }
+            
+    midiInput.recv(arguments.callee);
 }
 
+exports.generateEvents = generateEvents;
+
+// Events for parameter changes that are decoded from control change
+// messages by the native library.
+var parameterEvents = { nrpn7: true, nrpn14: true, rpn: true, cc14: true };
+
 MIDI.MIDIInput.prototype.init = function()
 {
     if (!this.listening) {
         this.listening = true;
 
         this.currentFilter = 0x7fffffff;
+        this.channelMask = 0xffff;
 
         (function (midiInput) {
             midiInput.on('newListener', function (type, listener) {
@@ -440,20 +477,20 @@ MIDI.MIDIInput.prototype.init = function()
                     // ... reset the filter bit corresponding to the event type in the MIDI listener
                     midiInput.currentFilter &= ~midiMessageDefs[type].filterBit;
                     midiInput.setFilters(midiInput.channelMask, midiInput.currentFilter);
+                    // ... and have the native library emit events of that type
+                    midiInput.subscribe(type);
                 }
-                // If listener is interested in the nrpn event, enable nrpn processing
-                if ((type == 'nrpn14' || type == 'nrpn7')) {
-                    var is14bit = (type == 'nrpn14');
-                    if (midiInput.nrpn && (midiInput.nrpn.is14bit != is14bit)) {
-                        throw "cannot listen to 7 and 14 bit nrpn control changes at the same time";
-                    }
-                    midiInput.nrpn = new NRPN(is14bit);
-                    midiInput.on('controlChange', _.bind(processNrpn, midiInput));
+                // If listener is interested in a parameter change event,
+                // let control changes pass and have the native library decode them
+                if (parameterEvents[type]) {
+                    midiInput.currentFilter &= ~midiMessageDefs.controlChange.filterBit;
+                    midiInput.setFilters(midiInput.channelMask, midiInput.currentFilter);
+                    midiInput.subscribe(type);
                 }
             });
         })(this);
 
-        this.recv(generateEvents);
+        this.listen();
     }
 
     this.channels(0);
@@ -494,10 +531,40 @@ MIDI.MIDIInput.prototype.channels = function(argument)
     return retval;
 }
 
+// Messages that the native library absorbs when following clock
+var clockEvents = [ 'timingClock', 'start', 'stop', 'continue', 'songPositionPointer' ];
+
+// Follow the MIDI clock received.  The tempo and beat position are
+// estimated natively, timing clock messages are no longer delivered.
+// A 'tempo' event is emitted when the tempo changes.  Options are
+// window, the number of clock pulses to average over, and threshold,
+// the tempo change in BPM that is reported.
+MIDI.MIDIInput.prototype.followClock = function(enable, options)
+{
+    options = options || {};
+    if (enable === undefined) {
+        enable = true;
+    }
+    if (enable) {
+        _.each(clockEvents, function (type) {
+            this.currentFilter &= ~midiMessageDefs[type].filterBit;
+        }, this);
+        this.setFilters(this.channelMask, this.currentFilter);
+    } else if (!this.listeners('timingClock').length) {
+        // Do not flood JavaScript with clock messages nobody listens to
+        this.currentFilter |= midiMessageDefs.timingClock.filterBit;
+        this.setFilters(this.channelMask, this.currentFilter);
+    }
+    this.setClockFollowing(enable,
+                           options.window === undefined ? 48 : options.window,
+                           options.threshold === undefined ? 0.5 : options.threshold);
+}
+
 MIDI.MIDIInput.prototype.stopListening = function()
 {
     if (this.listening) {
         this.listening = false;
+        this.unlisten();
         this.setFilters(0xffff, 0x7fffffff);
     }
 }
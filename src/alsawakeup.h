@@ -0,0 +1,224 @@
+// -*- C++ -*-
+
+// Blocking wakeup for MIDI input on Linux
+
+// Portmidi does not expose the file descriptors of its input streams,
+// so input would have to be polled.  An alsawakeup object opens a
+// separate ALSA sequencer client that subscribes to the same sequencer
+// ports as the portmidi input streams.  Every event that the kernel
+// delivers to portmidi is also delivered to this client, which makes
+// its poll descriptors readable.  wait() blocks in poll() on these
+// descriptors and on a pipe that is used to wake the waiting thread
+// explicitly, so an idle process does not use any CPU.  The events
+// received by the wakeup client are only used as a signal and are
+// dropped.
+//
+// The ALSA sequencer delivers an event to the subscribers one after
+// the other, so the waiting thread may run before the event has been
+// queued for portmidi.  Callers should retry a read that found no data
+// after a short timeout.
+//
+// watch(), unwatch() and drain() must not be called concurrently,
+// notify() may be called from any thread.
+
+#ifndef _alsawakeup_h
+#define _alsawakeup_h
+
+#ifdef HAVE_ALSA
+
+#include <alsa/asoundlib.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+#include <map>
+
+class alsawakeup
+{
+public:
+  // Bits returned by wait()
+  enum { NOTIFIED = 1, RECEIVED = 2 };
+
+  alsawakeup()
+    : _seq(0),
+      _port(-1)
+  {
+    _pipe[0] = _pipe[1] = -1;
+    if (pipe(_pipe)) {
+      return;
+    }
+    for (int i = 0; i < 2; i++) {
+      fcntl(_pipe[i], F_SETFL, fcntl(_pipe[i], F_GETFL) | O_NONBLOCK);
+      fcntl(_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (snd_seq_open(&_seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0) {
+      _seq = 0;
+      return;
+    }
+    snd_seq_set_client_name(_seq, "MIDI input wakeup");
+    _client = snd_seq_client_id(_seq);
+    _port = snd_seq_create_simple_port(_seq, "wakeup",
+                                       SND_SEQ_PORT_CAP_WRITE
+                                       | SND_SEQ_PORT_CAP_SUBS_WRITE
+                                       | SND_SEQ_PORT_CAP_NO_EXPORT,
+                                       SND_SEQ_PORT_TYPE_APPLICATION);
+    if (_port < 0) {
+      snd_seq_close(_seq);
+      _seq = 0;
+      return;
+    }
+
+    pollfd control;
+    control.fd = _pipe[0];
+    control.events = POLLIN;
+    control.revents = 0;
+    _fds.push_back(control);
+
+    const int count = snd_seq_poll_descriptors_count(_seq, POLLIN);
+    _fds.resize(1 + count);
+    snd_seq_poll_descriptors(_seq, &_fds[1], count, POLLIN);
+  }
+
+  ~alsawakeup()
+  {
+    if (_seq) {
+      snd_seq_close(_seq);
+    }
+    for (int i = 0; i < 2; i++) {
+      if (_pipe[i] >= 0) {
+        close(_pipe[i]);
+      }
+    }
+  }
+
+  // False if the sequencer could not be opened, the caller needs to
+  // poll for input in this case.
+  bool available() const { return _seq != 0; }
+
+  // Subscribe to the sequencer port with the given name.  Returns
+  // false if the port cannot be found or subscribed to.
+  bool watch(const std::string& portName)
+  {
+    if (!_seq) {
+      return false;
+    }
+    std::map<std::string, Subscription>::iterator i = _subscriptions.find(portName);
+    if (i != _subscriptions.end()) {
+      i->second.refs++;
+      return true;
+    }
+
+    Subscription subscription;
+    if (!findPort(portName, subscription)
+        || snd_seq_connect_from(_seq, _port, subscription.client, subscription.port) < 0) {
+      return false;
+    }
+    subscription.refs = 1;
+    _subscriptions[portName] = subscription;
+    return true;
+  }
+
+  void unwatch(const std::string& portName)
+  {
+    std::map<std::string, Subscription>::iterator i = _subscriptions.find(portName);
+    if (i == _subscriptions.end() || --i->second.refs) {
+      return;
+    }
+    snd_seq_disconnect_from(_seq, _port, i->second.client, i->second.port);
+    _subscriptions.erase(i);
+  }
+
+  // Wake up the thread blocked in wait()
+  void notify()
+  {
+    const char c = 0;
+    // A full pipe means that a wakeup is pending anyway
+    while (write(_pipe[1], &c, 1) < 0 && errno == EINTR)
+      ;
+  }
+
+  // Block until notify() has been called or an event has been
+  // received on a watched port, or until timeout milliseconds have
+  // passed (-1 waits indefinitely).  Returns a combination of NOTIFIED
+  // and RECEIVED, or 0 on timeout.
+  int wait(int timeout)
+  {
+    int rc;
+    do {
+      rc = poll(&_fds[0], _fds.size(), timeout);
+    } while (rc < 0 && errno == EINTR);
+
+    int result = 0;
+    if (rc > 0) {
+      if (_fds[0].revents & POLLIN) {
+        result |= NOTIFIED;
+      }
+      for (size_t i = 1; i < _fds.size(); i++) {
+        if (_fds[i].revents & POLLIN) {
+          result |= RECEIVED;
+        }
+      }
+    }
+    return result;
+  }
+
+  // Consume the pending wakeups
+  void drain()
+  {
+    char buf[64];
+    while (read(_pipe[0], buf, sizeof buf) > 0)
+      ;
+    snd_seq_drop_input(_seq);
+  }
+
+private:
+  struct Subscription {
+    int client;
+    int port;
+    int refs;
+  };
+
+  snd_seq_t* _seq;
+  int _client;
+  int _port;
+  int _pipe[2];
+  std::vector<pollfd> _fds;
+  std::map<std::string, Subscription> _subscriptions;
+
+  bool findPort(const std::string& portName, Subscription& subscription)
+  {
+    const unsigned int readable = SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ;
+
+    snd_seq_client_info_t* clientInfo;
+    snd_seq_port_info_t* portInfo;
+    snd_seq_client_info_alloca(&clientInfo);
+    snd_seq_port_info_alloca(&portInfo);
+
+    snd_seq_client_info_set_client(clientInfo, -1);
+    while (snd_seq_query_next_client(_seq, clientInfo) >= 0) {
+      const int client = snd_seq_client_info_get_client(clientInfo);
+      if (client == _client) {
+        continue;
+      }
+      snd_seq_port_info_set_client(portInfo, client);
+      snd_seq_port_info_set_port(portInfo, -1);
+      while (snd_seq_query_next_port(_seq, portInfo) >= 0) {
+        if ((snd_seq_port_info_get_capability(portInfo) & readable) == readable
+            && portName == snd_seq_port_info_get_name(portInfo)) {
+          subscription.client = client;
+          subscription.port = snd_seq_port_info_get_port(portInfo);
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+#endif
+
+#endif
@@ -13,12 +13,14 @@ function sendBcl(string) {
     function sendBclLine(lineNumber)
     {
         var line = bclToSend[lineNumber];
-        var sysex = [0xf0, 0x00, 0x20, 0x32, 0x00, 0x15,
-                     0x20, ((lineNumber >> 7) & 0x7f), (lineNumber & 0x7f)]
-        for (var i = 0; i < line.length; i++) {
-            sysex.push(line.charCodeAt(i));
+        var header = [0xf0, 0x00, 0x20, 0x32, 0x00, 0x15,
+                      0x20, ((lineNumber >> 7) & 0x7f), (lineNumber & 0x7f)];
+        var sysex = new Buffer(header.length + line.length + 1);
+        for (var i = 0; i < header.length; i++) {
+            sysex[i] = header[i];
         }
-        sysex.push(0xf7);
+        sysex.write(line, header.length, 'ascii');
+        sysex[sysex.length - 1] = 0xf7;
         bcrOutput.sysex(sysex);
     }
 
@@ -0,0 +1,146 @@
+// -*- C++ -*-
+
+// Log-linear histogram of 32 bit values
+
+// Values below SUB_BUCKETS have a bucket each.  Above, every power of
+// two is divided into SUB_BUCKETS buckets of equal width, so that the
+// relative error of a value reported for a bucket is below
+// 1 / SUB_BUCKETS.  Recording is a few instructions without branches
+// on the value range and does not allocate.
+//
+// A histogram has a single writer thread.  Counts are updated with
+// atomic increments, so other threads can read them at any time and
+// see a consistent count per bucket, although not necessarily a
+// consistent state across buckets.  reset() may be called by a reader,
+// values recorded concurrently may be lost.
+
+#ifndef _histogram_h
+#define _histogram_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+class histogram
+{
+public:
+  enum {
+    SUB_BITS = 4,
+    SUB_BUCKETS = 1 << SUB_BITS,
+    BUCKETS = (32 - SUB_BITS + 1) * SUB_BUCKETS
+  };
+
+  histogram() { reset(); }
+
+  void record(uint32_t value)
+  {
+    __sync_fetch_and_add(&_counts[bucketOf(value)], 1);
+    __sync_fetch_and_add(&_count, 1);
+    __sync_fetch_and_add(&_sum, value);
+    uint32_t current;
+    while (value < (current = _min) && !__sync_bool_compare_and_swap(&_min, current, value))
+      ;
+    while (value > (current = _max) && !__sync_bool_compare_and_swap(&_max, current, value))
+      ;
+  }
+
+  void reset()
+  {
+    for (size_t i = 0; i < BUCKETS; i++) {
+      __sync_lock_test_and_set(&_counts[i], 0);
+    }
+    __sync_lock_test_and_set(&_count, 0);
+    __sync_lock_test_and_set(&_sum, 0);
+    __sync_lock_test_and_set(&_min, ~0u);
+    __sync_lock_test_and_set(&_max, 0);
+  }
+
+  uint64_t count() const { return _count; }
+  uint32_t min() const { return _count ? _min : 0; }
+  uint32_t max() const { return _max; }
+  double mean() const { return _count ? (double) _sum / _count : 0; }
+
+  // Value below which the fraction p of the recorded values fall, as
+  // the upper bound of the bucket that contains it
+  uint32_t percentile(double p) const
+  {
+    const uint64_t total = _count;
+    if (!total) {
+      return 0;
+    }
+    uint64_t rank = (uint64_t) (p * total);
+    if (rank >= total) {
+      rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += _counts[i];
+      if (seen > rank) {
+        return (upperBound(i) < _max) ? upperBound(i) : _max;
+      }
+    }
+    return _max;
+  }
+
+  // Summary numbers, copied out so that they can be reported after
+  // a lock protecting the histogram has been released
+  struct summary {
+    uint64_t count;
+    uint32_t min;
+    uint32_t max;
+    double mean;
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+    uint32_t p999;
+  };
+
+  summary summarize() const
+  {
+    summary result;
+    result.count = count();
+    result.min = min();
+    result.max = max();
+    result.mean = mean();
+    result.p50 = percentile(0.5);
+    result.p90 = percentile(0.9);
+    result.p99 = percentile(0.99);
+    result.p999 = percentile(0.999);
+    return result;
+  }
+
+  // Buckets, for reporting the full distribution
+  uint64_t bucketCount(size_t bucket) const { return _counts[bucket]; }
+
+  static uint32_t lowerBound(size_t bucket)
+  {
+    if (bucket < SUB_BUCKETS) {
+      return bucket;
+    }
+    const unsigned shift = bucket / SUB_BUCKETS - 1;
+    return (uint32_t) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  }
+
+  static uint32_t upperBound(size_t bucket)
+  {
+    return (bucket + 1 < BUCKETS) ? lowerBound(bucket + 1) - 1 : ~0u;
+  }
+
+  static size_t bucketOf(uint32_t value)
+  {
+    if (value < SUB_BUCKETS) {
+      return value;
+    }
+    const unsigned magnitude = 31 - __builtin_clz(value);
+    const unsigned shift = magnitude - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+  }
+
+private:
+  volatile uint64_t _counts[BUCKETS];
+  volatile uint64_t _count;
+  volatile uint64_t _sum;
+  volatile uint32_t _min;
+  volatile uint32_t _max;
+};
+
+#endif
@@ -0,0 +1,560 @@
+// -*- C++ -*-
+
+// Append-only journal of received MIDI events
+
+// A journal stores the raw events read from a MIDI input, 8 bytes per
+// event, so that a recording can be replayed exactly.  Sysex messages
+// are stored as portmidi delivers them, four bytes per event.
+//
+// File layout, all integers are little endian:
+//
+//   header   "MIDJ" version
+//   blocks   tag length payload
+//
+//   DATA     firstTimestamp lastTimestamp count
+//            count * (timestamp message)
+//   INDX     previousIndex(64 bit) count
+//            count * (offset(64 bit) firstTimestamp lastTimestamp)
+//   TAIL     lastIndex(64 bit)
+//
+// An index block lists the data blocks written since the previous
+// index block, and is written every INDEX_INTERVAL data blocks.  When
+// the journal is closed, a final index block and the tail block are
+// written.  The reader follows the index chain back from the tail to
+// find all data blocks without touching the event data.  If the tail
+// is missing because the recording was not closed properly, the
+// reader walks the block headers from the start instead.
+//
+// The journalwriter is fed from the MIDI reader thread.  append()
+// only copies the events into a buffer; full buffers are handed to a
+// writer thread which performs all file I/O, buffers that are not
+// full are flushed every FLUSH_INTERVAL milliseconds.  Timestamps are
+// expected to be nondecreasing, as they are for the events of one
+// input.
+
+#ifndef _journal_h
+#define _journal_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+
+#include "mutex.h"
+#include "mappedfile.h"
+
+struct journalevent {
+  uint32_t timestamp;
+  uint32_t message;
+};
+
+namespace journalformat {
+  enum {
+    VERSION = 1,
+    HEADER_SIZE = 8,
+    BLOCK_HEADER_SIZE = 8,
+    DATA_HEADER_SIZE = 12,
+    EVENT_SIZE = 8,
+    INDEX_HEADER_SIZE = 12,
+    INDEX_ENTRY_SIZE = 16
+  };
+
+  inline void put32(std::vector<unsigned char>& v, uint32_t x)
+  {
+    for (int i = 0; i < 4; i++) {
+      v.push_back(x >> (8 * i));
+    }
+  }
+  inline void put64(std::vector<unsigned char>& v, uint64_t x)
+  {
+    put32(v, x);
+    put32(v, x >> 32);
+  }
+  inline uint32_t get32(const unsigned char* p)
+  {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+  }
+  inline uint64_t get64(const unsigned char* p)
+  {
+    return get32(p) | ((uint64_t) get32(p + 4) << 32);
+  }
+  inline void putTag(std::vector<unsigned char>& v, const char* tag)
+  {
+    v.insert(v.end(), tag, tag + 4);
+  }
+}
+
+// //////////////////////////////////////////////////////////////////
+// Writer
+// //////////////////////////////////////////////////////////////////
+
+class journalwriter
+{
+public:
+  enum { BLOCK_EVENTS = 4096, INDEX_INTERVAL = 64, FLUSH_INTERVAL = 1000 };
+
+  journalwriter(const char* path)
+    : _current(new buffer),
+      _closing(false),
+      _failed(false),
+      _eventCount(0),
+      _offset(0),
+      _lastIndex(0)
+  {
+    _fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (_fd < 0) {
+      delete _current;
+      throw file_error(std::string("could not create ") + path);
+    }
+    _current->reserve(BLOCK_EVENTS);
+
+    _block.clear();
+    journalformat::putTag(_block, "MIDJ");
+    journalformat::put32(_block, journalformat::VERSION);
+    if (!writeBlock()) {
+      ::close(_fd);
+      delete _current;
+      throw file_error(std::string("could not write ") + path);
+    }
+
+    if (pthread_create(&_thread, 0, writerThread, this)) {
+      ::close(_fd);
+      delete _current;
+      throw file_error("could not start journal writer thread");
+    }
+  }
+
+  ~journalwriter()
+  {
+    close();
+    delete _current;
+    for (size_t i = 0; i < _free.size(); i++) {
+      delete _free[i];
+    }
+  }
+
+  // Called by the producer.  Event must have timestamp and message
+  // members, like PmEvent.
+  template <class Event>
+  void append(const Event* events, size_t count)
+  {
+    unique_lock<mutex> lock(_mutex);
+    if (_closing) {
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      journalevent event;
+      event.timestamp = events[i].timestamp;
+      event.message = events[i].message;
+      _current->push_back(event);
+      if (_current->size() == BLOCK_EVENTS) {
+        _full.push_back(_current);
+        _current = takeBuffer();
+        _condition.notify_one();
+      }
+    }
+    _eventCount += count;
+  }
+
+  // Write all buffered events and the final index, and stop the
+  // writer thread.  Returns false if writing has failed at any time.
+  bool close()
+  {
+    {
+      unique_lock<mutex> lock(_mutex);
+      if (_closing) {
+        return !_failed;
+      }
+      _closing = true;
+      _condition.notify_one();
+    }
+    pthread_join(_thread, 0);
+    ::close(_fd);
+    return !_failed;
+  }
+
+  uint64_t eventCount()
+  {
+    unique_lock<mutex> lock(_mutex);
+    return _eventCount;
+  }
+
+private:
+  typedef std::vector<journalevent> buffer;
+
+  int _fd;
+  pthread_t _thread;
+
+  // _mutex protects the buffers and flags against the writer thread
+  mutex _mutex;
+  monotonic_condition_variable _condition;
+  buffer* _current;                             // being filled by append()
+  std::vector<buffer*> _full;                   // waiting to be written
+  std::vector<buffer*> _free;
+  bool _closing;
+  bool _failed;
+  uint64_t _eventCount;
+
+  // Only used by the writer thread
+  std::vector<unsigned char> _block;
+  uint64_t _offset;                             // of the next block
+  uint64_t _lastIndex;                          // offset, 0 if none
+  struct indexentry {
+    uint64_t offset;
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+  };
+  std::vector<indexentry> _pendingIndex;        // data blocks since the last index
+
+  // Called with _mutex held.  Buffers are recycled, so the producer
+  // only allocates while the writer thread is behind.
+  buffer* takeBuffer()
+  {
+    if (_free.empty()) {
+      buffer* b = new buffer;
+      b->reserve(BLOCK_EVENTS);
+      return b;
+    }
+    buffer* b = _free.back();
+    _free.pop_back();
+    return b;
+  }
+
+  static void* writerThread(void* arg)
+  {
+    static_cast<journalwriter*>(arg)->writerLoop();
+    return 0;
+  }
+
+  void writerLoop()
+  {
+    std::vector<buffer*> buffers;
+    unique_lock<mutex> lock(_mutex);
+
+    while (true) {
+      if (_full.empty() && !_closing && !_condition.wait_for(lock, FLUSH_INTERVAL)) {
+        // Flush a partially filled buffer on timeout
+        if (!_current->empty()) {
+          _full.push_back(_current);
+          _current = takeBuffer();
+        }
+      }
+      if (_closing && !_current->empty()) {
+        _full.push_back(_current);
+        _current = takeBuffer();
+      }
+      buffers.swap(_full);
+      const bool closing = _closing;
+
+      // Write without holding the lock
+      _mutex.unlock();
+      bool ok = true;
+      for (size_t i = 0; i < buffers.size(); i++) {
+        ok = ok && writeData(*buffers[i]);
+        buffers[i]->clear();
+      }
+      if (closing) {
+        ok = ok && writeIndex() && writeTail();
+      }
+      _mutex.lock();
+
+      _free.insert(_free.end(), buffers.begin(), buffers.end());
+      buffers.clear();
+      _failed = _failed || !ok;
+      if (closing) {
+        return;
+      }
+    }
+  }
+
+  bool writeData(const buffer& events)
+  {
+    if (events.empty()) {
+      return true;
+    }
+    using namespace journalformat;
+    _block.clear();
+    putTag(_block, "DATA");
+    put32(_block, DATA_HEADER_SIZE + events.size() * EVENT_SIZE);
+    put32(_block, events.front().timestamp);
+    put32(_block, events.back().timestamp);
+    put32(_block, events.size());
+    for (size_t i = 0; i < events.size(); i++) {
+      put32(_block, events[i].timestamp);
+      put32(_block, events[i].message);
+    }
+
+    indexentry entry = { _offset, events.front().timestamp, events.back().timestamp };
+    if (!writeBlock()) {
+      return false;
+    }
+    _pendingIndex.push_back(entry);
+    return _pendingIndex.size() < INDEX_INTERVAL || writeIndex();
+  }
+
+  bool writeIndex()
+  {
+    using namespace journalformat;
+    _block.clear();
+    putTag(_block, "INDX");
+    put32(_block, INDEX_HEADER_SIZE + _pendingIndex.size() * INDEX_ENTRY_SIZE);
+    put64(_block, _lastIndex);
+    put32(_block, _pendingIndex.size());
+    for (size_t i = 0; i < _pendingIndex.size(); i++) {
+      put64(_block, _pendingIndex[i].offset);
+      put32(_block, _pendingIndex[i].firstTimestamp);
+      put32(_block, _pendingIndex[i].lastTimestamp);
+    }
+
+    const uint64_t offset = _offset;
+    if (!writeBlock()) {
+      return false;
+    }
+    _lastIndex = offset;
+    _pendingIndex.clear();
+    return true;
+  }
+
+  bool writeTail()
+  {
+    using namespace journalformat;
+    _block.clear();
+    putTag(_block, "TAIL");
+    put32(_block, 8);
+    put64(_block, _lastIndex);
+    return writeBlock();
+  }
+
+  bool writeBlock()
+  {
+    size_t written = 0;
+    while (written < _block.size()) {
+      const ssize_t rc = write(_fd, &_block[written], _block.size() - written);
+      if (rc < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      written += rc;
+    }
+    _offset += written;
+    return true;
+  }
+
+  journalwriter(const journalwriter&);
+  journalwriter& operator=(const journalwriter&);
+};
+
+// //////////////////////////////////////////////////////////////////
+// Reader
+// //////////////////////////////////////////////////////////////////
+
+class journalreader
+{
+public:
+  // Position of an event, ordered by block and event within the block
+  struct position {
+    size_t block;
+    uint32_t event;
+  };
+
+  journalreader(const char* path)
+    : _file(path),
+      _eventCount(0)
+  {
+    using namespace journalformat;
+    const unsigned char* data = _file.data();
+    if (_file.size() < HEADER_SIZE || memcmp(data, "MIDJ", 4)) {
+      throw file_error(std::string(path) + " is not a MIDI journal");
+    }
+    if (get32(data + 4) != VERSION) {
+      throw file_error(std::string(path) + " has an unsupported journal version");
+    }
+    if (!readIndex()) {
+      scanBlocks();
+    }
+    for (size_t i = 0; i < _blocks.size(); i++) {
+      _eventCount += _blocks[i].count;
+    }
+  }
+
+  uint64_t eventCount() const { return _eventCount; }
+  bool empty() const { return _blocks.empty(); }
+  uint32_t firstTimestamp() const { return empty() ? 0 : _blocks.front().firstTimestamp; }
+  uint32_t lastTimestamp() const { return empty() ? 0 : _blocks.back().lastTimestamp; }
+
+  position begin() const
+  {
+    position p = { 0, 0 };
+    return p;
+  }
+
+  bool atEnd(const position& p) const { return p.block == _blocks.size(); }
+
+  // Returns the event at p, which must not be at the end
+  journalevent at(const position& p) const
+  {
+    const unsigned char* e = _blocks[p.block].events + p.event * journalformat::EVENT_SIZE;
+    journalevent event;
+    event.timestamp = journalformat::get32(e);
+    event.message = journalformat::get32(e + 4);
+    return event;
+  }
+
+  void advance(position& p) const
+  {
+    if (++p.event == _blocks[p.block].count) {
+      p.block++;
+      p.event = 0;
+    }
+  }
+
+  // Position of the first event at or after timestamp, found by binary
+  // search over the blocks and then over the events of one block
+  position seek(uint32_t timestamp) const
+  {
+    size_t lo = 0, hi = _blocks.size();
+    while (lo < hi) {
+      const size_t mid = (lo + hi) / 2;
+      if (_blocks[mid].lastTimestamp < timestamp) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    position p = { lo, 0 };
+    if (lo == _blocks.size()) {
+      return p;
+    }
+    uint32_t first = 0, last = _blocks[lo].count;
+    while (first < last) {
+      p.event = (first + last) / 2;
+      if (at(p).timestamp < timestamp) {
+        first = p.event + 1;
+      } else {
+        last = p.event;
+      }
+    }
+    p.event = first;
+    return p;
+  }
+
+private:
+  struct block {
+    const unsigned char* events;
+    uint32_t count;
+    uint32_t firstTimestamp;
+    uint32_t lastTimestamp;
+  };
+
+  mappedfile _file;
+  std::vector<block> _blocks;
+  uint64_t _eventCount;
+
+  // Returns a pointer to the payload of the block at offset with the
+  // given tag, or 0 if there is no complete block of that kind
+  const unsigned char* blockAt(uint64_t offset, const char* tag, uint32_t& length) const
+  {
+    using namespace journalformat;
+    if (offset < HEADER_SIZE || offset > _file.size() || _file.size() - offset < BLOCK_HEADER_SIZE) {
+      return 0;
+    }
+    const unsigned char* p = _file.data() + offset;
+    length = get32(p + 4);
+    if (memcmp(p, tag, 4) || length > _file.size() - offset - BLOCK_HEADER_SIZE) {
+      return 0;
+    }
+    return p + BLOCK_HEADER_SIZE;
+  }
+
+  bool addDataBlock(uint64_t offset)
+  {
+    using namespace journalformat;
+    uint32_t length;
+    const unsigned char* payload = blockAt(offset, "DATA", length);
+    if (!payload || length < DATA_HEADER_SIZE) {
+      return false;
+    }
+    block b;
+    b.firstTimestamp = get32(payload);
+    b.lastTimestamp = get32(payload + 4);
+    b.count = get32(payload + 8);
+    b.events = payload + DATA_HEADER_SIZE;
+    if (b.count == 0 || b.count > (length - DATA_HEADER_SIZE) / EVENT_SIZE) {
+      return false;
+    }
+    _blocks.push_back(b);
+    return true;
+  }
+
+  // Follow the index chain back from the tail block
+  bool readIndex()
+  {
+    using namespace journalformat;
+    const size_t tailSize = BLOCK_HEADER_SIZE + 8;
+    uint32_t length;
+    const unsigned char* tail = (_file.size() >= HEADER_SIZE + tailSize)
+      ? blockAt(_file.size() - tailSize, "TAIL", length)
+      : 0;
+    if (!tail || length != 8) {
+      return false;
+    }
+
+    std::vector<uint64_t> offsets;
+    uint64_t indexOffset = get64(tail);
+    while (indexOffset) {
+      const unsigned char* index = blockAt(indexOffset, "INDX", length);
+      if (!index || length < INDEX_HEADER_SIZE) {
+        return false;
+      }
+      const uint32_t count = get32(index + 8);
+      if (count > (length - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE) {
+        return false;
+      }
+      // Entries are collected in reverse and put in order below
+      for (uint32_t i = count; i > 0; i--) {
+        offsets.push_back(get64(index + INDEX_HEADER_SIZE + (i - 1) * INDEX_ENTRY_SIZE));
+      }
+      const uint64_t previous = get64(index);
+      if (previous >= indexOffset) {
+        return false;
+      }
+      indexOffset = previous;
+    }
+
+    for (size_t i = offsets.size(); i > 0; i--) {
+      if (!addDataBlock(offsets[i - 1])) {
+        _blocks.clear();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Walk all block headers, used for journals that were not closed
+  void scanBlocks()
+  {
+    using namespace journalformat;
+    uint64_t offset = HEADER_SIZE;
+    while (_file.size() - offset >= BLOCK_HEADER_SIZE) {
+      const unsigned char* p = _file.data() + offset;
+      const uint32_t length = get32(p + 4);
+      if (length > _file.size() - offset - BLOCK_HEADER_SIZE) {
+        break;
+      }
+      if (!memcmp(p, "DATA", 4)) {
+        addDataBlock(offset);
+      }
+      offset += BLOCK_HEADER_SIZE + length;
+    }
+  }
+};
+
+#endif
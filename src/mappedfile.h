@@ -0,0 +1,79 @@
+// -*- C++ -*-
+
+// Read only memory mapping of a file
+
+#ifndef _mappedfile_h
+#define _mappedfile_h
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <exception>
+#include <string>
+
+// Thrown by the file readers and writers on I/O and format errors
+class file_error
+  : public std::exception
+{
+public:
+  file_error(const std::string& what)
+    : _what(what)
+  {}
+  virtual ~file_error() throw() {}
+  virtual const char* what() const throw() { return _what.c_str(); }
+
+private:
+  std::string _what;
+};
+
+class mappedfile
+{
+public:
+  mappedfile(const char* path)
+    : _data(0),
+      _size(0)
+  {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw file_error(std::string("could not open ") + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+      close(fd);
+      throw file_error(std::string("could not stat ") + path);
+    }
+    _size = st.st_size;
+    // Empty files cannot be mapped
+    if (_size) {
+      void* map = mmap(0, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        close(fd);
+        throw file_error(std::string("could not map ") + path);
+      }
+      _data = static_cast<const unsigned char*>(map);
+    }
+    close(fd);
+  }
+
+  ~mappedfile()
+  {
+    if (_data) {
+      munmap(const_cast<unsigned char*>(_data), _size);
+    }
+  }
+
+  const unsigned char* data() const { return _data; }
+  size_t size() const { return _size; }
+
+private:
+  const unsigned char* _data;
+  size_t _size;
+
+  mappedfile(const mappedfile&);
+  mappedfile& operator=(const mappedfile&);
+};
+
+#endif
@@ -6,6 +6,9 @@
 #define _mutex_h
 
 #include <pthread.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
 
 class pthread_exception
   : public std::exception
@@ -47,6 +50,7 @@ public:
 
 private:
   friend class condition_variable;
+  friend class monotonic_condition_variable;
   pthread_mutex_t _mutex;
 };
 
@@ -66,6 +70,7 @@ public:
 
 private:
   friend class condition_variable;
+  friend class monotonic_condition_variable;
   T* _lock;
 };
 
@@ -94,4 +99,55 @@ public:
   pthread_cond_t _condition;
 };
 
+// Condition variable with waits until CLOCK_MONOTONIC deadlines, which
+// are not affected by changes of the system time
+class monotonic_condition_variable
+  : public condition_variable
+{
+public:
+  monotonic_condition_variable() {
+#ifndef __APPLE__
+    pthread_cond_destroy(&_condition);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&_condition, &attributes);
+    pthread_condattr_destroy(&attributes);
+#endif
+  }
+
+  // Returns false if the deadline has passed
+  bool wait_until(unique_lock<mutex>& lock, const struct timespec& deadline) {
+#ifdef __APPLE__
+    // Darwin has no monotonic condition variables, wait relative
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long nanoseconds = (deadline.tv_sec - now.tv_sec) * 1000000000LL + (deadline.tv_nsec - now.tv_nsec);
+    if (nanoseconds <= 0) {
+      return false;
+    }
+    struct timespec relative;
+    relative.tv_sec = nanoseconds / 1000000000;
+    relative.tv_nsec = nanoseconds % 1000000000;
+    const int rc = pthread_cond_timedwait_relative_np(&_condition, &(lock._lock->_mutex), &relative);
+#else
+    const int rc = pthread_cond_timedwait(&_condition, &(lock._lock->_mutex), &deadline);
+#endif
+    if (rc && rc != ETIMEDOUT) {
+      throw pthread_exception("pthread_cond_timedwait failed");
+    }
+    return rc == 0;
+  }
+
+  // Returns false if the timeout has expired
+  bool wait_for(unique_lock<mutex>& lock, unsigned milliseconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    const unsigned long long nanoseconds = deadline.tv_nsec + milliseconds * 1000000ULL;
+    deadline.tv_sec += nanoseconds / 1000000000;
+    deadline.tv_nsec = nanoseconds % 1000000000;
+    return wait_until(lock, deadline);
+  }
+};
+
 #endif
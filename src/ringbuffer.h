@@ -0,0 +1,98 @@
+// -*- C++ -*-
+
+// Lock-free single producer, single consumer ring buffer
+
+// The producer and the consumer indices live on separate cache lines,
+// and each side keeps a private copy of the other side's index so that
+// the shared lines are only touched when the cached value says that
+// the ring looks full (producer) or empty (consumer).  Elements are
+// stored inline, the ring never allocates after construction.
+
+#ifndef _ringbuffer_h
+#define _ringbuffer_h
+
+#include <stddef.h>
+
+template <class T, size_t N>
+class ringbuffer
+{
+  // N must be a power of two so that indices can be masked
+  typedef char capacity_must_be_power_of_two[((N & (N - 1)) == 0) ? 1 : -1];
+
+public:
+  ringbuffer()
+    : _head(0),
+      _tailCache(0),
+      _tail(0),
+      _headCache(0)
+  {}
+
+  static size_t capacity() { return N; }
+
+  // Producer side: Returns false if the ring is full.
+  bool push(const T& element)
+  {
+    const size_t head = _head;
+    if (head - _tailCache == N) {
+      _tailCache = load(_tail);
+      if (head - _tailCache == N) {
+        return false;
+      }
+    }
+    _elements[head & (N - 1)] = element;
+    store(_head, head + 1);
+    return true;
+  }
+
+  // Consumer side: Returns false if the ring is empty.
+  bool pop(T& element)
+  {
+    const size_t tail = _tail;
+    if (tail == _headCache) {
+      _headCache = load(_head);
+      if (tail == _headCache) {
+        return false;
+      }
+    }
+    element = _elements[tail & (N - 1)];
+    store(_tail, tail + 1);
+    return true;
+  }
+
+  // Consumer side
+  bool empty() const { return _tail == load(_head); }
+
+  // May be called from either side, the result is a snapshot
+  size_t size() const { return load(_head) - load(_tail); }
+
+private:
+  enum { CACHE_LINE_SIZE = 64 };
+
+  // The barriers order the element access with respect to the index
+  // update that publishes it to the other side.
+  static size_t load(const volatile size_t& index)
+  {
+    size_t value = index;
+    __sync_synchronize();
+    return value;
+  }
+  static void store(volatile size_t& index, size_t value)
+  {
+    __sync_synchronize();
+    index = value;
+  }
+
+  // written by the producer
+  volatile size_t _head;
+  size_t _tailCache;
+  char _producerPad[CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+
+  // written by the consumer
+  volatile size_t _tail;
+  size_t _headCache;
+  char _consumerPad[CACHE_LINE_SIZE - 2 * sizeof(size_t)];
+
+  T _elements[N];
+};
+
+#endif
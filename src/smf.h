@@ -0,0 +1,516 @@
+// -*- C++ -*-
+
+// Standard MIDI File reader
+
+// The file is mapped into memory and the tracks are decoded lazily,
+// directly from the mapping.  An smfsequence merges the events of all
+// tracks into one stream ordered by tick with a k-way merge and
+// computes the time of each event from the tempo map, which is built
+// from the tempo meta events as the stream is read.
+//
+// To make seeking cheap, the sequence keeps a sparse index.  Every
+// CHECKPOINT_INTERVAL events, the position and running status of all
+// tracks and the tempo state are recorded.  The index is built by a
+// separate scanner that only reads as far into the file as needed to
+// answer a seek, so a file is never parsed more than once.  Seeking
+// restores the closest checkpoint before the target by binary search
+// and skips at most CHECKPOINT_INTERVAL events from there.
+//
+// smfsequence is not thread safe.
+
+#ifndef _smf_h
+#define _smf_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "mappedfile.h"
+
+// //////////////////////////////////////////////////////////////////
+// Memory mapped file and its chunk structure
+// //////////////////////////////////////////////////////////////////
+
+class smffile
+{
+public:
+  struct track {
+    const unsigned char* data;
+    const unsigned char* end;
+  };
+
+  smffile(const char* path)
+    : _file(path),
+      _data(_file.data()),
+      _size(_file.size())
+  {
+    parseChunks(path);
+  }
+
+  int format() const { return _format; }
+  uint16_t division() const { return _division; }
+  const std::vector<track>& tracks() const { return _tracks; }
+
+  static uint32_t read32(const unsigned char* p)
+  {
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+  static uint16_t read16(const unsigned char* p)
+  {
+    return (p[0] << 8) | p[1];
+  }
+
+private:
+  mappedfile _file;
+  const unsigned char* _data;
+  size_t _size;
+  int _format;
+  uint16_t _division;
+  std::vector<track> _tracks;
+
+  // Only the chunk headers are read, track data is decoded on demand
+  void parseChunks(const char* path)
+  {
+    if (_size < 14 || memcmp(_data, "MThd", 4) || read32(_data + 4) < 6) {
+      throw file_error(std::string(path) + " is not a Standard MIDI File");
+    }
+    _format = read16(_data + 8);
+    const uint16_t trackCount = read16(_data + 10);
+    _division = read16(_data + 12);
+    // SMPTE divisions need ticks per frame in the lower byte
+    if (_division == 0 || ((_division & 0x8000) && !(_division & 0xff))) {
+      throw file_error(std::string(path) + " has an invalid time division");
+    }
+
+    size_t offset = 8 + read32(_data + 4);
+    while (offset + 8 <= _size && _tracks.size() < trackCount) {
+      const uint32_t length = read32(_data + offset + 4);
+      const size_t start = offset + 8;
+      // A truncated last chunk is read up to the end of the file
+      const size_t end = (length > _size - start) ? _size : start + length;
+      if (!memcmp(_data + offset, "MTrk", 4)) {
+        track t = { _data + start, _data + end };
+        _tracks.push_back(t);
+      }
+      offset = end;
+    }
+  }
+};
+
+// //////////////////////////////////////////////////////////////////
+// Decoded events and the per track decoder
+// //////////////////////////////////////////////////////////////////
+
+struct smfevent {
+  enum { SYSEX = 0xf0, ESCAPE = 0xf7, META = 0xff };
+  enum { META_END_OF_TRACK = 0x2f, META_TEMPO = 0x51, META_TIME_SIGNATURE = 0x58 };
+
+  uint32_t tick;
+  double micros;                                // time since the start of the file
+  unsigned track;
+  unsigned char status;
+  unsigned char data1;                          // first data byte, or meta type
+  unsigned char data2;
+  const unsigned char* data;                    // sysex or meta payload
+  uint32_t length;
+};
+
+class smftrack
+{
+public:
+  // Position of the next event, restored when seeking
+  struct state {
+    const unsigned char* pos;
+    uint32_t tick;
+    unsigned char runningStatus;
+  };
+
+  smftrack(const smffile::track& t, unsigned index)
+    : _end(t.end),
+      _index(index)
+  {
+    _state.pos = t.data;
+    _state.tick = 0;
+    _state.runningStatus = 0;
+  }
+
+  // State before the current head event
+  const state& headState() const { return _headState; }
+  const smfevent& head() const { return _head; }
+
+  void restore(const state& s) { _state = s; }
+
+  // Decode the next event into head().  Returns false at the end of
+  // the track.
+  bool advance()
+  {
+    _headState = _state;
+    const unsigned char*& p = _state.pos;
+
+    uint32_t delta;
+    if (!readVariable(p, delta) || p == _end) {
+      return finish();
+    }
+    _state.tick += delta;
+    _head.tick = _state.tick;
+    _head.track = _index;
+    _head.data = 0;
+    _head.length = 0;
+    _head.data1 = _head.data2 = 0;
+
+    unsigned char status = *p;
+    if (status & 0x80) {
+      p++;
+    } else if (_state.runningStatus) {
+      status = _state.runningStatus;
+    } else {
+      return finish();
+    }
+    _head.status = status;
+
+    if (status < 0xf0) {
+      _state.runningStatus = status;
+      const int dataBytes = ((status & 0xe0) == 0xc0) ? 1 : 2;
+      if (_end - p < dataBytes) {
+        return finish();
+      }
+      _head.data1 = p[0] & 0x7f;
+      if (dataBytes == 2) {
+        _head.data2 = p[1] & 0x7f;
+      }
+      p += dataBytes;
+      return true;
+    }
+
+    // Sysex and meta events cancel running status
+    _state.runningStatus = 0;
+    if (status == smfevent::META) {
+      if (p == _end) {
+        return finish();
+      }
+      _head.data1 = *p++;
+      if (_head.data1 == smfevent::META_END_OF_TRACK) {
+        return finish();
+      }
+    } else if (status != smfevent::SYSEX && status != smfevent::ESCAPE) {
+      return finish();
+    }
+    uint32_t length;
+    if (!readVariable(p, length) || length > (uint32_t) (_end - p)) {
+      return finish();
+    }
+    _head.data = p;
+    _head.length = length;
+    p += length;
+    return true;
+  }
+
+private:
+  const unsigned char* _end;
+  unsigned _index;
+  state _state;
+  state _headState;
+  smfevent _head;
+
+  bool finish()
+  {
+    _state.pos = _end;
+    return false;
+  }
+
+  bool readVariable(const unsigned char*& p, uint32_t& value) const
+  {
+    value = 0;
+    for (int i = 0; i < 4 && p < _end; i++) {
+      const unsigned char b = *p++;
+      value = (value << 7) | (b & 0x7f);
+      if (!(b & 0x80)) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// //////////////////////////////////////////////////////////////////
+// Merged event stream with tempo map and seek index
+// //////////////////////////////////////////////////////////////////
+
+class smfsequence
+{
+public:
+  enum { CHECKPOINT_INTERVAL = 256, DEFAULT_TEMPO = 500000, MAXIMUM_DENOMINATOR = 8 };
+
+  smfsequence(const smffile& file)
+    : _file(file),
+      _cursor(file),
+      _scanner(file),
+      _scannerDone(false),
+      _scannerEvents(0)
+  {
+    addCheckpoint();
+    TimeSignature ts = { 0, 0, 4 * ticksPerQuarter() };
+    _timeSignatures.push_back(ts);
+  }
+
+  // Read the next event at the playback position.  Returns false at
+  // the end of the sequence.
+  bool next(smfevent& event) { return _cursor.next(event); }
+  bool done() const { return _cursor.done(); }
+
+  // Tick and time of the next event at the playback position, or of
+  // the last event at the end of the sequence.
+  uint32_t tick() const { return _cursor.peekTick(); }
+  double micros() const { return _cursor.microsAt(_cursor.peekTick()); }
+
+  // Move the playback position to the first event at or after tick
+  void seek(uint32_t tick)
+  {
+    scanTo(tick);
+
+    // The last checkpoint strictly before the target tick, events at
+    // the checkpoint's tick may precede it.
+    size_t lo = 0, hi = _index.size();
+    while (hi - lo > 1) {
+      const size_t mid = (lo + hi) / 2;
+      if (_index[mid].tick < tick) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    _cursor.restore(_index[lo], &_trackStates[lo * _file.tracks().size()]);
+
+    smfevent event;
+    while (!_cursor.done() && _cursor.peekTick() < tick) {
+      _cursor.next(event);
+    }
+  }
+
+  // Returns the tick at which the given bar starts, counting from 0.
+  // Time signature changes are taken into account.
+  uint32_t barToTick(uint32_t bar)
+  {
+    while (!_scannerDone && bar >= lastTimeSignature().bar
+           && tickOf(lastTimeSignature(), bar) > _scanner.peekTick()) {
+      scanEvents(CHECKPOINT_INTERVAL);
+    }
+    std::vector<TimeSignature>::const_iterator i = _timeSignatures.end();
+    do {
+      --i;
+    } while (i->bar > bar);
+    return tickOf(*i, bar);
+  }
+
+  // Duration of the sequence, scans to the end of the file
+  double durationMicros()
+  {
+    while (!_scannerDone) {
+      scanEvents(CHECKPOINT_INTERVAL);
+    }
+    return _scanner.microsAt(_scanner.lastTick());
+  }
+
+  uint32_t ticksPerQuarter() const
+  {
+    return (_file.division() & 0x8000) ? 0 : _file.division();
+  }
+
+private:
+  // The merge of all tracks, with the tempo state at the last event
+  class cursor
+  {
+  public:
+    cursor(const smffile& file)
+      : _file(file),
+        _lastTick(0),
+        _micros(0),
+        _tempo(DEFAULT_TEMPO)
+    {
+      for (size_t i = 0; i < file.tracks().size(); i++) {
+        _tracks.push_back(smftrack(file.tracks()[i], i));
+      }
+      for (size_t i = 0; i < _tracks.size(); i++) {
+        if (_tracks[i].advance()) {
+          _heap.push_back(i);
+        }
+      }
+      std::make_heap(_heap.begin(), _heap.end(), later(_tracks));
+    }
+
+    bool done() const { return _heap.empty(); }
+    uint32_t peekTick() const { return _heap.empty() ? _lastTick : _tracks[_heap.front()].head().tick; }
+    uint32_t lastTick() const { return _lastTick; }
+    uint32_t tempo() const { return _tempo; }
+    double micros() const { return _micros; }
+
+    double microsAt(uint32_t tick) const
+    {
+      return _micros + (tick - _lastTick) * microsPerTick();
+    }
+
+    bool next(smfevent& event)
+    {
+      if (_heap.empty()) {
+        return false;
+      }
+      std::pop_heap(_heap.begin(), _heap.end(), later(_tracks));
+      const size_t track = _heap.back();
+      event = _tracks[track].head();
+      if (_tracks[track].advance()) {
+        std::push_heap(_heap.begin(), _heap.end(), later(_tracks));
+      } else {
+        _heap.pop_back();
+      }
+
+      _micros = microsAt(event.tick);
+      _lastTick = event.tick;
+      event.micros = _micros;
+      if (event.status == smfevent::META && event.data1 == smfevent::META_TEMPO && event.length == 3) {
+        _tempo = (event.data[0] << 16) | (event.data[1] << 8) | event.data[2];
+      }
+      return true;
+    }
+
+    // Save the state of all tracks before their head events
+    template <class Checkpoint>
+    void save(Checkpoint& checkpoint, std::vector<smftrack::state>& states) const
+    {
+      checkpoint.tick = peekTick();
+      checkpoint.lastTick = _lastTick;
+      checkpoint.micros = _micros;
+      checkpoint.tempo = _tempo;
+      for (size_t i = 0; i < _tracks.size(); i++) {
+        states.push_back(_tracks[i].headState());
+      }
+    }
+
+    template <class Checkpoint>
+    void restore(const Checkpoint& checkpoint, const smftrack::state* states)
+    {
+      _lastTick = checkpoint.lastTick;
+      _micros = checkpoint.micros;
+      _tempo = checkpoint.tempo;
+      _heap.clear();
+      for (size_t i = 0; i < _tracks.size(); i++) {
+        _tracks[i].restore(states[i]);
+        if (_tracks[i].advance()) {
+          _heap.push_back(i);
+        }
+      }
+      std::make_heap(_heap.begin(), _heap.end(), later(_tracks));
+    }
+
+  private:
+    const smffile& _file;
+    std::vector<smftrack> _tracks;
+    std::vector<size_t> _heap;                  // track indices, earliest head on top
+    uint32_t _lastTick;
+    double _micros;                             // time of _lastTick
+    uint32_t _tempo;                            // microseconds per quarter note
+
+    double microsPerTick() const
+    {
+      const uint16_t division = _file.division();
+      if (division & 0x8000) {
+        // SMPTE: frames per second in the upper byte, negated
+        const int framesPerSecond = -(int8_t) (division >> 8);
+        return 1e6 / (framesPerSecond * (division & 0xff));
+      }
+      return (double) _tempo / division;
+    }
+
+    // Heap order, ties broken by track number to keep the merge stable
+    struct later {
+      const std::vector<smftrack>& tracks;
+      later(const std::vector<smftrack>& t) : tracks(t) {}
+      bool operator()(size_t a, size_t b) const
+      {
+        const uint32_t ta = tracks[a].head().tick;
+        const uint32_t tb = tracks[b].head().tick;
+        return (ta != tb) ? (ta > tb) : (a > b);
+      }
+    };
+  };
+
+  struct Checkpoint {
+    uint32_t tick;                              // of the next event
+    uint32_t lastTick;
+    double micros;
+    uint32_t tempo;
+  };
+
+  struct TimeSignature {
+    uint32_t tick;
+    uint32_t bar;
+    uint32_t ticksPerBar;
+  };
+
+  const smffile& _file;
+  cursor _cursor;
+  cursor _scanner;
+  bool _scannerDone;
+  size_t _scannerEvents;
+  std::vector<Checkpoint> _index;
+  std::vector<smftrack::state> _trackStates;    // tracks().size() per checkpoint
+  std::vector<TimeSignature> _timeSignatures;
+
+  const TimeSignature& lastTimeSignature() const { return _timeSignatures.back(); }
+
+  static uint32_t tickOf(const TimeSignature& ts, uint32_t bar)
+  {
+    return ts.tick + (bar - ts.bar) * ts.ticksPerBar;
+  }
+
+  void addCheckpoint()
+  {
+    Checkpoint checkpoint;
+    _scanner.save(checkpoint, _trackStates);
+    _index.push_back(checkpoint);
+  }
+
+  // Extend the index by up to count events
+  void scanEvents(size_t count)
+  {
+    smfevent event;
+    for (size_t i = 0; i < count; i++) {
+      if (!_scanner.next(event)) {
+        _scannerDone = true;
+        return;
+      }
+      // Time signatures with a denominator above 2^MAXIMUM_DENOMINATOR
+      // are malformed and ignored, the shift would be undefined
+      if (event.status == smfevent::META && event.data1 == smfevent::META_TIME_SIGNATURE
+          && event.length >= 2 && event.data[1] <= MAXIMUM_DENOMINATOR && ticksPerQuarter()) {
+        const TimeSignature& last = lastTimeSignature();
+        TimeSignature ts;
+        ts.tick = event.tick;
+        // A change in the middle of a bar starts a new bar
+        ts.bar = last.bar + (event.tick - last.tick + last.ticksPerBar - 1) / last.ticksPerBar;
+        ts.ticksPerBar = std::max(1u, event.data[0] * 4 * ticksPerQuarter() >> event.data[1]);
+        if (ts.tick == last.tick) {
+          _timeSignatures.back() = ts;
+        } else {
+          _timeSignatures.push_back(ts);
+        }
+      }
+      if (++_scannerEvents % CHECKPOINT_INTERVAL == 0) {
+        addCheckpoint();
+      }
+    }
+  }
+
+  // Extend the index until it covers tick
+  void scanTo(uint32_t tick)
+  {
+    while (!_scannerDone && _scanner.peekTick() <= tick) {
+      scanEvents(CHECKPOINT_INTERVAL);
+    }
+  }
+};
+
+#endif
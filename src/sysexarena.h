@@ -0,0 +1,216 @@
+// -*- C++ -*-
+
+// Chunked arena for reassembling sysex messages
+
+// Sysex messages are accumulated directly in large, reusable chunks of
+// memory.  A completed message stays where it was assembled and is
+// handed out by reference: Every finished message holds a reference to
+// its chunk, which is released when the consumer no longer needs the
+// message.  Chunks without references are recycled for later messages.
+// A message that outgrows the space left in the current chunk is moved
+// to a fresh chunk that is at least twice as large as the message so
+// far, so that long messages are copied a logarithmic number of times.
+//
+// The arena is not thread safe, all functions including release() must
+// be called from the same thread.  Chunks that are still referenced
+// when the arena is destroyed are freed when their last reference is
+// released.
+
+#ifndef _sysexarena_h
+#define _sysexarena_h
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <vector>
+#include <algorithm>
+
+class sysexarena
+{
+public:
+  enum { DEFAULT_CHUNK_SIZE = 65536 };
+
+  class chunk
+  {
+  private:
+    friend class sysexarena;
+
+    sysexarena* _arena;                         // 0 once the arena is gone
+    size_t _size;
+    size_t _used;
+    int _refs;
+    unsigned char* _data;
+  };
+
+  sysexarena(size_t chunkSize = DEFAULT_CHUNK_SIZE)
+    : _chunkSize(chunkSize),
+      _current(0),
+      _messageStart(0),
+      _messageLength(0),
+      _inMessage(false)
+  {}
+
+  ~sysexarena()
+  {
+    for (size_t i = 0; i < _free.size(); i++) {
+      destroy(_free[i]);
+    }
+    for (size_t i = 0; i < _retired.size(); i++) {
+      _retired[i]->_arena = 0;
+    }
+    if (_current) {
+      if (_current->_refs) {
+        _current->_arena = 0;
+      } else {
+        destroy(_current);
+      }
+    }
+  }
+
+  bool inMessage() const { return _inMessage; }
+  size_t messageLength() const { return _messageLength; }
+
+  // Start a new message, discarding any unfinished one
+  void start()
+  {
+    _inMessage = true;
+    _messageLength = 0;
+    _messageStart = _current ? _current->_used : 0;
+  }
+
+  // Discard the message being assembled
+  void discard()
+  {
+    _inMessage = false;
+    _messageLength = 0;
+  }
+
+  // Append one byte to the message being assembled.  Throws
+  // std::bad_alloc if no memory is available.
+  void append(unsigned char byte)
+  {
+    if (!_current || _messageStart + _messageLength == _current->_size) {
+      grow();
+    }
+    _current->_data[_messageStart + _messageLength++] = byte;
+  }
+
+  // Finish the message being assembled.  Returns a pointer to the
+  // message bytes and the chunk that holds them.  The chunk is
+  // referenced until release() is called for it.
+  const unsigned char* finish(chunk*& owner, size_t& length)
+  {
+    if (!_current) {
+      grow();
+    }
+    owner = _current;
+    length = _messageLength;
+    const unsigned char* data = _current->_data + _messageStart;
+    _current->_used = _messageStart + _messageLength;
+    _current->_refs++;
+    _messageStart = _current->_used;
+    _messageLength = 0;
+    _inMessage = false;
+    return data;
+  }
+
+  // Release the reference to a chunk obtained by finish()
+  static void release(chunk* owner)
+  {
+    if (--owner->_refs) {
+      return;
+    }
+    sysexarena* arena = owner->_arena;
+    if (!arena) {
+      destroy(owner);
+    } else if (owner != arena->_current) {
+      arena->retire(owner);
+    } else if (!arena->_inMessage) {
+      // nobody looks at the current chunk any more, start over at
+      // the beginning
+      owner->_used = 0;
+      arena->_messageStart = 0;
+    }
+  }
+
+private:
+  size_t _chunkSize;
+  chunk* _current;
+  size_t _messageStart;
+  size_t _messageLength;
+  bool _inMessage;
+
+  // unreferenced chunks of _chunkSize available for reuse
+  std::vector<chunk*> _free;
+  // chunks that are not current but still referenced
+  std::vector<chunk*> _retired;
+
+  static chunk* create(sysexarena* arena, size_t size)
+  {
+    chunk* c = new chunk;
+    c->_data = static_cast<unsigned char*>(malloc(size));
+    if (!c->_data) {
+      delete c;
+      throw std::bad_alloc();
+    }
+    c->_arena = arena;
+    c->_size = size;
+    c->_used = 0;
+    c->_refs = 0;
+    return c;
+  }
+
+  static void destroy(chunk* c)
+  {
+    free(c->_data);
+    delete c;
+  }
+
+  // Called when the last reference to a chunk that is not the current
+  // chunk has been released.
+  void retire(chunk* c)
+  {
+    std::vector<chunk*>::iterator i = std::find(_retired.begin(), _retired.end(), c);
+    if (i != _retired.end()) {
+      _retired.erase(i);
+    }
+    if (c->_size == _chunkSize) {
+      c->_used = 0;
+      _free.push_back(c);
+    } else {
+      destroy(c);
+    }
+  }
+
+  // Move the message being assembled to a new chunk with enough space
+  void grow()
+  {
+    size_t needed = std::max((size_t) _chunkSize, 2 * (_messageLength + 1));
+    chunk* c;
+    if (needed == _chunkSize && _free.size()) {
+      c = _free.back();
+      _free.pop_back();
+    } else {
+      c = create(this, needed);
+    }
+
+    if (_current) {
+      memcpy(c->_data, _current->_data + _messageStart, _messageLength);
+      if (_current->_refs) {
+        _retired.push_back(_current);
+      } else if (_current->_size == _chunkSize) {
+        _current->_used = 0;
+        _free.push_back(_current);
+      } else {
+        destroy(_current);
+      }
+    }
+
+    _current = c;
+    _messageStart = 0;
+  }
+};
+
+#endif
@@ -0,0 +1,488 @@
+// -*- C++ -*-
+
+// Hierarchical timing wheel for scheduling values at millisecond
+// timestamps
+
+// Entries that are due within the next SLOTS milliseconds are kept in
+// the slot for their timestamp.  Later ones are kept in a second level
+// of ROTATIONS slots that hold the entries due in one rotation of the
+// wheel each, and are moved into the wheel when their rotation starts.
+// Entries due even later are kept in an overflow list that is checked
+// once per revolution of the second level.  Insertion and removal are
+// O(1), expiring costs O(1) per elapsed millisecond plus the entries
+// expired, and every entry is moved at most twice.  An occupancy bitmap lets
+// expire() skip empty slots when it needs to catch up.  Entries due
+// at the same millisecond are expired in insertion order.
+//
+// Entries may carry a tag.  All entries with the same tag are chained
+// so that they can be cancelled together.  Tag 0 means untagged.  The
+// chains are found through an open addressed hash table with linear
+// probing that is kept at most half full.
+//
+// Nodes are allocated in blocks and recycled, and the tag table only
+// grows, so the wheel only allocates when it holds more entries or
+// more distinct tags than ever before.  Timestamps are compared modulo
+// 2^32 so that wrapping clocks are handled.  The wheel is not thread
+// safe.
+
+#ifndef _timingwheel_h
+#define _timingwheel_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+template <class T>
+class timingwheel
+{
+public:
+  typedef uint32_t time_type;
+  typedef uint32_t tag_type;
+
+  timingwheel(time_type now = 0)
+    : _now(now),
+      _size(0),
+      _tagCount(0),
+      _tagBits(0),
+      _free(0)
+  {
+    memset(_heads, 0, sizeof _heads);
+    memset(_tails, 0, sizeof _tails);
+    memset(_occupied, 0, sizeof _occupied);
+  }
+
+  ~timingwheel()
+  {
+    for (size_t i = 0; i < _blocks.size(); i++) {
+      delete[] _blocks[i];
+    }
+  }
+
+  size_t size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  // Time up to which entries have been expired
+  time_type now() const { return _now; }
+
+  void insert(time_type when, const T& value, tag_type tag = 0)
+  {
+    node* n = allocate();
+    n->when = when;
+    n->value = value;
+    n->tag = tag;
+
+    link(n, before(_now, when) ? slotFor(when, _now) : (size_t) DUE_SLOT);
+
+    if (tag) {
+      node*& head = addTag(tag);
+      n->tagPrev = 0;
+      n->tagNext = head;
+      if (head) {
+        head->tagPrev = n;
+      }
+      head = n;
+    }
+    _size++;
+  }
+
+  // Stores a time at or before which the earliest entry is due in
+  // when, returns false if the wheel is empty.  The time is exact for
+  // entries due within the current rotation.  For later entries, it is
+  // the start of the rotation that holds them, at which expire() moves
+  // them into the wheel.
+  bool next(time_type& when) const
+  {
+    if (!_size) {
+      return false;
+    }
+    if (_heads[DUE_SLOT]) {
+      when = _now;
+      return true;
+    }
+    // The rotation starting at t is moved into the wheel when t expires
+    const time_type t = _now + 1;
+    if (slotOf(t) == 0 && rotationPending(rotationOf(t))) {
+      when = t;
+      return true;
+    }
+    const time_type rotationEnd = t + (SLOTS - slotOf(t)) - 1;
+    const time_type candidate = nextOccupied(t, rotationEnd);
+    if (isOccupied(slotOf(candidate))) {
+      when = candidate;
+      return true;
+    }
+    // Occupied slots before t hold entries of the next rotation
+    const time_type rotation = rotationOf(t) + 1;
+    for (size_t i = 0; i < SLOTS / 32; i++) {
+      if (_occupied[i]) {
+        when = rotation << SLOT_BITS;
+        return true;
+      }
+    }
+    for (time_type r = rotation; r != rotation + ROTATIONS; r++) {
+      if (rotationPending(r)) {
+        when = r << SLOT_BITS;
+        return true;
+      }
+    }
+    when = (rotation + ROTATIONS) << SLOT_BITS;
+    return true;
+  }
+
+  // Remove all entries with the given tag, calling dispose(value) for
+  // each.  Returns the number of entries removed.
+  template <class F>
+  size_t cancel(tag_type tag, F dispose)
+  {
+    node** head = tag ? findTag(tag) : 0;
+    if (!head) {
+      return 0;
+    }
+    size_t count = 0;
+    node* n = *head;
+    removeTag(tag);
+    while (n) {
+      node* next = n->tagNext;
+      unlink(n);
+      dispose(n->value);
+      release(n);
+      count++;
+      n = next;
+    }
+    return count;
+  }
+
+  // Call f(when, value) for every entry that is due at or before now,
+  // in the order of their timestamps.  f must not modify the wheel.
+  template <class F>
+  void expire(time_type now, F f)
+  {
+    // Entries inserted when they were already due come first
+    expireSlot(DUE_SLOT, f);
+
+    while (before(_now, now)) {
+      time_type t = _now + 1;
+      if (slotOf(t) == 0) {
+        migrate(t);
+      }
+      // Skip empty slots, but stop at the end of the rotation so that
+      // the overflow list is migrated in time.
+      const time_type rotationEnd = t + (SLOTS - slotOf(t)) - 1;
+      const time_type last = before(now, rotationEnd) ? now : rotationEnd;
+      t = nextOccupied(t, last);
+      _now = t;
+      if (isOccupied(slotOf(t))) {
+        expireSlot(slotOf(t), f);
+      }
+    }
+  }
+
+  // Remove all entries, calling dispose(value) for each
+  template <class F>
+  void clear(F dispose)
+  {
+    for (size_t slot = 0; slot < SLOT_COUNT; slot++) {
+      node* n = _heads[slot];
+      while (n) {
+        node* next = n->next;
+        dispose(n->value);
+        release(n);
+        n = next;
+      }
+      _heads[slot] = _tails[slot] = 0;
+    }
+    memset(_occupied, 0, sizeof _occupied);
+    for (size_t i = 0; i < _tags.size(); i++) {
+      _tags[i].tag = 0;
+    }
+    _tagCount = 0;
+    _size = 0;
+  }
+
+private:
+  enum {
+    SLOT_BITS = 8,
+    SLOTS = 1 << SLOT_BITS,                     // milliseconds per rotation
+    ROTATIONS = 256,                            // must be a power of two
+    OVERFLOW_SLOT = SLOTS + ROTATIONS,          // due after the last rotation
+    DUE_SLOT,                                   // inserted when already due
+    SLOT_COUNT,
+    BLOCK_SIZE = 256,
+    MINIMUM_TAG_BITS = 4
+  };
+
+  struct node {
+    time_type when;
+    tag_type tag;
+    T value;
+    size_t slot;
+    node* prev;
+    node* next;
+    node* tagPrev;
+    node* tagNext;
+  };
+
+  // Head of the chain of entries with a tag, tag 0 if unused
+  struct tagentry {
+    tag_type tag;
+    node* head;
+  };
+
+  time_type _now;
+  size_t _size;
+  node* _heads[SLOT_COUNT];
+  node* _tails[SLOT_COUNT];
+  uint32_t _occupied[SLOTS / 32];
+  std::vector<tagentry> _tags;                  // 2^_tagBits entries
+  size_t _tagCount;
+  unsigned _tagBits;
+
+  node* _free;
+  std::vector<node*> _blocks;
+
+  static bool before(time_type a, time_type b) { return (int32_t) (a - b) < 0; }
+  static size_t slotOf(time_type t) { return t & (SLOTS - 1); }
+  static time_type rotationOf(time_type t) { return t >> SLOT_BITS; }
+
+  // Slot for an entry due at when, which is not before base
+  static size_t slotFor(time_type when, time_type base)
+  {
+    if (when - base < SLOTS) {
+      return slotOf(when);
+    }
+    const time_type rotations = (rotationOf(when) - rotationOf(base)) & (~(time_type) 0 >> SLOT_BITS);
+    if (rotations < ROTATIONS) {
+      return SLOTS + (rotationOf(when) & (ROTATIONS - 1));
+    }
+    return OVERFLOW_SLOT;
+  }
+
+  // True if entries are moved into the wheel when rotation r starts
+  bool rotationPending(time_type r) const
+  {
+    return _heads[SLOTS + (r & (ROTATIONS - 1))]
+      || ((r & (ROTATIONS - 1)) == 0 && _heads[OVERFLOW_SLOT]);
+  }
+
+  bool isOccupied(size_t slot) const { return _occupied[slot / 32] & (1u << (slot % 32)); }
+  void setOccupied(size_t slot) { _occupied[slot / 32] |= 1u << (slot % 32); }
+  void clearOccupied(size_t slot) { _occupied[slot / 32] &= ~(1u << (slot % 32)); }
+
+  // Returns the first time from t to last whose slot is occupied, or
+  // last if there is none.  t and last must be in the same rotation.
+  time_type nextOccupied(time_type t, time_type last) const
+  {
+    size_t slot = slotOf(t);
+    const size_t lastSlot = slotOf(last);
+    while (slot <= lastSlot) {
+      uint32_t word = _occupied[slot / 32] >> (slot % 32);
+      if (word) {
+        slot += __builtin_ctz(word);
+        return (slot <= lastSlot) ? t + (slot - slotOf(t)) : last;
+      }
+      slot = (slot / 32 + 1) * 32;
+    }
+    return last;
+  }
+
+  // Home position of a tag in _tags, by Fibonacci hashing
+  size_t tagSlot(tag_type tag) const
+  {
+    return (uint32_t) (tag * 0x9e3779b9u) >> (32 - _tagBits);
+  }
+
+  node** findTag(tag_type tag)
+  {
+    if (!_tagCount) {
+      return 0;
+    }
+    const size_t mask = _tags.size() - 1;
+    for (size_t i = tagSlot(tag); _tags[i].tag; i = (i + 1) & mask) {
+      if (_tags[i].tag == tag) {
+        return &_tags[i].head;
+      }
+    }
+    return 0;
+  }
+
+  // Head of the chain for tag, which is created empty if needed
+  node*& addTag(tag_type tag)
+  {
+    if ((_tagCount + 1) * 2 > _tags.size()) {
+      growTags();
+    }
+    const size_t mask = _tags.size() - 1;
+    size_t i = tagSlot(tag);
+    for (; _tags[i].tag; i = (i + 1) & mask) {
+      if (_tags[i].tag == tag) {
+        return _tags[i].head;
+      }
+    }
+    _tags[i].tag = tag;
+    _tags[i].head = 0;
+    _tagCount++;
+    return _tags[i].head;
+  }
+
+  // Remove a tag that is in the table.  The entries following it in
+  // its probe sequence are shifted back so that no tombstones are
+  // needed.
+  void removeTag(tag_type tag)
+  {
+    const size_t mask = _tags.size() - 1;
+    size_t i = tagSlot(tag);
+    while (_tags[i].tag != tag) {
+      i = (i + 1) & mask;
+    }
+    for (size_t j = (i + 1) & mask; _tags[j].tag; j = (j + 1) & mask) {
+      // An entry whose home lies cyclically in (i, j] stays
+      const size_t home = tagSlot(_tags[j].tag);
+      if (((j - home) & mask) < ((j - i) & mask)) {
+        continue;
+      }
+      _tags[i] = _tags[j];
+      i = j;
+    }
+    _tags[i].tag = 0;
+    _tagCount--;
+  }
+
+  void growTags()
+  {
+    std::vector<tagentry> old;
+    old.swap(_tags);
+    _tagBits = _tagBits ? _tagBits + 1 : (unsigned) MINIMUM_TAG_BITS;
+    tagentry empty = { 0, 0 };
+    _tags.assign((size_t) 1 << _tagBits, empty);
+    _tagCount = 0;
+    for (size_t i = 0; i < old.size(); i++) {
+      if (old[i].tag) {
+        addTag(old[i].tag) = old[i].head;
+      }
+    }
+  }
+
+  node* allocate()
+  {
+    if (!_free) {
+      node* block = new node[BLOCK_SIZE];
+      _blocks.push_back(block);
+      for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        block[i].next = _free;
+        _free = &block[i];
+      }
+    }
+    node* n = _free;
+    _free = n->next;
+    return n;
+  }
+
+  void release(node* n)
+  {
+    n->value = T();
+    n->next = _free;
+    _free = n;
+  }
+
+  void link(node* n, size_t slot)
+  {
+    n->slot = slot;
+    n->next = 0;
+    n->prev = _tails[slot];
+    if (_tails[slot]) {
+      _tails[slot]->next = n;
+    } else {
+      _heads[slot] = n;
+    }
+    _tails[slot] = n;
+    if (slot < SLOTS) {
+      setOccupied(slot);
+    }
+  }
+
+  // Remove n from its slot list
+  void unlink(node* n)
+  {
+    const size_t slot = n->slot;
+    if (n->prev) {
+      n->prev->next = n->next;
+    } else {
+      _heads[slot] = n->next;
+    }
+    if (n->next) {
+      n->next->prev = n->prev;
+    } else {
+      _tails[slot] = n->prev;
+    }
+    if (!_heads[slot] && slot < SLOTS) {
+      clearOccupied(slot);
+    }
+    _size--;
+  }
+
+  // Remove n from its tag chain
+  void untag(node* n)
+  {
+    if (!n->tag) {
+      return;
+    }
+    if (n->tagNext) {
+      n->tagNext->tagPrev = n->tagPrev;
+    }
+    if (n->tagPrev) {
+      n->tagPrev->tagNext = n->tagNext;
+    } else if (n->tagNext) {
+      *findTag(n->tag) = n->tagNext;
+    } else {
+      removeTag(n->tag);
+    }
+  }
+
+  template <class F>
+  void expireSlot(size_t slot, F f)
+  {
+    node* n = _heads[slot];
+    _heads[slot] = _tails[slot] = 0;
+    if (slot < SLOTS) {
+      clearOccupied(slot);
+    }
+    while (n) {
+      node* next = n->next;
+      untag(n);
+      _size--;
+      f(n->when, n->value);
+      release(n);
+      n = next;
+    }
+  }
+
+  // Move the entries that are due in the rotation starting at t into
+  // the wheel.  When the second level starts a revolution, the
+  // overflow entries that are now within its range are moved first.
+  void migrate(time_type t)
+  {
+    if ((rotationOf(t) & (ROTATIONS - 1)) == 0) {
+      relink(OVERFLOW_SLOT, t);
+    }
+    relink(SLOTS + (rotationOf(t) & (ROTATIONS - 1)), t);
+  }
+
+  void relink(size_t slot, time_type base)
+  {
+    node* n = _heads[slot];
+    while (n) {
+      node* next = n->next;
+      const size_t target = slotFor(n->when, base);
+      if (target != slot) {
+        unlink(n);
+        _size++;
+        link(n, target);
+      }
+      n = next;
+    }
+  }
+};
+
+#endif
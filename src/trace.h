@@ -0,0 +1,235 @@
+// -*- C++ -*-
+
+// Recorder of timed events for the Chrome trace viewer
+
+// Every thread that records events writes them to a ring buffer of its
+// own, so recording does not take a lock and does not allocate once
+// the thread has recorded its first event of a trace.  When the ring
+// buffer is full, the oldest records are overwritten.  While the
+// recorder is stopped, a probe costs one test of the enabled flag.
+//
+// Events are either complete, with a start time and a duration, or
+// instant.  Each event type has a name and optionally the name of the
+// single numeric argument that its records carry.  Times are in
+// microseconds of the clock that the recorder is created with.
+//
+// write() produces the JSON object format of the trace event format
+// understood by chrome://tracing and Perfetto, with one lane per
+// thread.  Records that are written while write() runs may appear
+// torn, so the recorder should be stopped before writing the trace.
+
+#ifndef _trace_h
+#define _trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "mutex.h"
+
+class tracerecorder
+{
+public:
+  typedef int64_t (*clock_type)();
+
+  struct eventtype {
+    const char* name;
+    const char* argument;                       // 0 if the events carry no value
+  };
+
+  enum { DEFAULT_CAPACITY = 65536 };            // records per thread
+
+  tracerecorder(clock_type clock, const eventtype* types)
+    : _clock(clock),
+      _types(types),
+      _enabled(false),
+      _generation(0),
+      _capacity(DEFAULT_CAPACITY),
+      _lastThreadId(0)
+  {
+    pthread_key_create(&_key, orphan);
+  }
+
+  bool enabled() const { return _enabled; }
+
+  // Start a new trace, discarding the records of the previous one
+  void start(size_t capacity = DEFAULT_CAPACITY)
+  {
+    unique_lock<mutex> lock(_mutex);
+    for (size_t i = 0; i < _buffers.size(); ) {
+      if (_buffers[i]->orphaned) {
+        delete _buffers[i];
+        _buffers.erase(_buffers.begin() + i);
+      } else {
+        i++;
+      }
+    }
+    _capacity = capacity ? capacity : 1;
+    _generation++;
+    _enabled = true;
+  }
+
+  void stop() { _enabled = false; }
+
+  // Name the lane of the calling thread
+  void name(const char* threadName)
+  {
+    buffer* b = static_cast<buffer*>(pthread_getspecific(_key));
+    unique_lock<mutex> lock(_mutex);
+    if (!b) {
+      b = attach();
+    }
+    b->name = threadName;
+  }
+
+  // Start time for a complete event, 0 if the recorder is stopped
+  int64_t now() const { return _enabled ? _clock() : 0; }
+
+  void complete(uint16_t type, int64_t start, int64_t end, uint32_t value = 0)
+  {
+    if (_enabled) {
+      append(type, start, (uint32_t) (end - start), value);
+    }
+  }
+
+  // Complete event that ends now
+  void finish(uint16_t type, int64_t start, uint32_t value = 0)
+  {
+    if (_enabled) {
+      append(type, start, (uint32_t) (_clock() - start), value);
+    }
+  }
+
+  void instant(uint16_t type, uint32_t value = 0)
+  {
+    if (_enabled) {
+      append(type, _clock(), INSTANT, value);
+    }
+  }
+
+  void instant(uint16_t type, int64_t time, uint32_t value)
+  {
+    if (_enabled) {
+      append(type, time, INSTANT, value);
+    }
+  }
+
+  void write(std::ostream& out)
+  {
+    unique_lock<mutex> lock(_mutex);
+    const char* separator = "\n";
+    out << "{\"traceEvents\":[";
+    for (size_t i = 0; i < _buffers.size(); i++) {
+      const buffer& b = *_buffers[i];
+      out << separator
+          << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b.id
+          << ",\"args\":{\"name\":\"";
+      if (b.name.empty()) {
+        out << "thread " << b.id;
+      } else {
+        out << b.name;
+      }
+      out << "\"}}";
+      separator = ",\n";
+    }
+    for (size_t i = 0; i < _buffers.size(); i++) {
+      const buffer& b = *_buffers[i];
+      if (b.generation != _generation) {
+        continue;
+      }
+      const uint64_t written = b.written;
+      const size_t size = b.records.size();
+      for (uint64_t n = (written > size) ? written - size : 0; n < written; n++) {
+        const record& r = b.records[n % size];
+        const eventtype& type = _types[r.type];
+        out << separator
+            << "{\"name\":\"" << type.name << "\",\"cat\":\"midi\",\"pid\":1,\"tid\":" << b.id
+            << ",\"ts\":" << r.time;
+        if (r.duration == INSTANT) {
+          out << ",\"ph\":\"i\",\"s\":\"t\"";
+        } else {
+          out << ",\"ph\":\"X\",\"dur\":" << r.duration;
+        }
+        if (type.argument) {
+          out << ",\"args\":{\"" << type.argument << "\":" << r.value << "}";
+        }
+        out << "}";
+      }
+    }
+    out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  }
+
+private:
+  enum { INSTANT = 0xffffffff };
+
+  struct record {
+    int64_t time;
+    uint32_t duration;                          // INSTANT for instant events
+    uint32_t value;
+    uint16_t type;
+  };
+
+  struct buffer {
+    uint32_t id;                                // lane in the trace
+    std::string name;
+    unsigned generation;
+    std::vector<record> records;
+    volatile uint64_t written;
+    volatile bool orphaned;                     // the thread has exited
+  };
+
+  clock_type _clock;
+  const eventtype* _types;
+  volatile bool _enabled;
+  volatile unsigned _generation;
+  size_t _capacity;
+  uint32_t _lastThreadId;
+  pthread_key_t _key;
+  mutex _mutex;
+  std::vector<buffer*> _buffers;
+
+  // The buffer of an exited thread is kept until the next trace starts
+  // so that its records can still be written
+  static void orphan(void* b) { static_cast<buffer*>(b)->orphaned = true; }
+
+  // Create the buffer of the calling thread, called with _mutex held
+  buffer* attach()
+  {
+    buffer* b = new buffer;
+    b->id = ++_lastThreadId;
+    b->generation = _generation - 1;
+    b->written = 0;
+    b->orphaned = false;
+    _buffers.push_back(b);
+    pthread_setspecific(_key, b);
+    return b;
+  }
+
+  void append(uint16_t type, int64_t time, uint32_t duration, uint32_t value)
+  {
+    buffer* b = static_cast<buffer*>(pthread_getspecific(_key));
+    if (!b || b->generation != _generation) {
+      unique_lock<mutex> lock(_mutex);
+      if (!b) {
+        b = attach();
+      }
+      b->records.assign(_capacity, record());
+      b->written = 0;
+      b->generation = _generation;
+    }
+    record& r = b->records[b->written % b->records.size()];
+    r.time = time;
+    r.duration = duration;
+    r.value = value;
+    r.type = type;
+    // Publish the record before it is counted
+    __sync_synchronize();
+    b->written = b->written + 1;
+  }
+};
+
+#endif
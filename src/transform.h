@@ -0,0 +1,143 @@
+// -*- C++ -*-
+
+// Transform kernels over buffers of packed MIDI event records
+
+// A transform program is a list of operations that are applied in
+// order to every record.  Each operation is precompiled into lookup
+// tables so that the kernels do not branch on the kind of message:
+//
+// A map operation selects records by their status byte and, through a
+// second table, by their first data byte, and replaces one of the
+// three message bytes by a table lookup.  Transposition, channel
+// remapping and velocity and controller curves are all map
+// operations.  A map may drop a record by mapping its byte to DROP.
+//
+// A filter operation keeps the records whose status byte is marked in
+// its table and compacts the buffer.
+//
+// The buffer is processed in blocks that fit into the L1 cache: all
+// operations run over one block before the next one is touched, and
+// the records kept are moved down to close the gaps left by dropped
+// records.  The transformation is done in place and does not
+// allocate.  Records are left in their order.  Sysex records are
+// only affected by filters, their bytes are not moved.
+
+#ifndef _transform_h
+#define _transform_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+class transformprogram
+{
+public:
+  enum {
+    DROP = 0xff,                                // map result that drops the record
+    BLOCK_RECORDS = 256
+  };
+
+  enum field { STATUS = 0, DATA1 = 1, DATA2 = 2 };
+
+  struct operation {
+    bool filter;
+    field target;                               // byte replaced by a map
+    unsigned char statuses[256];                // records selected, or kept by a filter
+    unsigned char data1[128];                   // selection by the first data byte
+    unsigned char table[256];                   // new value of the target byte
+  };
+
+  transformprogram()
+  {
+    // Records dropped by a map have their status byte cleared
+    memset(_valid.statuses, 0, sizeof _valid.statuses);
+    memset(_valid.statuses + 0x80, 1, 0x80);
+  }
+
+  // An operation that selects all valid records and changes nothing
+  static operation identity(field target = DATA1)
+  {
+    operation op;
+    op.filter = false;
+    op.target = target;
+    memset(op.statuses, 0, 0x80);
+    memset(op.statuses + 0x80, 1, 0x80);
+    memset(op.data1, 1, sizeof op.data1);
+    for (int i = 0; i < 256; i++) {
+      op.table[i] = i;
+    }
+    return op;
+  }
+
+  void add(const operation& op) { _operations.push_back(op); }
+  size_t size() const { return _operations.size(); }
+
+  // Transform count records of recordSize bytes, in which the status
+  // and data bytes are found at statusOffset.  Returns the number of
+  // records left, which are at the start of the buffer.
+  size_t run(unsigned char* records, size_t count, size_t recordSize, size_t statusOffset) const
+  {
+    size_t kept = 0;
+    for (size_t start = 0; start < count; start += BLOCK_RECORDS) {
+      unsigned char* block = records + start * recordSize;
+      size_t n = (count - start < BLOCK_RECORDS) ? count - start : BLOCK_RECORDS;
+      bool dropping = false;
+      for (size_t i = 0; i < _operations.size(); i++) {
+        const operation& op = _operations[i];
+        if (op.filter) {
+          n = compact(block, n, recordSize, statusOffset, op.statuses);
+        } else {
+          dropping |= map(block, n, recordSize, statusOffset, op);
+        }
+      }
+      if (dropping) {
+        n = compact(block, n, recordSize, statusOffset, _valid.statuses);
+      }
+      if (kept != start) {
+        memmove(records + kept * recordSize, block, n * recordSize);
+      }
+      kept += n;
+    }
+    return kept;
+  }
+
+private:
+  std::vector<operation> _operations;
+  struct { unsigned char statuses[256]; } _valid;
+
+  // Returns true if any record has been dropped
+  static bool map(unsigned char* block, size_t n, size_t recordSize, size_t statusOffset, const operation& op)
+  {
+    unsigned char dropped = 0;
+    unsigned char* p = block + statusOffset;
+    for (size_t i = 0; i < n; i++, p += recordSize) {
+      if (op.statuses[p[0]] & op.data1[p[1] & 0x7f]) {
+        const unsigned char value = op.table[p[op.target]];
+        // Status bytes can be 0xff, data bytes cannot
+        const unsigned char drop = (value == DROP) & (op.target != STATUS);
+        dropped |= drop;
+        p[op.target] = value;
+        // A dropped record gets status 0, which is never selected
+        p[0] &= drop - 1;
+      }
+    }
+    return dropped;
+  }
+
+  static size_t compact(unsigned char* block, size_t n, size_t recordSize, size_t statusOffset, const unsigned char* keep)
+  {
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+      const unsigned char* record = block + i * recordSize;
+      if (kept != i) {
+        memcpy(block + kept * recordSize, record, recordSize);
+      }
+      kept += keep[record[statusOffset]];
+    }
+    return kept;
+  }
+};
+
+#endif
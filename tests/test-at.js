@@ -16,3 +16,18 @@ MIDI.at(baseTime + 2300, function () { console.log('three'); });
 MIDI.at(baseTime + 2200, function () { console.log('two'); });
 MIDI.at(baseTime + 2100, function () { console.log('one'); });
 
+
+var cancelled = MIDI.at(baseTime + 2150, function () { console.log('this should not be printed'); });
+console.log('cancelled pending callback:', MIDI.cancelAt(cancelled));
+console.log('cancelled again:', MIDI.cancelAt(cancelled));
+
+// Callbacks due at the same time are run in one batch
+var batchTime = baseTime + 2500;
+var batchCount = 0;
+for (var j = 0; j < 1000; j++) {
+    MIDI.at(batchTime, function (timestamp) {
+        if (++batchCount == 1000) {
+            console.log('1000 callbacks at', batchTime, 'done at', MIDI.currentTime());
+        }
+    });
+}
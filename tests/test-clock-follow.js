@@ -0,0 +1,21 @@
+var MIDI = require('MIDI');
+
+// Follow the clock of an external sequencer and print its tempo and
+// the beat position four times per second
+var input = new MIDI.MIDIInput();
+console.log('following clock on', input.portName);
+
+input.init();
+input.followClock(true, { window: 96, threshold: 0.2 });
+input.on('tempo', function (bpm) {
+    console.log('tempo', bpm.toFixed(2));
+});
+input.on('start', function () { console.log('start'); });
+input.on('stop', function () { console.log('stop'); });
+input.on('continue', function () { console.log('continue'); });
+
+setInterval(function () {
+    if (input.clockRunning()) {
+        console.log('beat', input.beatPosition().toFixed(3), 'at', input.tempo().toFixed(2), 'bpm');
+    }
+}, 250);
@@ -0,0 +1,31 @@
+var MIDI = require('MIDI');
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('opened MIDI output port', output.portName);
+
+var clock = new MIDI.MIDIClock(output, 100);
+clock.start(MIDI.currentTime() + 100);
+
+// ramp up after two seconds, stop and continue from bar 3 later
+setTimeout(function () {
+    console.log('ramping from', clock.tempo().toFixed(1), 'to 160 bpm');
+    clock.setTempo(160, 4000);
+}, 2000);
+
+var report = setInterval(function () {
+    var jitter = clock.jitter();
+    console.log('tempo', clock.tempo().toFixed(1), 'position', clock.songPosition().toFixed(2),
+                'jitter mean', jitter.mean.toFixed(3), 'stddev', jitter.stddev.toFixed(3),
+                'min', jitter.min.toFixed(3), 'max', jitter.max.toFixed(3));
+}, 1000);
+
+setTimeout(function () {
+    clock.stop();
+    clock.setSongPosition(32);
+    clock.continue(MIDI.currentTime() + 500);
+}, 8000);
+
+setTimeout(function () {
+    clock.stop();
+    clearInterval(report);
+}, 12000);
@@ -0,0 +1,19 @@
+var MIDI = require('MIDI');
+
+var midiInput = new MIDI.MIDIInput();
+console.log("opened MIDI input port", midiInput.portName);
+midiInput.setCoalescing(true);
+
+midiInput.on('controlChange', function (controller, value, channel, time) {
+    console.log('controlChange: controller', controller, 'value', value, 'channel', channel, 'time', time);
+});
+midiInput.on('pitchWheelChange', function (value, channel, time) {
+    console.log('pitchWheelChange: value', value, 'channel', channel, 'time', time);
+});
+midiInput.on('noteOn', function (pitch, velocity, channel, time) {
+    console.log('noteOn: pitch', pitch, 'velocity', velocity, 'channel', channel, 'time', time);
+});
+
+setInterval(function () {
+    console.log('coalesced:', midiInput.coalescedCounts());
+}, 5000);
@@ -0,0 +1,31 @@
+var MIDI = require('MIDI');
+
+var filename = '/tmp/test-journal.mj';
+var seconds = parseInt(process.argv[2] || '10');
+
+var input = new MIDI.MIDIInput();
+console.log('recording', input.portName, 'for', seconds, 'seconds to', filename);
+input.record(filename);
+
+setTimeout(function () {
+    console.log('recorded', input.stopRecording(), 'events');
+    input.close();
+
+    var player = new MIDI.JournalPlayer(filename);
+    console.log('journal has', player.events, 'events from', player.startTime, 'to', player.endTime);
+    if (!player.events) {
+        return;
+    }
+
+    // replay the second half at double speed
+    player.seek((player.startTime + player.endTime) / 2);
+    player.setSpeed(2);
+    var start = MIDI.currentTime();
+    player.on('message', function (message, time) {
+        console.log(time - start, MIDI.messageToString(message));
+    });
+    player.on('end', function () {
+        console.log('replay done after', MIDI.currentTime() - start, 'ms');
+    });
+    player.play();
+}, seconds * 1000);
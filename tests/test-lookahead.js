@@ -0,0 +1,31 @@
+var MIDI = require('MIDI');
+
+// Play a note on every beat with callbacks that run ahead of the beat.
+// Every few seconds, the JavaScript thread is blocked for a while to
+// simulate a garbage collection, which the adaptive lookahead should
+// absorb after the first occurrence.
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('playing to', output.portName);
+
+MIDI.setLookahead('adaptive', 5, 200);
+
+var beat = 0;
+function playBeat(time) {
+    var now = MIDI.currentTime();
+    console.log('beat', beat, 'time', time, 'called', time - now, 'ms early',
+                'lookahead', MIDI.lookahead().lookahead.toFixed(1));
+    output.send([0x90, 60, 100], time);
+    output.send([0x80, 60, 0], time + 100);
+    if (beat % 8 == 7) {
+        var until = MIDI.currentTime() + 50;
+        while (MIDI.currentTime() < until)
+            ;
+    }
+    if (++beat < 32) {
+        MIDI.at(time + 250, playBeat);
+    } else {
+        output.close();
+    }
+}
+
+MIDI.at(MIDI.currentTime() + 500, playBeat);
@@ -7,11 +7,12 @@ console.log("opened MIDI input port", midiInput.portName);
 midiInput.on('nrpn14', function (nrpn, value, channel) {
     console.log('nrpn14', nrpn, 'value', value, 'channel', channel);
 });
-try {
-    midiInput.on('nrpn7', function (nrpn, value, channel) {
-        console.log('nrpn7', nrpn, 'value', value, 'channel', channel);
-    });
-}
-catch (e) {
-    console.log("caught expected error:", e);
-}
\ No newline at end of file
+midiInput.on('nrpn7', function (nrpn, value, channel) {
+    console.log('nrpn7', nrpn, 'value', value, 'channel', channel);
+});
+midiInput.on('rpn', function (rpn, value, channel) {
+    console.log('rpn', rpn, 'value', value, 'channel', channel);
+});
+midiInput.on('cc14', function (controller, value, channel) {
+    console.log('cc14', controller, 'value', value, 'channel', channel);
+});
@@ -0,0 +1,41 @@
+var MIDI = require('MIDI');
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('opened MIDI output port', output.portName);
+
+var kick =  [ 36, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 1 ];
+var snare = [ 38, 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0 ];
+var hats =  [ 42, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 ];
+
+// one bar of sixteenths at 96 ticks per beat
+function makeEvents(specs) {
+    var events = [];
+    for (var track = 0; track < specs.length; track++) {
+        for (var i = 1; i <= 16; i++) {
+            if (specs[track][i]) {
+                events.push([ (i - 1) * 24, 0x99, specs[track][0], 127 ]);
+                events.push([ (i - 1) * 24 + 12, 0x89, specs[track][0], 0 ]);
+            }
+        }
+    }
+    return events;
+}
+
+var pattern = new MIDI.Pattern(output);
+pattern.setEvents(makeEvents([kick, snare, hats]), 16 * 24);
+pattern.setTempo(125);
+pattern.start(MIDI.currentTime() + 100);
+
+// change tempo and swing after two bars, swap the pattern after four,
+// stop after eight
+setTimeout(function () {
+    pattern.setTempo(150);
+    pattern.setSwing(0.33);
+}, 2 * 1920);
+setTimeout(function () {
+    pattern.setEvents(makeEvents([kick, hats]), 16 * 24);
+}, 4 * 1920);
+setTimeout(function () {
+    console.log('played', pattern.loopCount(), 'loops');
+    pattern.stop();
+}, 8 * 1700);
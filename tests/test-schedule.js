@@ -0,0 +1,28 @@
+var MIDI = require('MIDI');
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('opened MIDI output port', output.portName);
+
+// two voices, queued out of order
+var base = MIDI.currentTime() + 100;
+for (var i = 7; i >= 0; i--) {
+    output.noteOn(60 + i, 127, base + i * 250);
+    output.noteOn(60 + i, 0, base + i * 250 + 200);
+}
+for (var i = 0; i < 16; i++) {
+    output.send([ 0x90, 48, 100 ], base + i * 125, 1);
+    output.send([ 0x90, 48, 0 ], base + i * 125 + 60, 1);
+}
+console.log('queued', output.queueDepth(), 'messages');
+
+// stop the second voice after one second
+MIDI.at(base + 1000, function () {
+    console.log('cancelled', output.cancel(1), 'messages, queue depth now', output.queueDepth());
+});
+
+try {
+    output.send([ 0x90, 60, 127 ], base, 0);
+}
+catch (e) {
+    console.log('expected error:', e);
+}
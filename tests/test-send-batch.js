@@ -0,0 +1,26 @@
+var MIDI = require('MIDI');
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('opened MIDI output port', output.portName);
+
+// one bar of sixteenth hi-hats and a sysex message, in one batch
+var base = MIDI.currentTime() + 100;
+var sixteenth = 60000 / 120 / 4;
+var messages = [];
+for (var i = 0; i < 16; i++) {
+    messages.push([ base + i * sixteenth, 0x99, 42, 127 ]);
+    messages.push([ base + i * sixteenth + sixteenth / 2, 0x89, 42, 0 ]);
+}
+messages.push([ base + 16 * sixteenth, 0xf0, [ 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 ] ]);
+output.sendMessages(messages);
+
+// the times in a batch need not be in order
+output.sendMessages([ [ base + 20, 0x80, 60, 0 ], [ base + 10, 0x90, 60, 127 ] ]);
+console.log('sent batch with out of order times');
+
+try {
+    output.sendBatch(MIDI.packEvents([ [ 0, 0x90, 200, 127 ] ]));
+}
+catch (e) {
+    console.log('expected error:', e);
+}
@@ -0,0 +1,37 @@
+var MIDI = require('MIDI');
+
+if (process.argv.length < 3) {
+    console.log('usage: node test-smf.js file.mid [bar]');
+    process.exit(1);
+}
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('opened MIDI output port', output.portName);
+
+var player = new MIDI.SMFPlayer(output, process.argv[2]);
+console.log('format', player.format, 'tracks', player.tracks,
+            'ticks per quarter', player.ticksPerQuarter,
+            'duration', (player.duration() / 1000).toFixed(1), 's');
+
+player.on('end', function () {
+    console.log('end of file reached at tick', player.position());
+});
+
+if (process.argv.length > 3) {
+    player.seekBar(parseInt(process.argv[3]));
+    console.log('starting at bar', process.argv[3], 'tick', player.position());
+}
+player.play(MIDI.currentTime() + 100);
+
+// jump back to bar 0 after five seconds, stop and resume after ten
+setTimeout(function () {
+    console.log('seeking to bar 0');
+    player.seekBar(0);
+}, 5000);
+setTimeout(function () {
+    player.stop();
+    console.log('stopped at tick', player.position());
+    setTimeout(function () {
+        player.play();
+    }, 1000);
+}, 10000);
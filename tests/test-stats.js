@@ -0,0 +1,43 @@
+var MIDI = require('MIDI');
+
+// Send timestamped notes from an output to itself through a loopback
+// port and print the pipeline statistics every second.
+var input = new MIDI.MIDIInput();
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('receiving from', input.portName, 'sending to', output.portName);
+
+input.on('noteOn', function () {});
+input.listen();
+
+function summary(histogram) {
+    return 'n ' + histogram.count + ' p50 ' + histogram.p50 + ' p99 ' + histogram.p99 + ' max ' + histogram.max;
+}
+
+var notes = setInterval(function () {
+    var now = MIDI.currentTime();
+    for (var i = 0; i < 10; i++) {
+        output.send([0x90, 60 + i, 100], now + 10 + i * 10);
+        output.send([0x80, 60 + i, 0], now + 15 + i * 10);
+    }
+}, 100);
+
+var report = setInterval(function () {
+    var stats = MIDI.stats();
+    console.log('timer jitter', summary(stats.timer.jitter), 'overruns', stats.timer.overruns.count);
+    stats.inputs.forEach(function (input) {
+        console.log('input', input.portName, 'received', input.received,
+                    'queue', summary(input.queue), 'dispatch', summary(input.dispatch));
+    });
+    stats.outputs.forEach(function (output) {
+        console.log('output', output.portName, 'queued', output.queued, 'late', output.late,
+                    'slack', summary(output.slack));
+    });
+    MIDI.resetStats();
+}, 1000);
+
+setTimeout(function () {
+    clearInterval(notes);
+    clearInterval(report);
+    input.close();
+    output.close();
+}, 5000);
@@ -0,0 +1,31 @@
+var MIDI = require('MIDI');
+
+// Forward the lower half of the keyboard to channel 2 one octave
+// down and the upper half to channel 1, then swap the split while
+// playing
+var input = new MIDI.MIDIInput();
+var output = new MIDI.MIDIOutput();
+console.log('routing', input.portName, 'to', output.portName);
+
+var lower = input.addRoute(output, { keys: [0, 59], channel: 2, transpose: -12 });
+var upper = input.addRoute(output, { keys: [60, 127], channel: 1 });
+
+try {
+    input.addRoute(output, { types: [ 'sysex' ] });
+}
+catch (e) {
+    console.log('expectedly caught error:', e);
+}
+
+setTimeout(function () {
+    console.log('moving split point to 48');
+    input.updateRoute(lower, { keys: [0, 47], channel: 2, transpose: -12 });
+    input.updateRoute(upper, { keys: [48, 127], channel: 1, velocity: 100 });
+}, 10000);
+
+setTimeout(function () {
+    input.removeRoute(upper);
+    input.clearRoutes();
+    input.close();
+    output.close();
+}, 20000);
@@ -0,0 +1,25 @@
+var MIDI = require('MIDI');
+
+// Schedule notes and callbacks in the microsecond time base and check
+// that the callbacks are called with the microsecond times they were
+// scheduled for.
+MIDI.setTimeBase('microseconds');
+console.log('time base', MIDI.timeBase(), 'current time', MIDI.currentTime());
+
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('playing to', output.portName);
+
+var step = 0;
+function playStep(time) {
+    var now = MIDI.currentTime();
+    console.log('step', step, 'time', time, 'called', (now - time).toFixed(0), 'us late');
+    output.send([0x90, 60 + step, 100], time + 1500);
+    output.send([0x80, 60 + step, 0], time + 51500);
+    if (++step < 16) {
+        MIDI.at(time + 125250, playStep);
+    } else {
+        output.close();
+    }
+}
+
+MIDI.at(MIDI.currentTime() + 200000, playStep);
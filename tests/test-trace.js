@@ -0,0 +1,33 @@
+var MIDI = require('MIDI');
+var fs = require('fs');
+
+// Send notes from an output to itself through a loopback port while
+// tracing the pipeline, then write the trace to a file that can be
+// loaded into chrome://tracing.
+var input = new MIDI.MIDIInput();
+var output = new MIDI.MIDIOutput(undefined, 1);
+console.log('receiving from', input.portName, 'sending to', output.portName);
+
+input.on('noteOn', function () {});
+input.listen();
+
+MIDI.startTrace();
+
+var notes = setInterval(function () {
+    var now = MIDI.currentTime();
+    for (var i = 0; i < 10; i++) {
+        output.send([0x90, 60 + i, 100], now + 10 + i * 10);
+        output.send([0x80, 60 + i, 0], now + 15 + i * 10);
+    }
+    MIDI.at(now + 50, function () {});
+}, 100);
+
+setTimeout(function () {
+    clearInterval(notes);
+    MIDI.stopTrace();
+    var trace = MIDI.dumpTrace();
+    fs.writeFileSync('midi-trace.json', trace);
+    console.log('wrote', JSON.parse(trace).traceEvents.length, 'events to midi-trace.json');
+    input.close();
+    output.close();
+}, 2000);
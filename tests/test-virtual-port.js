@@ -0,0 +1,35 @@
+var MIDI = require('MIDI');
+
+// Send bursts of notes through a throttled virtual port and report how
+// long they took to arrive.  Runs without MIDI hardware.
+MIDI.createVirtualPort('virtual loopback', { throttle: true, jitter: 200, seed: 1 });
+
+var input = new MIDI.MIDIInput('virtual loopback');
+var output = new MIDI.MIDIOutput('virtual loopback');
+console.log('receiving from', input.portName, 'sending to', output.portName);
+
+var sent;
+var received = 0;
+var BURST = 100;
+
+input.on('noteOn', function (pitch, velocity, channel, time) {
+    if (++received == BURST) {
+        // 100 messages of 3 bytes take 96 ms at DIN MIDI speed
+        console.log('burst of', BURST, 'notes arrived after', time - sent, 'ms');
+        received = 0;
+    }
+});
+input.listen();
+
+var bursts = setInterval(function () {
+    sent = MIDI.currentTime();
+    for (var i = 0; i < BURST; i++) {
+        output.send([0x90, 60, 100]);
+    }
+}, 250);
+
+setTimeout(function () {
+    clearInterval(bursts);
+    input.close();
+    output.close();
+}, 2000);